@@ -0,0 +1,155 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "context.h"
+#include "files.h"
+#include "image.h"
+#include "rapidjson/pointer.h"
+#include "render.h"
+#include "simulation.h"
+
+
+namespace {
+
+struct AnimationSettings {
+  float altitude_from;  // In degree
+  float altitude_to;
+  int frame_num;
+};
+
+
+/*! @brief Parse <animation> of config, e.g. { "sun_altitude": [0, 40], "frame_num": 41 }.
+ *
+ * @return false if <animation> is missing or malformed.
+ */
+bool ParseAnimationSettings(const rapidjson::Document& d, AnimationSettings* settings) {
+  const auto* p = rapidjson::Pointer("/animation/sun_altitude").Get(d);
+  if (p == nullptr || !p->IsArray() || p->Size() != 2 || !(*p)[0].IsNumber() || !(*p)[1].IsNumber()) {
+    std::fprintf(stderr, "Config <animation.sun_altitude> cannot recognize!\n");
+    return false;
+  }
+  settings->altitude_from = static_cast<float>((*p)[0].GetDouble());
+  settings->altitude_to = static_cast<float>((*p)[1].GetDouble());
+  if (std::abs(settings->altitude_from) > 90 || std::abs(settings->altitude_to) > 90) {
+    std::fprintf(stderr, "Config <animation.sun_altitude> must be in [-90, 90]!\n");
+    return false;
+  }
+
+  p = rapidjson::Pointer("/animation/frame_num").Get(d);
+  if (p == nullptr || !p->IsInt() || p->GetInt() < 1) {
+    std::fprintf(stderr, "Config <animation.frame_num> cannot recognize!\n");
+    return false;
+  }
+  settings->frame_num = p->GetInt();
+  return true;
+}
+
+
+/*! @brief Rotate ray data about x axis, i.e. raise the sun by angle.
+ *
+ * @param angle rotation angle, in degree.
+ * @param in ray data, num x 4, [dx, dy, dz, w].
+ * @param out ray data after rotation, num x 4.
+ */
+void RotateRays(float angle, const float* in, float* out, size_t num) {
+  float c = std::cos(angle * IceHalo::Math::kDegreeToRad);
+  float s = std::sin(angle * IceHalo::Math::kDegreeToRad);
+  for (size_t i = 0; i < num; i++) {
+    const float* d = in + i * 4;
+    out[i * 4 + 0] = d[0];
+    out[i * 4 + 1] = d[1] * c - d[2] * s;
+    out[i * 4 + 2] = d[1] * s + d[2] * c;
+    out[i * 4 + 3] = d[3];
+  }
+}
+
+}  // namespace
+
+
+// Render a sequence of frames, with sun altitude going from one value to another.
+//
+// If all crystals are oriented at random over all directions, the result turns with the sun as a whole. Then rays
+// are traced only once, at the sun altitude in config, and every frame takes them rotated to its own sun. This is
+// exact, and a frame costs only a projection. Otherwise every frame is traced with its own sun.
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::printf("USAGE: %s <config-file>\n", argv[0]);
+    return -1;
+  }
+
+  auto start = std::chrono::system_clock::now();
+  rapidjson::Document d;
+  AnimationSettings settings{};
+  if (!IceHalo::ProjectContext::ReadConfigFile(argv[1], &d) || !ParseAnimationSettings(d, &settings)) {
+    return -1;
+  }
+  IceHalo::ProjectContextPtr proj_ctx = IceHalo::ProjectContext::CreateFromDocument(d, argv[1]);
+  IceHalo::Simulator simulator(proj_ctx);
+  IceHalo::SpectrumRenderer renderer(proj_ctx);
+
+  const auto wavelengths = proj_ctx->GetRoundWavelengths();
+  const float ref_altitude = proj_ctx->sun_ctx_.GetSunAltitude();
+  const bool shared_rays = proj_ctx->IsOrientationIsotropic();
+  std::printf("%d frames, %s\n", settings.frame_num,
+              shared_rays ? "rays are traced once for all frames" : "every frame is traced");
+
+  // Ray data of every wavelength, at reference sun altitude. Only for shared rays.
+  std::vector<std::vector<float>> ray_data(shared_rays ? wavelengths.size() : 0);
+  for (decltype(ray_data.size()) i = 0; i < ray_data.size(); i++) {
+    simulator.SetWavelength(wavelengths[i]);
+    simulator.Start([&](size_t /* batch_ray_num */) {
+      auto ray_num = simulator.GetFinalRaySegments().size();
+      auto offset = ray_data[i].size();
+      ray_data[i].resize(offset + ray_num * 4);
+      simulator.GetFinalDirections(ray_data[i].data() + offset);
+    });
+  }
+
+  std::vector<float> frame_data;
+  std::vector<uint8_t> rgb_data;
+  char filename[256];
+  for (int k = 0; k < settings.frame_num; k++) {
+    auto t0 = std::chrono::system_clock::now();
+    float altitude = settings.altitude_from;
+    if (settings.frame_num > 1) {
+      altitude += (settings.altitude_to - settings.altitude_from) * k / (settings.frame_num - 1);
+    }
+    proj_ctx->sun_ctx_.SetSunAltitude(altitude);
+    renderer.ResetData();
+
+    for (decltype(wavelengths.size()) i = 0; i < wavelengths.size(); i++) {
+      const auto& wl = wavelengths[i];
+      if (shared_rays) {
+        auto ray_num = ray_data[i].size() / 4;
+        frame_data.resize(ray_num * 4);
+        RotateRays(altitude - ref_altitude, ray_data[i].data(), frame_data.data(), ray_num);
+        renderer.LoadData(wl.wavelength, wl.weight, frame_data.data(), ray_num, proj_ctx->GetInitRayNum());
+      } else {
+        simulator.SetWavelength(wl);
+        simulator.Start([&](size_t batch_ray_num) {
+          auto ray_num = simulator.GetFinalRaySegments().size();
+          frame_data.resize(ray_num * 4);
+          simulator.GetFinalDirections(frame_data.data());
+          renderer.LoadData(wl.wavelength, wl.weight, frame_data.data(), ray_num, batch_ray_num);
+        });
+      }
+    }
+
+    std::snprintf(filename, sizeof(filename), "img_frame_%04d.jpg", k);
+    auto img_path = IceHalo::PathJoin(proj_ctx->GetDataDirectory(), filename);
+    if (!IceHalo::SaveImage(img_path, proj_ctx, &renderer, &rgb_data)) {
+      return -1;
+    }
+    auto t1 = std::chrono::system_clock::now();
+    std::chrono::duration<float, std::ratio<1, 1000>> diff = t1 - t0;
+    std::printf("Frame %d, sun altitude %.2f: %.2fms\n", k, altitude, diff.count());
+  }
+
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = end - start;
+  std::printf("Total: %.3fs\n", diff.count() / 1e3);
+  return 0;
+}
@@ -1,13 +1,19 @@
 #include "context.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <limits>
+#include <string>
 #include <utility>
 
 #include "optics.h"
 #include "rapidjson/error/en.h"
 #include "rapidjson/filereadstream.h"
 #include "rapidjson/pointer.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 #include "render.h"
 #include "threadingpool.h"
 
@@ -20,9 +26,11 @@ AbstractRayPathFilter::AbstractRayPathFilter()
     : symmetry_flag_(kSymmetryNone), complementary_(false), remove_homodromous_(false) {}
 
 
-bool AbstractRayPathFilter::Filter(const Crystal* crystal, RaySegment* last_r) const {
+bool AbstractRayPathFilter::Filter(const Crystal* crystal, uint32_t last_r) const {
+  auto ray_pool = RaySegmentPool::GetInstance();
+  auto first_r = ray_pool->root_ctx[last_r]->first_ray_segment;
   if (remove_homodromous_ &&
-      Math::Dot3(last_r->dir.val(), last_r->root_ctx->first_ray_segment->dir.val()) > 1.0 - 5 * Math::kFloatEps) {
+      Math::Dot3(ray_pool->GetDirection(last_r), ray_pool->GetDirection(first_r)) > 1.0 - 5 * Math::kFloatEps) {
     return false;
   }
 
@@ -95,17 +103,18 @@ size_t AbstractRayPathFilter::RayPathHash(const std::vector<uint16_t>& ray_path,
 }
 
 
-size_t AbstractRayPathFilter::RayPathHash(const Crystal* crystal,                  // used for get face number
-                                          const RaySegment* last_ray, int length,  // ray path and length
+size_t AbstractRayPathFilter::RayPathHash(const Crystal* crystal,        // used for get face number
+                                          uint32_t last_ray, int length,  // ray path and length
                                           bool reverse) const {
   constexpr size_t kStep = 7;
   constexpr size_t kTotalBits = sizeof(size_t) * CHAR_BIT;
 
+  auto ray_pool = RaySegmentPool::GetInstance();
   size_t result = 0;
   size_t curr_offset = reverse ? kStep * (length - 1) % kTotalBits : 0;
   auto p = last_ray;
-  while (p->prev) {
-    auto fn = static_cast<uint16_t>(crystal->FaceNumber(p->face_id));
+  while (ray_pool->prev[p] != RaySegmentPool::kInvalidId) {
+    auto fn = static_cast<uint16_t>(crystal->FaceNumber(ray_pool->face_id[p]));
     size_t tmp_hash = (fn << curr_offset) | (fn >> (kTotalBits - curr_offset));
     result ^= tmp_hash;
 
@@ -115,14 +124,14 @@ size_t AbstractRayPathFilter::RayPathHash(const Crystal* crystal,
       curr_offset += kStep;
     }
     curr_offset %= kTotalBits;
-    p = p->prev;
+    p = ray_pool->prev[p];
   }
 
   return result;
 }
 
 
-bool NoneRayPathFilter::FilterPath(const Crystal* /* crystal */, RaySegment* /* r */) const {
+bool NoneRayPathFilter::FilterPath(const Crystal* /* crystal */, uint32_t /* r */) const {
   return true;
 }
 
@@ -202,12 +211,13 @@ void SpecificRayPathFilter::ApplySymmetry(const Crystal* crystal) {
 }
 
 
-bool SpecificRayPathFilter::FilterPath(const Crystal* crystal, RaySegment* last_r) const {
+bool SpecificRayPathFilter::FilterPath(const Crystal* crystal, uint32_t last_r) const {
   if (ray_path_hashes_.empty()) {
     return true;
   }
 
-  int curr_fn0 = crystal->FaceNumber(last_r->root_ctx->first_ray_segment->face_id);
+  auto ray_pool = RaySegmentPool::GetInstance();
+  int curr_fn0 = crystal->FaceNumber(ray_pool->face_id[ray_pool->root_ctx[last_r]->first_ray_segment]);
   if (curr_fn0 < 0 || crystal->GetFaceNumberPeriod() < 0) {  // If do not have face number mapping.
     return true;
   }
@@ -215,12 +225,12 @@ bool SpecificRayPathFilter::FilterPath(const Crystal* crystal, RaySegment* last_
   // First, check ray path length.
   size_t curr_ray_path_len = 0;
   auto p = last_r;
-  while (p->prev) {
-    int curr_fn = crystal->FaceNumber(p->face_id);
+  while (ray_pool->prev[p] != RaySegmentPool::kInvalidId) {
+    int curr_fn = crystal->FaceNumber(ray_pool->face_id[p]);
     if (curr_fn < 0) {
       return false;
     }
-    p = p->prev;
+    p = ray_pool->prev[p];
     curr_ray_path_len++;
   }
   if (curr_ray_path_len == 0) {
@@ -267,16 +277,17 @@ void GeneralRayPathFilter::ClearHitNumbers() {
 }
 
 
-bool GeneralRayPathFilter::FilterPath(const Crystal* crystal, RaySegment* last_r) const {
+bool GeneralRayPathFilter::FilterPath(const Crystal* crystal, uint32_t last_r) const {
   if (entry_faces_.empty() && exit_faces_.empty()) {
     return true;
   }
 
+  auto ray_pool = RaySegmentPool::GetInstance();
   if (!hit_nums_.empty()) {  // Check hit number.
     auto p = last_r;
     int n = 0;
-    while (p) {
-      p = p->prev;
+    while (p != RaySegmentPool::kInvalidId) {
+      p = ray_pool->prev[p];
       n++;
     }
     if (hit_nums_.count(n) == 0) {
@@ -284,8 +295,8 @@ bool GeneralRayPathFilter::FilterPath(const Crystal* crystal, RaySegment* last_r
     }
   }
 
-  int curr_entry_fn = crystal->FaceNumber(last_r->root_ctx->first_ray_segment->face_id);
-  int curr_exit_fn = crystal->FaceNumber(last_r->face_id);
+  int curr_entry_fn = crystal->FaceNumber(ray_pool->face_id[ray_pool->root_ctx[last_r]->first_ray_segment]);
+  int curr_exit_fn = crystal->FaceNumber(ray_pool->face_id[last_r]);
   if (curr_entry_fn < 0 || curr_exit_fn < 0 ||
       crystal->GetFaceNumberPeriod() < 0) {  // If do not have a face number mapping
     return true;
@@ -470,12 +481,15 @@ void CameraContext::SetLensType(IceHalo::LensType type) {
 
 RenderContext::RenderContext()
     : ray_color_{ 1.0f, 1.0f, 1.0f }, background_color_{ 0.0f, 0.0f, 0.0f }, intensity_(1.0f), image_width_(0),
-      image_height_(0), offset_x_(0), offset_y_(0), visible_range_(VisibleRange::kUpper) {}
+      image_height_(0), offset_x_(0), offset_y_(0), visible_range_(VisibleRange::kUpper),
+      snapshot_interval_(kDefaultSnapshotInterval), checkpoint_interval_(0),
+      accumulation_mode_(AccumulationMode::kSpectrum), accumulator_type_(AccumulatorType::kDouble) {}
 
 
 constexpr float RenderContext::kMinIntensity;
 constexpr float RenderContext::kMaxIntensity;
 constexpr int RenderContext::kMaxImageSize;
+constexpr float RenderContext::kDefaultSnapshotInterval;
 
 
 const float* RenderContext::GetRayColor() const {
@@ -588,35 +602,65 @@ void RenderContext::SetVisibleRange(IceHalo::VisibleRange r) {
 }
 
 
+float RenderContext::GetSnapshotInterval() const {
+  return snapshot_interval_;
+}
+
+
+void RenderContext::SetSnapshotInterval(float interval) {
+  snapshot_interval_ = std::max(interval, 0.0f);
+}
+
+
+float RenderContext::GetCheckpointInterval() const {
+  return checkpoint_interval_;
+}
+
+
+void RenderContext::SetCheckpointInterval(float interval) {
+  checkpoint_interval_ = std::max(interval, 0.0f);
+}
+
+
+AccumulationMode RenderContext::GetAccumulationMode() const {
+  return accumulation_mode_;
+}
+
+
+void RenderContext::SetAccumulationMode(AccumulationMode mode) {
+  accumulation_mode_ = mode;
+}
+
+
+AccumulatorType RenderContext::GetAccumulatorType() const {
+  return accumulator_type_;
+}
+
+
+void RenderContext::SetAccumulatorType(AccumulatorType type) {
+  accumulator_type_ = type;
+}
+
+
 constexpr float ProjectContext::kPropMinW;
 constexpr float ProjectContext::kScatMinW;
 constexpr size_t ProjectContext::kMinInitRayNum;
 constexpr int ProjectContext::kMinRayHitNum;
 constexpr int ProjectContext::kMaxRayHitNum;
+constexpr float ProjectContext::kDefaultRouletteSurvival;
+constexpr int ProjectContext::kDefaultSpectrumSampleNum;
 
 
 std::unique_ptr<ProjectContext> ProjectContext::CreateFromFile(const char* filename) {
-  printf("Reading config from: %s\n", filename);
-
-  FILE* fp = fopen(filename, "rb");
-  if (!fp) {
-    std::fprintf(stderr, "ERROR: file %s cannot be open!\n", filename);
-    std::fclose(fp);
-    return nullptr;
-  }
-
-  constexpr size_t kTmpBufferSize = 65536;
-  char buffer[kTmpBufferSize];
-  rapidjson::FileReadStream is(fp, buffer, sizeof(buffer));
-
   rapidjson::Document d;
-  if (d.ParseStream(is).HasParseError()) {
-    std::fprintf(stderr, "\nError(offset %zu): %s\n", d.GetErrorOffset(), GetParseError_En(d.GetParseError()));
-    std::fclose(fp);
+  if (!ReadConfigFile(filename, &d)) {
     return nullptr;
   }
+  return CreateFromDocument(d, filename);
+}
 
-  fclose(fp);
+
+std::unique_ptr<ProjectContext> ProjectContext::CreateFromDocument(rapidjson::Document& d, const char* filename) {
   std::unique_ptr<ProjectContext> proj = CreateDefault();
 
   proj->ParseSunSettings(d);
@@ -627,11 +671,36 @@ std::unique_ptr<ProjectContext> ProjectContext::CreateFromFile(const char* filen
   proj->ParseCrystalSettings(d);
   proj->ParseRayPathFilterSettings(d);
   proj->ParseMultiScatterSettings(d);
+  proj->ParseStopSettings(d);
 
   return proj;
 }
 
 
+bool ProjectContext::ReadConfigFile(const char* filename, rapidjson::Document* d) {
+  printf("Reading config from: %s\n", filename);
+
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    std::fprintf(stderr, "ERROR: file %s cannot be open!\n", filename);
+    return false;
+  }
+
+  constexpr size_t kTmpBufferSize = 65536;
+  char buffer[kTmpBufferSize];
+  rapidjson::FileReadStream is(fp, buffer, sizeof(buffer));
+
+  if (d->ParseStream(is).HasParseError()) {
+    std::fprintf(stderr, "\nError(offset %zu): %s\n", d->GetErrorOffset(), GetParseError_En(d->GetParseError()));
+    std::fclose(fp);
+    return false;
+  }
+
+  fclose(fp);
+  return true;
+}
+
+
 std::unique_ptr<ProjectContext> ProjectContext::CreateDefault() {
   return std::unique_ptr<ProjectContext>(new ProjectContext());
 }
@@ -657,6 +726,16 @@ void ProjectContext::SetRayHitNum(int hit_num) {
 }
 
 
+size_t ProjectContext::GetMaxMemory() const {
+  return max_memory_;
+}
+
+
+void ProjectContext::SetMaxMemory(size_t mega_bytes) {
+  max_memory_ = mega_bytes;
+}
+
+
 std::string ProjectContext::GetModelPath() const {
   return model_path_;
 }
@@ -667,13 +746,196 @@ void ProjectContext::SetModelPath(const std::string& path) {
 }
 
 
+std::string ProjectContext::GetCrystalCacheDirectory() const {
+  return crystal_cache_path_;
+}
+
+
+void ProjectContext::SetCrystalCacheDirectory(const std::string& dir) {
+  crystal_cache_path_ = dir;
+}
+
+
 std::string ProjectContext::GetDataDirectory() const {
   return data_path_;
 }
 
 
 std::string ProjectContext::GetDefaultImagePath() const {
-  return PathJoin(data_path_, "img.jpg");
+  return PathJoin(data_path_, "img" + GetShardTag() + ".jpg");
+}
+
+
+std::string ProjectContext::GetCheckpointPath() const {
+  return PathJoin(data_path_, "checkpoint" + GetShardTag() + ".dat");
+}
+
+
+void ProjectContext::SetShard(int index, int num) {
+  if (num < 1 || index < 0 || index >= num) {
+    throw std::invalid_argument("shard index must be in [0, shard number)!");
+  }
+
+  // Split rays as evenly as possible. The shards sum up to the configured ray number.
+  auto total_ray_num = init_ray_num_ * shard_num_;
+  init_ray_num_ = total_ray_num / num + (static_cast<size_t>(index) < total_ray_num % num ? 1 : 0);
+  init_ray_num_ = std::max(init_ray_num_, static_cast<size_t>(1));
+  shard_index_ = index;
+  shard_num_ = num;
+  Math::RandomNumberGenerator::GetInstance()->SetStream(static_cast<uint32_t>(index));
+}
+
+
+int ProjectContext::GetShardIndex() const {
+  return shard_index_;
+}
+
+
+int ProjectContext::GetShardNum() const {
+  return shard_num_;
+}
+
+
+std::string ProjectContext::GetShardTag() const {
+  if (shard_num_ <= 1) {
+    return "";
+  }
+  return "_shard" + std::to_string(shard_index_) + "of" + std::to_string(shard_num_);
+}
+
+
+float ProjectContext::GetTargetNoise() const {
+  return target_noise_;
+}
+
+
+void ProjectContext::SetTargetNoise(float noise) {
+  target_noise_ = std::max(noise, 0.0f);
+}
+
+
+float ProjectContext::GetTimeBudget() const {
+  return time_budget_;
+}
+
+
+void ProjectContext::SetTimeBudget(float seconds) {
+  time_budget_ = std::max(seconds, 0.0f);
+}
+
+
+bool ProjectContext::HasStopCondition() const {
+  return target_noise_ > 0 || time_budget_ > 0;
+}
+
+
+void ProjectContext::SetRussianRoulette(float threshold, float survival) {
+  roulette_threshold_ = std::max(threshold, 0.0f);
+  roulette_survival_ = std::min(std::max(survival, kPropMinW), 1.0f);
+}
+
+
+float ProjectContext::GetRouletteThreshold() const {
+  return roulette_threshold_;
+}
+
+
+float ProjectContext::GetRouletteSurvival() const {
+  return roulette_survival_;
+}
+
+
+FresnelMode ProjectContext::GetFresnelMode() const {
+  return fresnel_mode_;
+}
+
+
+void ProjectContext::SetFresnelMode(FresnelMode mode) {
+  fresnel_mode_ = mode;
+}
+
+
+SamplingMode ProjectContext::GetSamplingMode() const {
+  return sampling_mode_;
+}
+
+
+void ProjectContext::SetSamplingMode(SamplingMode mode) {
+  sampling_mode_ = mode;
+}
+
+
+SpectrumMode ProjectContext::GetSpectrumMode() const {
+  return spectrum_mode_;
+}
+
+
+void ProjectContext::SetSpectrumMode(SpectrumMode mode) {
+  spectrum_mode_ = mode;
+}
+
+
+int ProjectContext::GetSpectrumSampleNum() const {
+  return spectrum_sample_num_;
+}
+
+
+void ProjectContext::SetSpectrumSampleNum(int num) {
+  spectrum_sample_num_ = std::max(num, 1);
+}
+
+
+std::vector<ProjectContext::WavelengthInfo> ProjectContext::GetRoundWavelengths() const {
+  if (spectrum_mode_ == SpectrumMode::kDiscrete) {
+    return wavelengths_;
+  }
+  return SampleWavelengths(Math::RandomNumberGenerator::GetInstance()->GetUniform(), spectrum_sample_num_);
+}
+
+
+// The spectrum is linear between adjacent points, so its integral up to a point in a segment is quadratic, and
+// the quantile is a root of it. The root is taken in a form that is stable for flat segments as well.
+std::vector<ProjectContext::WavelengthInfo> ProjectContext::SampleWavelengths(float u, int num) const {
+  auto points = wavelengths_;
+  std::sort(points.begin(), points.end(),
+            [](const WavelengthInfo& a, const WavelengthInfo& b) { return a.wavelength < b.wavelength; });
+  std::vector<double> cdf(points.size(), 0);
+  for (size_t i = 1; i < points.size(); i++) {
+    cdf[i] = cdf[i - 1] + (points[i - 1].weight + points[i].weight) / 2.0 *
+                              (points[i].wavelength - points[i - 1].wavelength);
+  }
+  double total = cdf.empty() ? 0 : cdf.back();
+
+  std::vector<WavelengthInfo> samples;
+  for (int k = 0; k < num; k++) {
+    double q = u + static_cast<double>(k) / num;
+    q -= std::floor(q);
+    if (total <= 0) {  // A single wavelength, or nothing to draw from.
+      samples.emplace_back(WavelengthInfo{ points.empty() ? 550.0f : points[0].wavelength, 1.0f });
+      continue;
+    }
+
+    double t = q * total;
+    auto i = static_cast<size_t>(std::upper_bound(cdf.begin(), cdf.end(), t) - cdf.begin());
+    i = std::min(std::max(i, static_cast<size_t>(1)), cdf.size() - 1) - 1;
+    double r = t - cdf[i];
+    double a = points[i].weight;
+    double b = (points[i + 1].weight - points[i].weight) / (points[i + 1].wavelength - points[i].wavelength);
+    double s = r > 0 ? 2 * r / (a + std::sqrt(std::max(a * a + 2 * b * r, 0.0))) : 0;
+    s = std::min(std::max(s, 0.0), static_cast<double>(points[i + 1].wavelength - points[i].wavelength));
+    samples.emplace_back(WavelengthInfo{ static_cast<float>(points[i].wavelength + s), 1.0f });
+  }
+  return samples;
+}
+
+
+void ProjectContext::EnableCoherentSort(bool enable) {
+  coherent_sort_ = enable;
+}
+
+
+bool ProjectContext::GetCoherentSort() const {
+  return coherent_sort_;
 }
 
 
@@ -706,6 +968,20 @@ CrystalContext* ProjectContext::GetCrystalContext(int id) const {
 }
 
 
+bool ProjectContext::IsOrientationIsotropic() const {
+  for (const auto& m : multi_scatter_info_) {
+    for (const auto& c : m.GetCrystalInfo()) {
+      auto ctx = GetCrystalContext(c.crystal_id);
+      if (c.population > 0 && ctx != nullptr && (ctx->axis.latitude_dist != Math::Distribution::kUniform ||
+                                                 ctx->axis.roll_dist != Math::Distribution::kUniform)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
 Crystal* ProjectContext::GetCrystal(int id) const {
   if (crystal_store_.count(id)) {
     return crystal_store_.at(id)->crystal.get();
@@ -751,7 +1027,11 @@ AbstractRayPathFilter* ProjectContext::GetRayPathFilter(int id) const {
 
 ProjectContext::ProjectContext()
     : sun_ctx_(SunContext::kDefaultAltitude), cam_ctx_{}, render_ctx_{}, init_ray_num_(kDefaultInitRayNum),
-      ray_hit_num_(kDefaultRayHitNum), model_path_("") {}
+      ray_hit_num_(kDefaultRayHitNum), max_memory_(0), target_noise_(0), time_budget_(0), roulette_threshold_(0),
+      roulette_survival_(kDefaultRouletteSurvival), fresnel_mode_(FresnelMode::kSplit),
+      sampling_mode_(SamplingMode::kRandom), spectrum_mode_(SpectrumMode::kDiscrete),
+      spectrum_sample_num_(kDefaultSpectrumSampleNum), coherent_sort_(false), shard_index_(0), shard_num_(1),
+      model_path_("") {}
 
 
 void ProjectContext::ParseSunSettings(rapidjson::Document& d) {
@@ -799,6 +1079,14 @@ void ProjectContext::ParseRaySettings(rapidjson::Document& d) {
     SetRayHitNum(p->GetInt());
   }
 
+  max_memory_ = 0;
+  p = Pointer("/max_memory").Get(d);
+  if (p != nullptr && !p->IsUint()) {
+    std::fprintf(stderr, "\nWARNING! Config <max_memory> is not unsigned int, ignore it!\n");
+  } else if (p != nullptr) {
+    SetMaxMemory(p->GetUint());
+  }
+
   std::vector<float> tmp_wavelengths{ 550.0f };
   auto wl_p = Pointer("/ray/wavelength").Get(d);
   if (wl_p == nullptr) {
@@ -835,7 +1123,68 @@ void ProjectContext::ParseRaySettings(rapidjson::Document& d) {
 
   wavelengths_.clear();
   for (decltype(tmp_wavelengths.size()) i = 0; i < tmp_wavelengths.size(); i++) {
-    wavelengths_.emplace_back(WavelengthInfo{ static_cast<int>(tmp_wavelengths[i]), tmp_weights[i] });
+    wavelengths_.emplace_back(WavelengthInfo{ tmp_wavelengths[i], tmp_weights[i] });
+  }
+
+  SetRussianRoulette(0, kDefaultRouletteSurvival);
+  p = Pointer("/ray/russian_roulette/threshold").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <ray.russian_roulette.threshold> is not a number, ignore it!\n");
+  } else if (p != nullptr) {
+    float threshold = static_cast<float>(p->GetDouble());
+    float survival = kDefaultRouletteSurvival;
+    p = Pointer("/ray/russian_roulette/survival").Get(d);
+    if (p != nullptr && (!p->IsNumber() || p->GetDouble() <= 0 || p->GetDouble() > 1)) {
+      std::fprintf(stderr, "\nWARNING! Config <ray.russian_roulette.survival> is not in (0, 1], using default %.1f!\n",
+                   kDefaultRouletteSurvival);
+    } else if (p != nullptr) {
+      survival = static_cast<float>(p->GetDouble());
+    }
+    SetRussianRoulette(threshold, survival);
+  }
+
+  fresnel_mode_ = FresnelMode::kSplit;
+  p = Pointer("/ray/fresnel").Get(d);
+  std::string fresnel = p != nullptr && p->IsString() ? p->GetString() : "";
+  if (fresnel == "stochastic") {
+    fresnel_mode_ = FresnelMode::kStochastic;
+  } else if (p != nullptr && fresnel != "split") {
+    std::fprintf(stderr, "\nWARNING! Config <ray.fresnel> cannot be recognized, using default split!\n");
+  }
+
+  sampling_mode_ = SamplingMode::kRandom;
+  p = Pointer("/ray/sampling").Get(d);
+  std::string sampling = p != nullptr && p->IsString() ? p->GetString() : "";
+  if (sampling == "sobol") {
+    sampling_mode_ = SamplingMode::kSobol;
+  } else if (p != nullptr && sampling != "random") {
+    std::fprintf(stderr, "\nWARNING! Config <ray.sampling> cannot be recognized, using default random!\n");
+  }
+
+  spectrum_mode_ = SpectrumMode::kDiscrete;
+  p = Pointer("/ray/spectrum").Get(d);
+  std::string spectrum = p != nullptr && p->IsString() ? p->GetString() : "";
+  if (spectrum == "continuous") {
+    spectrum_mode_ = SpectrumMode::kContinuous;
+  } else if (p != nullptr && spectrum != "discrete") {
+    std::fprintf(stderr, "\nWARNING! Config <ray.spectrum> cannot be recognized, using default discrete!\n");
+  }
+
+  spectrum_sample_num_ = kDefaultSpectrumSampleNum;
+  p = Pointer("/ray/spectrum_samples").Get(d);
+  if (p != nullptr && (!p->IsInt() || p->GetInt() < 1)) {
+    std::fprintf(stderr, "\nWARNING! Config <ray.spectrum_samples> is not a positive integer, using default %d!\n",
+                 kDefaultSpectrumSampleNum);
+  } else if (p != nullptr) {
+    SetSpectrumSampleNum(p->GetInt());
+  }
+
+  coherent_sort_ = false;
+  p = Pointer("/ray/coherent_sort").Get(d);
+  if (p != nullptr && !p->IsBool()) {
+    std::fprintf(stderr, "\nWARNING! Config <ray.coherent_sort> is not a boolean, ignore it!\n");
+  } else if (p != nullptr) {
+    EnableCoherentSort(p->GetBool());
   }
 }
 
@@ -1024,6 +1373,41 @@ void ProjectContext::ParseRenderSettings(rapidjson::Document& d) {
     float b = static_cast<float>(std::min(std::max(pa[0].GetDouble(), 0.0), 1.0));
     render_ctx_.SetRayColor(r, g, b);
   }
+
+  render_ctx_.SetSnapshotInterval(RenderContext::kDefaultSnapshotInterval);
+  p = Pointer("/render/snapshot_interval").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <render.snapshot_interval> is not a number, using default %.1f!\n",
+                 RenderContext::kDefaultSnapshotInterval);
+  } else if (p != nullptr) {
+    render_ctx_.SetSnapshotInterval(static_cast<float>(p->GetDouble()));
+  }
+
+  render_ctx_.SetCheckpointInterval(0);
+  p = Pointer("/render/checkpoint_interval").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <render.checkpoint_interval> is not a number, no checkpoint is saved!\n");
+  } else if (p != nullptr) {
+    render_ctx_.SetCheckpointInterval(static_cast<float>(p->GetDouble()));
+  }
+
+  render_ctx_.SetAccumulationMode(AccumulationMode::kSpectrum);
+  p = Pointer("/render/accumulation").Get(d);
+  std::string accumulation = p != nullptr && p->IsString() ? p->GetString() : "";
+  if (accumulation == "xyz") {
+    render_ctx_.SetAccumulationMode(AccumulationMode::kXyz);
+  } else if (p != nullptr && accumulation != "spectrum") {
+    std::fprintf(stderr, "\nWARNING! Config <render.accumulation> cannot be recognized, using default spectrum!\n");
+  }
+
+  render_ctx_.SetAccumulatorType(AccumulatorType::kDouble);
+  p = Pointer("/render/accumulator").Get(d);
+  std::string accumulator = p != nullptr && p->IsString() ? p->GetString() : "";
+  if (accumulator == "kahan") {
+    render_ctx_.SetAccumulatorType(AccumulatorType::kKahan);
+  } else if (p != nullptr && accumulator != "double") {
+    std::fprintf(stderr, "\nWARNING! Config <render.accumulator> cannot be recognized, using default double!\n");
+  }
 }
 
 
@@ -1039,6 +1423,14 @@ void ProjectContext::ParseDataSettings(const char* config_file_path, rapidjson::
   }
   data_path_ = dir;
 
+  crystal_cache_path_.clear();
+  p = Pointer("/crystal_cache").Get(d);
+  if (p != nullptr && !p->IsString()) {
+    std::fprintf(stderr, "\nWARNING! Config <crystal_cache> is not a string, ignore it!\n");
+  } else if (p != nullptr) {
+    SetCrystalCacheDirectory(p->GetString());
+  }
+
   std::string config_file_path_str(config_file_path);
   SetModelPath(PathJoin(config_file_path_str, "models"));
 }
@@ -1098,6 +1490,25 @@ void ProjectContext::ParseMultiScatterSettings(rapidjson::Document& d) {
 }
 
 
+void ProjectContext::ParseStopSettings(rapidjson::Document& d) {
+  target_noise_ = 0;
+  auto p = Pointer("/stop_condition/target_noise").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <stop_condition.target_noise> is not a number, ignore it!\n");
+  } else if (p != nullptr) {
+    SetTargetNoise(static_cast<float>(p->GetDouble()));
+  }
+
+  time_budget_ = 0;
+  p = Pointer("/stop_condition/time_budget").Get(d);
+  if (p != nullptr && !p->IsNumber()) {
+    std::fprintf(stderr, "\nWARNING! Config <stop_condition.time_budget> is not a number, ignore it!\n");
+  } else if (p != nullptr) {
+    SetTimeBudget(static_cast<float>(p->GetDouble()));
+  }
+}
+
+
 std::unordered_map<std::string, ProjectContext::CrystalParser>& ProjectContext::GetCrystalParsers() {
   static std::unordered_map<std::string, CrystalParser> crystal_parsers = {
     { "HexPrism", &ProjectContext::ParseCrystalHexPrism },
@@ -1137,7 +1548,21 @@ void ProjectContext::ParseOneCrystal(const rapidjson::Value& c, int ci) {
 
   auto axis = ParseCrystalAxis(c, ci);
   auto id = p->GetInt();
-  crystal_store_.emplace(id, new CrystalContext(crystal_parsers[type](this, c, ci), axis));
+  auto parser = crystal_parsers[type];
+  CrystalPtrU crystal;
+  p = Pointer("/parameter").Get(c);
+  if (type == "Custom" || p == nullptr) {
+    // A custom crystal is defined by a model file, which may change. It is not cached.
+    crystal = parser(this, c, ci);
+  } else {
+    // Key is the type and parameters, e.g. HexPrism:1.2
+    rapidjson::StringBuffer key_buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(key_buffer);
+    p->Accept(writer);
+    auto key = type + ":" + key_buffer.GetString();
+    crystal = CrystalCache::GetInstance()->Get(key, [&]() { return parser(this, c, ci); }, crystal_cache_path_);
+  }
+  crystal_store_.emplace(id, new CrystalContext(std::move(crystal), axis));
 }
 
 
@@ -1438,6 +1863,12 @@ CrystalPtrU ProjectContext::ParseCrystalCustom(const rapidjson::Value& c, int ci
     }
     std::fclose(file);
 
+    // Ray segments keep face ids in 16 bits. More faces would be mixed up silently.
+    if (faces.size() > static_cast<size_t>(RaySegmentPool::kMaxFaceId) + 1) {
+      std::snprintf(msg_buffer, kMsgBufferSize, "<crystal[%d].parameter> model has more than %d faces!", ci,
+                    RaySegmentPool::kMaxFaceId + 1);
+      throw std::invalid_argument(msg_buffer);
+    }
     return Crystal::CreateCustomCrystal(vertexes, faces);
   }
 }
@@ -1738,8 +2169,21 @@ void ProjectContext::ParseOneScatter(const rapidjson::Value& c, int ci) {
 CrystalContext::CrystalContext(CrystalPtrU&& g, const AxisDistribution& axis) : crystal(std::move(g)), axis(axis) {}
 
 
-RayInfo::RayInfo(RaySegment* seg, const CrystalContext* crystal_ctx, const float* main_axis_rot)
-    : first_ray_segment(seg), prev_ray_segment(nullptr), crystal_ctx(crystal_ctx),
-      main_axis_rot(main_axis_rot) {}
+RayInfo::RayInfo(uint32_t seg, const CrystalContext* crystal_ctx, const float* main_axis_mat)
+    : first_ray_segment(seg), prev_ray_segment(RaySegmentPool::kInvalidId), crystal_ctx(crystal_ctx) {
+  std::memcpy(this->main_axis_mat, main_axis_mat, sizeof(float) * 9);
+}
+
+bool ParseShardOption(const char* option, int* index, int* num) {
+  int i = 0;
+  int n = 0;
+  char tail = 0;
+  if (std::sscanf(option, "%d/%d%c", &i, &n, &tail) != 2 || n < 1 || i < 0 || i >= n) {
+    return false;
+  }
+  *index = i;
+  *num = n;
+  return true;
+}
 
 }  // namespace IceHalo
@@ -22,7 +22,6 @@
 
 namespace IceHalo {
 
-struct RaySegment;
 struct CrystalContext;
 class ProjectContext;
 enum class LensType;
@@ -31,6 +30,36 @@ enum class VisibleRange;
 using CrystalContextPtrU = std::unique_ptr<CrystalContext>;
 
 
+enum class FresnelMode {
+  kSplit,       // Trace both reflected and refracted rays, with weights split by Fresnel ratio.
+  kStochastic,  // Trace only one of them, chosen with probability of Fresnel ratio.
+};
+
+
+enum class SamplingMode {
+  kRandom,  // Sample crystal orientations and entry points independently.
+  kSobol,   // Sample them as points of an Owen-scrambled Sobol sequence, so they are well stratified.
+};
+
+
+enum class SpectrumMode {
+  kDiscrete,    // Trace every listed wavelength, with its weight.
+  kContinuous,  // Listed wavelengths and weights are samples of a spectrum. Wavelengths are drawn from it.
+};
+
+
+enum class AccumulationMode {
+  kSpectrum,  // Every wavelength has a plane of its own. Colors are computed when rendering.
+  kXyz,       // Rays are weighted by color matching functions when splatted, into X, Y, Z planes.
+};
+
+
+enum class AccumulatorType : uint8_t {
+  kKahan,   // Float sums with Kahan compensation.
+  kDouble,  // Double sums. As accurate as Kahan, with fewer operations per splat.
+};
+
+
 enum Symmetry : uint8_t {
   kSymmetryNone = 0u,
   kSymmetryPrism = 1u,
@@ -44,7 +73,7 @@ class AbstractRayPathFilter {
   AbstractRayPathFilter();
   virtual ~AbstractRayPathFilter() = default;
 
-  bool Filter(const Crystal* crystal, RaySegment* last_r) const;
+  bool Filter(const Crystal* crystal, uint32_t last_r) const;  // last_r: id in RaySegmentPool
 
   void SetSymmetryFlag(uint8_t symmetry_flag);
   void AddSymmetry(Symmetry symmetry);
@@ -59,8 +88,8 @@ class AbstractRayPathFilter {
 
  protected:
   size_t RayPathHash(const std::vector<uint16_t>& ray_path, bool reverse = false) const;
-  size_t RayPathHash(const Crystal* crystal, const RaySegment* last_ray, int length, bool reverse = false) const;
-  virtual bool FilterPath(const Crystal* crystal, RaySegment* last_r) const = 0;
+  size_t RayPathHash(const Crystal* crystal, uint32_t last_ray, int length, bool reverse = false) const;
+  virtual bool FilterPath(const Crystal* crystal, uint32_t last_r) const = 0;
 
   uint8_t symmetry_flag_;
   bool complementary_;
@@ -72,7 +101,7 @@ using RayPathFilterPtrU = std::unique_ptr<AbstractRayPathFilter>;
 
 class NoneRayPathFilter : public AbstractRayPathFilter {
  protected:
-  bool FilterPath(const Crystal* crystal, RaySegment* last_r) const override;
+  bool FilterPath(const Crystal* crystal, uint32_t last_r) const override;
 };
 
 
@@ -84,7 +113,7 @@ class SpecificRayPathFilter : public AbstractRayPathFilter {
   void ApplySymmetry(const Crystal* crystal) override;
 
  protected:
-  bool FilterPath(const Crystal* crystal, RaySegment* last_r) const override;
+  bool FilterPath(const Crystal* crystal, uint32_t last_r) const override;
 
  private:
   std::unordered_set<size_t> ray_path_hashes_;
@@ -101,7 +130,7 @@ class GeneralRayPathFilter : public AbstractRayPathFilter {
   void ClearHitNumbers();
 
  protected:
-  bool FilterPath(const Crystal* crystal, RaySegment* last_r) const override;
+  bool FilterPath(const Crystal* crystal, uint32_t last_r) const override;
 
  private:
   std::unordered_set<uint16_t> entry_faces_;
@@ -224,11 +253,24 @@ class RenderContext {
   VisibleRange GetVisibleRange() const;
   void SetVisibleRange(VisibleRange r);
 
+  float GetSnapshotInterval() const;
+  void SetSnapshotInterval(float interval);
+
+  float GetCheckpointInterval() const;
+  void SetCheckpointInterval(float interval);
+
+  AccumulationMode GetAccumulationMode() const;
+  void SetAccumulationMode(AccumulationMode mode);
+  AccumulatorType GetAccumulatorType() const;
+  void SetAccumulatorType(AccumulatorType type);
+
   static constexpr float kMinIntensity = 0.01f;
   static constexpr float kMaxIntensity = 100.0f;
 
   static constexpr int kMaxImageSize = 4096;
 
+  static constexpr float kDefaultSnapshotInterval = 5.0f;  // In seconds
+
  private:
   float ray_color_[3];
   float background_color_[3];
@@ -238,30 +280,114 @@ class RenderContext {
   int offset_x_;
   int offset_y_;
   VisibleRange visible_range_;
+  float snapshot_interval_;
+  float checkpoint_interval_;  // Non-positive means no checkpoint.
+  AccumulationMode accumulation_mode_;
+  AccumulatorType accumulator_type_;
 };
 
 
 class ProjectContext {
  public:
   struct WavelengthInfo {
-    int wavelength;
+    float wavelength;
     float weight;
   };
 
   static std::unique_ptr<ProjectContext> CreateFromFile(const char* filename);
   static std::unique_ptr<ProjectContext> CreateDefault();
 
+  /*! @brief Create a context from a parsed config.
+   *
+   * @param d the config document.
+   * @param filename path of config file. Model files are searched relative to it.
+   */
+  static std::unique_ptr<ProjectContext> CreateFromDocument(rapidjson::Document& d, const char* filename);
+
+  /*! @brief Read and parse a config file.
+   *
+   * @return false if the file cannot be read or is not valid JSON.
+   */
+  static bool ReadConfigFile(const char* filename, rapidjson::Document* d);
+
   size_t GetInitRayNum() const;
   void SetInitRayNum(size_t ray_num);
 
   int GetRayHitNum() const;
   void SetRayHitNum(int hit_num);
 
+  size_t GetMaxMemory() const;  // In MB. Zero means no limit.
+  void SetMaxMemory(size_t mega_bytes);
+
   std::string GetModelPath() const;
   void SetModelPath(const std::string& path);
 
+  std::string GetCrystalCacheDirectory() const;  // Empty if crystals are not cached into files.
+  void SetCrystalCacheDirectory(const std::string& dir);
+
   std::string GetDataDirectory() const;
   std::string GetDefaultImagePath() const;
+  std::string GetCheckpointPath() const;
+
+  /*! @brief Make this process one shard of a job split across several processes.
+   *
+   * The shard takes its share of ray number, uses an RNG stream of its own, and tags its output files.
+   *
+   * @param index shard index, in [0, num).
+   * @param num total number of shards.
+   */
+  void SetShard(int index, int num);
+  int GetShardIndex() const;
+  int GetShardNum() const;
+  std::string GetShardTag() const;  // Empty if not sharded.
+
+  float GetTargetNoise() const;
+  void SetTargetNoise(float noise);
+  float GetTimeBudget() const;
+  void SetTimeBudget(float seconds);
+  bool HasStopCondition() const;
+
+  /*! @brief Enable Russian roulette on low-weight rays inside crystals.
+   *
+   * A ray with weight below threshold survives with probability survival, and its weight is divided by
+   * survival, so the expected weight is unchanged. A non-positive threshold disables it.
+   */
+  void SetRussianRoulette(float threshold, float survival);
+  float GetRouletteThreshold() const;
+  float GetRouletteSurvival() const;
+
+  FresnelMode GetFresnelMode() const;
+  void SetFresnelMode(FresnelMode mode);
+
+  SamplingMode GetSamplingMode() const;
+  void SetSamplingMode(SamplingMode mode);
+
+  SpectrumMode GetSpectrumMode() const;
+  void SetSpectrumMode(SpectrumMode mode);
+  int GetSpectrumSampleNum() const;  // Wavelengths traced in a round, in continuous spectrum mode.
+  void SetSpectrumSampleNum(int num);
+
+  /*! @brief Wavelengths to trace in one round over the spectrum.
+   *
+   * In discrete mode they are wavelengths_. In continuous mode they are drawn anew by SampleWavelengths() at
+   * every call, with a random hero.
+   */
+  std::vector<WavelengthInfo> GetRoundWavelengths() const;
+
+  /*! @brief Draw wavelengths from the spectrum, taking wavelengths_ as samples of a piecewise linear spectrum.
+   *
+   * The hero wavelength is at quantile u of the spectrum, and companions are at u + k / num (wrapped into
+   * [0, 1)) for k = 1, ..., num - 1. So they are stratified over the spectrum. All weights are 1.
+   *
+   * @param u quantile of hero wavelength, in [0, 1).
+   * @param num number of wavelengths, including hero.
+   */
+  std::vector<WavelengthInfo> SampleWavelengths(float u, int num) const;
+
+  /*! @brief Enable sorting rays by (face, direction octant) before every hit, so adjacent rays behave alike.
+   */
+  void EnableCoherentSort(bool enable);
+  bool GetCoherentSort() const;
 
   void ClearCrystals();
   void SetCrystal(int id, CrystalPtrU&& crystal);
@@ -271,6 +397,11 @@ class ProjectContext {
   Crystal* GetCrystal(int id) const;
   void PrintCrystalInfo() const;
 
+  /*! @brief Whether all crystals in use are oriented at random over all directions, i.e. both axis and roll are
+   *         uniform. Then the result turns with the sun, and one simulation serves every sun position.
+   */
+  bool IsOrientationIsotropic() const;
+
   void ClearRayPathFilter();
   void SetRayPathFilter(int id, RayPathFilterPtrU&& filter);
   AbstractRayPathFilter* GetRayPathFilter(int id) const;
@@ -282,6 +413,8 @@ class ProjectContext {
   static constexpr int kMinRayHitNum = 1;
   static constexpr int kMaxRayHitNum = 12;
   static constexpr int kDefaultRayHitNum = 8;
+  static constexpr float kDefaultRouletteSurvival = 0.1f;
+  static constexpr int kDefaultSpectrumSampleNum = 8;
 
   SunContext sun_ctx_;
   CameraContext cam_ctx_;
@@ -300,6 +433,7 @@ class ProjectContext {
   void ParseCrystalSettings(rapidjson::Document& d);
   void ParseRayPathFilterSettings(rapidjson::Document& d);
   void ParseMultiScatterSettings(rapidjson::Document& d);
+  void ParseStopSettings(rapidjson::Document& d);
 
   using CrystalParser = std::function<CrystalPtrU(ProjectContext*, const rapidjson::Value&, int)>;
   static std::unordered_map<std::string, CrystalParser>& GetCrystalParsers();
@@ -325,8 +459,21 @@ class ProjectContext {
 
   size_t init_ray_num_;
   int ray_hit_num_;
+  size_t max_memory_;
+  float target_noise_;  // Relative standard error to stop at. Non-positive means no such limit.
+  float time_budget_;   // Wall-clock budget in seconds. Non-positive means no such limit.
+  float roulette_threshold_;  // Non-positive means no Russian roulette.
+  float roulette_survival_;
+  FresnelMode fresnel_mode_;
+  SamplingMode sampling_mode_;
+  SpectrumMode spectrum_mode_;
+  int spectrum_sample_num_;
+  bool coherent_sort_;
+  int shard_index_;
+  int shard_num_;
 
   std::string model_path_;
+  std::string crystal_cache_path_;
   std::string data_path_;
 
   std::unordered_map<int, CrystalContextPtrU> crystal_store_;
@@ -344,17 +491,24 @@ struct CrystalContext {
 
 
 struct RayInfo {
-  RayInfo(RaySegment* seg, const CrystalContext* crystal_ctx, const float* main_axis_rot);
+  RayInfo(uint32_t seg, const CrystalContext* crystal_ctx, const float* main_axis_mat);
 
-  RaySegment* first_ray_segment;
-  RaySegment* prev_ray_segment;
+  uint32_t first_ray_segment;  // Ids in RaySegmentPool
+  uint32_t prev_ray_segment;   // Exit segment of previous scattering, if any
   const CrystalContext* crystal_ctx;
-  Math::Vec3f main_axis_rot;
+  float main_axis_mat[9];  // Rotation of main axis, from Math::RotateZMatrix()
 };
 
 using RayInfoPtrU = std::unique_ptr<RayInfo>;
 using ProjectContextPtr = std::shared_ptr<ProjectContext>;
 
+
+/*! @brief Parse shard option in form of "i/N", e.g. "0/4".
+ *
+ * @return true if it is a valid shard option, i.e. 0 <= i < N.
+ */
+bool ParseShardOption(const char* option, int* index, int* num);
+
 }  // namespace IceHalo
 
 
@@ -2,20 +2,121 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
+#include <limits>
+#include <string>
 #include <utility>
 
 #include "context.h"
 
 namespace IceHalo {
 
+constexpr int PolygonBvh::kMaxLeafSize;
+constexpr int PolygonBvh::kMaxDepth;
+constexpr int Crystal::kBvhMinPolygons;
+
+namespace {
+
+constexpr uint32_t kCrystalStateMagic = 0x53524349;  // "ICRS"
+constexpr uint32_t kCrystalCacheMagic = 0x43524349;  // "ICRC"
+constexpr uint32_t kCrystalCacheVersion = 1;
+constexpr uint32_t kMaxCrystalTableSize = 1u << 24;  // Only to reject broken data.
+
+}  // namespace
+
+PolygonBvh::PolygonBvh(const float* vertexes, const int* offsets, int num) : polygon_indices_(num) {
+  std::vector<float> boxes(num * 6);
+  std::vector<float> centers(num * 3);
+  for (int i = 0; i < num; i++) {
+    polygon_indices_[i] = i;
+    for (int j = 0; j < 3; j++) {
+      boxes[i * 6 + j] = std::numeric_limits<float>::max();
+      boxes[i * 6 + 3 + j] = -std::numeric_limits<float>::max();
+      for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        boxes[i * 6 + j] = std::min(boxes[i * 6 + j], vertexes[k * 3 + j]);
+        boxes[i * 6 + 3 + j] = std::max(boxes[i * 6 + 3 + j], vertexes[k * 3 + j]);
+      }
+      centers[i * 3 + j] = (boxes[i * 6 + j] + boxes[i * 6 + 3 + j]) / 2;
+    }
+  }
+  nodes_.reserve(num * 2);
+  Build(boxes.data(), centers.data(), 0, num, 0);
+}
+
+
+const std::vector<PolygonBvh::Node>& PolygonBvh::GetNodes() const {
+  return nodes_;
+}
+
+
+const std::vector<int>& PolygonBvh::GetPolygonIndices() const {
+  return polygon_indices_;
+}
+
+
+int PolygonBvh::Build(const float* boxes, const float* centers, int start, int end, int depth) {
+  int node_idx = static_cast<int>(nodes_.size());
+  nodes_.emplace_back();
+
+  Node node{};
+  float center_min[3];
+  float center_max[3];
+  for (int j = 0; j < 3; j++) {
+    node.box_min[j] = center_min[j] = std::numeric_limits<float>::max();
+    node.box_max[j] = center_max[j] = -std::numeric_limits<float>::max();
+  }
+  for (int i = start; i < end; i++) {
+    int f = polygon_indices_[i];
+    for (int j = 0; j < 3; j++) {
+      node.box_min[j] = std::min(node.box_min[j], boxes[f * 6 + j]);
+      node.box_max[j] = std::max(node.box_max[j], boxes[f * 6 + 3 + j]);
+      center_min[j] = std::min(center_min[j], centers[f * 3 + j]);
+      center_max[j] = std::max(center_max[j], centers[f * 3 + j]);
+    }
+  }
+  // Pad the box a little, so that flat boxes (e.g. of a single axis-aligned face) are still hit robustly.
+  for (int j = 0; j < 3; j++) {
+    float pad = (node.box_max[j] - node.box_min[j]) * 1e-4f + Math::kFloatEps;
+    node.box_min[j] -= pad;
+    node.box_max[j] += pad;
+  }
+
+  int axis = 0;
+  for (int j = 1; j < 3; j++) {
+    if (center_max[j] - center_min[j] > center_max[axis] - center_min[axis]) {
+      axis = j;
+    }
+  }
+  if (end - start <= kMaxLeafSize || depth >= kMaxDepth - 1 || center_max[axis] - center_min[axis] <= 0) {
+    node.start = start;
+    node.count = end - start;
+    nodes_[node_idx] = node;
+    return node_idx;
+  }
+
+  // Split at the median of polygon centers along the widest axis.
+  int mid = (start + end) / 2;
+  std::nth_element(polygon_indices_.begin() + start, polygon_indices_.begin() + mid, polygon_indices_.begin() + end,
+                   [=](int a, int b) { return centers[a * 3 + axis] < centers[b * 3 + axis]; });
+  Build(boxes, centers, start, mid, depth + 1);
+  node.start = Build(boxes, centers, mid, end, depth + 1);
+  node.count = 0;
+  nodes_[node_idx] = node;
+  return node_idx;
+}
+
+
 Crystal::Crystal(std::vector<Math::Vec3f> vertexes,     // vertex
                  std::vector<Math::TriangleIdx> faces,  // face indices
                  CrystalType type)                      // crystal type
     : vertexes_(std::move(vertexes)), faces_(std::move(faces)), type_(type), face_number_period_(-1),
-      face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr) {
+      face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr), face_area_(nullptr),
+      polygon_max_edges_(0) {
   InitNorm();
   InitFaceNumber();
+  InitPolygons();
   switch (type_) {
     case CrystalType::kPrism:
     case CrystalType::kPyramid:
@@ -39,8 +140,32 @@ Crystal::Crystal(std::vector<IceHalo::Math::Vec3f> vertexes,     // vertex
                  CrystalType type)                               // crystal type
     : vertexes_(std::move(vertexes)), faces_(std::move(faces)), face_number_map_(std::move(face_number_map)),
       type_(type), face_number_period_(-1), face_bases_(nullptr), face_vertexes_(nullptr), face_norm_(nullptr),
-      face_area_(nullptr) {
+      face_area_(nullptr), polygon_max_edges_(0) {
   InitNorm();
+  InitPolygons();
+}
+
+
+Crystal::Crystal()
+    : type_(CrystalType::kUnknown), face_number_period_(-1), face_bases_(nullptr), face_vertexes_(nullptr),
+      face_norm_(nullptr), face_area_(nullptr), polygon_max_edges_(0) {}
+
+
+Crystal::Crystal(const Crystal& other)
+    : vertexes_(other.vertexes_), faces_(other.faces_), face_number_map_(other.face_number_map_), type_(other.type_),
+      face_number_period_(other.face_number_period_), polygon_plane_(other.polygon_plane_),
+      polygon_edge_(other.polygon_edge_), polygon_vertex_(other.polygon_vertex_),
+      polygon_edge_offset_(other.polygon_edge_offset_), polygon_face_id_(other.polygon_face_id_),
+      polygon_max_edges_(other.polygon_max_edges_), bvh_(other.bvh_ ? new PolygonBvh(*other.bvh_) : nullptr) {
+  auto face_num = faces_.size();
+  face_bases_ = new float[face_num * 6];
+  face_vertexes_ = new float[face_num * 9];
+  face_norm_ = new float[face_num * 3];
+  face_area_ = new float[face_num];
+  std::memcpy(face_bases_, other.face_bases_, sizeof(float) * face_num * 6);
+  std::memcpy(face_vertexes_, other.face_vertexes_, sizeof(float) * face_num * 9);
+  std::memcpy(face_norm_, other.face_norm_, sizeof(float) * face_num * 3);
+  std::memcpy(face_area_, other.face_area_, sizeof(float) * face_num);
 }
 
 
@@ -92,6 +217,155 @@ int Crystal::GetFaceNumberPeriod() const {
 }
 
 
+int Crystal::TotalPolygons() const {
+  return static_cast<int>(polygon_face_id_.size());
+}
+
+
+const float* Crystal::GetPolygonPlane() const {
+  return polygon_plane_.data();
+}
+
+
+const float* Crystal::GetPolygonEdge() const {
+  return polygon_edge_.data();
+}
+
+
+const float* Crystal::GetPolygonVertex() const {
+  return polygon_vertex_.data();
+}
+
+
+const int* Crystal::GetPolygonEdgeOffset() const {
+  return polygon_edge_offset_.data();
+}
+
+
+const int* Crystal::GetPolygonFaceId() const {
+  return polygon_face_id_.data();
+}
+
+
+int Crystal::GetPolygonMaxEdges() const {
+  return polygon_max_edges_;
+}
+
+
+const PolygonBvh* Crystal::GetBvh() const {
+  return bvh_.get();
+}
+
+
+CrystalPtrU Crystal::Clone() const {
+  return std::unique_ptr<Crystal>(new Crystal(*this));
+}
+
+
+bool Crystal::SaveState(File& file) const {
+  auto vertex_num = static_cast<uint32_t>(vertexes_.size());
+  auto face_num = static_cast<uint32_t>(faces_.size());
+  auto map_num = static_cast<uint32_t>(face_number_map_.size());
+  auto polygon_num = static_cast<uint32_t>(polygon_face_id_.size());
+  auto edge_num = static_cast<uint32_t>(polygon_vertex_.size() / 3);
+
+  bool ok = file.Write(kCrystalStateMagic) == 1 && file.Write(static_cast<int32_t>(type_)) == 1;
+  ok = ok && file.Write(static_cast<int32_t>(face_number_period_)) == 1;
+  ok = ok && file.Write(static_cast<int32_t>(polygon_max_edges_)) == 1;
+  ok = ok && file.Write(vertex_num) == 1 && file.Write(face_num) == 1 && file.Write(map_num) == 1;
+  ok = ok && file.Write(polygon_num) == 1 && file.Write(edge_num) == 1;
+  for (const auto& v : vertexes_) {
+    ok = ok && file.Write(v.val(), 3) == 3;
+  }
+  for (const auto& f : faces_) {
+    ok = ok && file.Write(f.idx(), 3) == 3;
+  }
+  ok = ok && file.Write(face_number_map_.data(), map_num) == map_num;
+  ok = ok && file.Write(face_bases_, face_num * 6) == face_num * 6;
+  ok = ok && file.Write(face_vertexes_, face_num * 9) == face_num * 9;
+  ok = ok && file.Write(face_norm_, face_num * 3) == face_num * 3;
+  ok = ok && file.Write(face_area_, face_num) == face_num;
+  ok = ok && file.Write(polygon_plane_.data(), polygon_num * 4) == polygon_num * 4;
+  ok = ok && file.Write(polygon_edge_.data(), edge_num * 4) == edge_num * 4;
+  ok = ok && file.Write(polygon_vertex_.data(), edge_num * 3) == edge_num * 3;
+  ok = ok && file.Write(polygon_edge_offset_.data(), polygon_num + 1) == polygon_num + 1;
+  ok = ok && file.Write(polygon_face_id_.data(), polygon_num) == polygon_num;
+  return ok;
+}
+
+
+CrystalPtrU Crystal::LoadState(File& file) {
+  uint32_t magic = 0;
+  int32_t type = 0;
+  int32_t period = 0;
+  int32_t max_edges = 0;
+  uint32_t vertex_num = 0;
+  uint32_t face_num = 0;
+  uint32_t map_num = 0;
+  uint32_t polygon_num = 0;
+  uint32_t edge_num = 0;
+  bool ok = file.Read(&magic) == 1 && magic == kCrystalStateMagic && file.Read(&type) == 1 &&
+            file.Read(&period) == 1 && file.Read(&max_edges) == 1;
+  ok = ok && file.Read(&vertex_num) == 1 && file.Read(&face_num) == 1 && file.Read(&map_num) == 1;
+  ok = ok && file.Read(&polygon_num) == 1 && file.Read(&edge_num) == 1;
+  if (!ok || vertex_num > kMaxCrystalTableSize || face_num > kMaxCrystalTableSize || map_num > face_num ||
+      polygon_num > face_num || edge_num > kMaxCrystalTableSize) {
+    return nullptr;
+  }
+
+  std::unique_ptr<Crystal> crystal(new Crystal());
+  crystal->type_ = static_cast<CrystalType>(type);
+  crystal->face_number_period_ = period;
+  crystal->polygon_max_edges_ = max_edges;
+
+  float v_buf[3];
+  for (uint32_t i = 0; ok && i < vertex_num; i++) {
+    ok = file.Read(v_buf, 3) == 3;
+    crystal->vertexes_.emplace_back(v_buf);
+  }
+  int f_buf[3];
+  for (uint32_t i = 0; ok && i < face_num; i++) {
+    ok = file.Read(f_buf, 3) == 3;
+    for (auto idx : f_buf) {
+      ok = ok && idx >= 0 && static_cast<uint32_t>(idx) < vertex_num;
+    }
+    crystal->faces_.emplace_back(f_buf[0], f_buf[1], f_buf[2]);
+  }
+
+  crystal->face_number_map_.resize(map_num);
+  crystal->face_bases_ = new float[face_num * 6];
+  crystal->face_vertexes_ = new float[face_num * 9];
+  crystal->face_norm_ = new float[face_num * 3];
+  crystal->face_area_ = new float[face_num];
+  crystal->polygon_plane_.resize(polygon_num * 4);
+  crystal->polygon_edge_.resize(edge_num * 4);
+  crystal->polygon_vertex_.resize(edge_num * 3);
+  crystal->polygon_edge_offset_.resize(polygon_num + 1);
+  crystal->polygon_face_id_.resize(polygon_num);
+  ok = ok && file.Read(crystal->face_number_map_.data(), map_num) == map_num;
+  ok = ok && file.Read(crystal->face_bases_, face_num * 6) == face_num * 6;
+  ok = ok && file.Read(crystal->face_vertexes_, face_num * 9) == face_num * 9;
+  ok = ok && file.Read(crystal->face_norm_, face_num * 3) == face_num * 3;
+  ok = ok && file.Read(crystal->face_area_, face_num) == face_num;
+  ok = ok && file.Read(crystal->polygon_plane_.data(), polygon_num * 4) == polygon_num * 4;
+  ok = ok && file.Read(crystal->polygon_edge_.data(), edge_num * 4) == edge_num * 4;
+  ok = ok && file.Read(crystal->polygon_vertex_.data(), edge_num * 3) == edge_num * 3;
+  ok = ok && file.Read(crystal->polygon_edge_offset_.data(), polygon_num + 1) == polygon_num + 1;
+  ok = ok && file.Read(crystal->polygon_face_id_.data(), polygon_num) == polygon_num;
+  ok = ok && crystal->polygon_edge_offset_.front() == 0 &&
+       crystal->polygon_edge_offset_.back() == static_cast<int>(edge_num);
+  if (!ok) {
+    return nullptr;
+  }
+
+  if (crystal->TotalPolygons() >= kBvhMinPolygons) {
+    crystal->bvh_.reset(new PolygonBvh(crystal->polygon_vertex_.data(), crystal->polygon_edge_offset_.data(),
+                                       crystal->TotalPolygons()));
+  }
+  return crystal;
+}
+
+
 CrystalType Crystal::GetType() const {
   return type_;
 }
@@ -141,6 +415,127 @@ void Crystal::InitNorm() {
   }
 }
 
+
+void Crystal::InitPolygons() {
+  auto face_num = static_cast<int>(faces_.size());
+  float scale = Math::kFloatEps;
+  for (const auto& v : vertexes_) {
+    scale = std::max({ scale, std::abs(v.x()), std::abs(v.y()), std::abs(v.z()) });
+  }
+  const float tol = scale * 1e-5f;
+
+  polygon_plane_.clear();
+  polygon_edge_.clear();
+  polygon_vertex_.clear();
+  polygon_edge_offset_.assign(1, 0);
+  polygon_face_id_.clear();
+  polygon_max_edges_ = 0;
+
+  // Add a convex polygon, given its vertexes in counter-clockwise order around its normal.
+  auto add_polygon = [&](int face_id, std::vector<Math::Vec3f> pts) {
+    // Drop (nearly) repeated vertexes, which would make degenerated edges.
+    for (size_t k = pts.size(); k-- > 0 && pts.size() > 3;) {
+      if (Math::DiffNorm3(pts[k].val(), pts[(k + 1) % pts.size()].val()) < tol) {
+        pts.erase(pts.begin() + k);
+      }
+    }
+    const float* n = face_norm_ + face_id * 3;
+    polygon_plane_.insert(polygon_plane_.end(), { n[0], n[1], n[2], Math::Dot3(n, face_vertexes_ + face_id * 9) });
+    auto edge_num = static_cast<int>(pts.size());
+    for (int k = 0; k < edge_num; k++) {
+      float e[3];
+      float m[3];
+      Math::Vec3FromTo(pts[k].val(), pts[(k + 1) % edge_num].val(), e);
+      Math::Cross3(n, e, m);  // Points inwards
+      Math::Normalize3(m);
+      polygon_edge_.insert(polygon_edge_.end(), { m[0], m[1], m[2], Math::Dot3(m, pts[k].val()) });
+      polygon_vertex_.insert(polygon_vertex_.end(), { pts[k].x(), pts[k].y(), pts[k].z() });
+    }
+    polygon_edge_offset_.emplace_back(polygon_edge_offset_.back() + edge_num);
+    polygon_face_id_.emplace_back(face_id);
+    polygon_max_edges_ = std::max(polygon_max_edges_, edge_num);
+  };
+
+  std::vector<bool> used(face_num, false);
+  for (int i = 0; i < face_num; i++) {
+    if (used[i]) {
+      continue;
+    }
+    used[i] = true;
+    const float* n = face_norm_ + i * 3;
+    if (std::isnan(n[0]) || face_area_[i] <= 0) {
+      continue;  // Never hit.
+    }
+
+    std::vector<int> group{ i };
+    float d = Math::Dot3(n, face_vertexes_ + i * 9);
+    for (int j = i + 1; j < face_num; j++) {
+      if (!used[j] && FaceNumber(j) == FaceNumber(i) && face_area_[j] > 0 &&
+          Math::Dot3(n, face_norm_ + j * 3) > 1 - Math::kFloatEps * 10 &&
+          std::abs(Math::Dot3(n, face_vertexes_ + j * 9) - d) < tol) {
+        group.emplace_back(j);
+      }
+    }
+
+    // Convex hull of all vertexes, in 2D coordinates (u, v) on the plane, where u x v = n.
+    float u[3];
+    float v[3];
+    Math::Normalized3(face_bases_ + i * 6, u);
+    Math::Cross3(n, u, v);
+    std::vector<std::pair<std::pair<float, float>, int>> pts2d;  // ((u, v), index of vertex)
+    float total_area = 0;
+    for (auto f : group) {
+      for (int k = 0; k < 3; k++) {
+        const float* p = face_vertexes_ + f * 9 + k * 3;
+        pts2d.emplace_back(std::make_pair(Math::Dot3(p, u), Math::Dot3(p, v)), faces_[f].idx()[k]);
+      }
+      total_area += face_area_[f];
+    }
+    std::sort(pts2d.begin(), pts2d.end());
+    auto cross = [&](size_t o, size_t a, size_t b) {
+      return (pts2d[a].first.first - pts2d[o].first.first) * (pts2d[b].first.second - pts2d[o].first.second) -
+             (pts2d[a].first.second - pts2d[o].first.second) * (pts2d[b].first.first - pts2d[o].first.first);
+    };
+    std::vector<size_t> hull;  // Andrew's monotone chain, counter-clockwise, without collinear points.
+    for (int pass = 0; pass < 2; pass++) {
+      auto lower_size = hull.size();
+      for (size_t k = 0; k < pts2d.size(); k++) {
+        size_t idx = pass == 0 ? k : pts2d.size() - 1 - k;
+        while (hull.size() >= lower_size + 2 && cross(hull[hull.size() - 2], hull.back(), idx) <= tol * tol) {
+          hull.pop_back();
+        }
+        hull.emplace_back(idx);
+      }
+      hull.pop_back();
+    }
+    float hull_area = 0;
+    for (size_t k = 0; k < hull.size(); k++) {
+      hull_area += cross(hull[0], hull[k], hull[(k + 1) % hull.size()]) / 2;
+    }
+
+    if (group.size() > 1 && hull.size() >= 3 && std::abs(hull_area - total_area) <= total_area * 1e-4f) {
+      std::vector<Math::Vec3f> pts;
+      for (auto k : hull) {
+        pts.emplace_back(vertexes_[pts2d[k].second]);
+      }
+      add_polygon(i, pts);
+      for (auto f : group) {
+        used[f] = true;
+      }
+    } else {
+      // Not a convex polygon, e.g. coplanar faces with a hole between them. Keep the triangle alone.
+      const auto* idx = faces_[i].idx();
+      add_polygon(i, { vertexes_[idx[0]], vertexes_[idx[1]], vertexes_[idx[2]] });
+    }
+  }
+
+  if (TotalPolygons() >= kBvhMinPolygons) {
+    bvh_.reset(new PolygonBvh(polygon_vertex_.data(), polygon_edge_offset_.data(), TotalPolygons()));
+  } else {
+    bvh_.reset();
+  }
+}
+
 void Crystal::InitFaceNumber() {
   switch (type_) {
     case CrystalType::kPrism:
@@ -692,4 +1087,100 @@ CrystalPtrU Crystal::CreateCustomCrystal(const std::vector<IceHalo::Math::Vec3f>
   return std::unique_ptr<Crystal>(new Crystal(pts, faces, face_number_map, CrystalType::kCustom));
 }
 
+
+CrystalCache* CrystalCache::instance_ = nullptr;
+
+CrystalCache* CrystalCache::GetInstance() {
+  if (!instance_) {
+    instance_ = new CrystalCache();
+  }
+  return instance_;
+}
+
+
+CrystalPtrU CrystalCache::Get(const std::string& key, const Builder& builder, const std::string& dir) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto it = crystals_.find(key);
+  if (it != crystals_.end()) {
+    return it->second->Clone();
+  }
+
+  auto crystal = dir.empty() ? nullptr : LoadFile(key, dir);
+  if (!crystal) {
+    crystal = builder();
+    if (!crystal) {
+      return nullptr;
+    }
+    if (!dir.empty()) {
+      SaveFile(key, dir, *crystal);
+    }
+  }
+  crystals_.emplace(key, crystal->Clone());
+  return crystal;
+}
+
+
+void CrystalCache::Clear() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  crystals_.clear();
+}
+
+
+size_t CrystalCache::Size() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return crystals_.size();
+}
+
+
+// File name is a hash of the key (64-bit FNV-1a). The key itself is also saved, in case of hash collision.
+std::string CrystalCache::GetFilePath(const std::string& key, const std::string& dir) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (auto c : key) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 0x100000001b3ull;
+  }
+  char filename[32];
+  std::snprintf(filename, sizeof(filename), "crystal_%016llx.dat", static_cast<unsigned long long>(hash));
+  return PathJoin(dir, filename);
+}
+
+
+CrystalPtrU CrystalCache::LoadFile(const std::string& key, const std::string& dir) {
+  auto path = GetFilePath(key, dir);
+  if (!FileExists(path.c_str())) {
+    return nullptr;
+  }
+
+  File file(path.c_str());
+  if (!file.Open(OpenMode::kRead | OpenMode::kBinary)) {
+    return nullptr;
+  }
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  uint32_t key_len = 0;
+  if (file.Read(&magic) != 1 || magic != kCrystalCacheMagic || file.Read(&version) != 1 ||
+      version != kCrystalCacheVersion || file.Read(&key_len) != 1 || key_len != key.size()) {
+    return nullptr;
+  }
+  std::string file_key(key_len, '\0');
+  if (file.Read(&file_key[0], key_len) != key_len || file_key != key) {
+    return nullptr;
+  }
+  return Crystal::LoadState(file);
+}
+
+
+void CrystalCache::SaveFile(const std::string& key, const std::string& dir, const Crystal& crystal) {
+  auto path = GetFilePath(key, dir);
+  bool saved = WriteFileAtomically(path, [&](File& file) {
+    bool ok = file.Write(kCrystalCacheMagic) == 1 && file.Write(kCrystalCacheVersion) == 1;
+    ok = ok && file.Write(static_cast<uint32_t>(key.size())) == 1;
+    ok = ok && file.Write(key.data(), key.size()) == key.size();
+    return ok && crystal.SaveState(file);
+  });
+  if (!saved) {
+    std::fprintf(stderr, "Failed to write crystal cache file %s!\n", path.c_str());
+  }
+}
+
 }  // namespace IceHalo
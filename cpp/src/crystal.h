@@ -1,10 +1,15 @@
 #ifndef SRC_CRYSTAL_H_
 #define SRC_CRYSTAL_H_
 
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "files.h"
 #include "mymath.h"
 
 namespace IceHalo {
@@ -18,6 +23,42 @@ enum class CrystalType {
   kCustom,
 };
 
+/*! @brief Bounding volume hierarchy over convex polygons, for finding ray intersections in sub-linear time.
+ *
+ * Nodes are stored in depth-first order. An inner node is followed by its left child, and keeps the index of its
+ * right child. A leaf keeps a range of polygon indices.
+ */
+class PolygonBvh {
+ public:
+  struct Node {
+    float box_min[3];
+    float box_max[3];
+    int start;  // Leaf: first index in polygon indices. Inner: index of right child.
+    int count;  // Leaf: number of polygons. Inner: 0.
+  };
+
+  /*! @brief Build the hierarchy.
+   *
+   * @param vertexes vertexes of all polygons, 3 floats per vertex.
+   * @param offsets vertexes of polygon i are [offsets[i], offsets[i + 1]). Must contain num + 1 values.
+   * @param num number of polygons.
+   */
+  PolygonBvh(const float* vertexes, const int* offsets, int num);
+
+  const std::vector<Node>& GetNodes() const;
+  const std::vector<int>& GetPolygonIndices() const;
+
+  static constexpr int kMaxLeafSize = 4;
+  static constexpr int kMaxDepth = 64;
+
+ private:
+  int Build(const float* boxes, const float* centers, int start, int end, int depth);
+
+  std::vector<Node> nodes_;
+  std::vector<int> polygon_indices_;
+};
+
+
 class Crystal {
  public:
   ~Crystal();
@@ -38,7 +79,42 @@ class Crystal {
   const float* GetFaceArea() const;
   int GetFaceNumberPeriod() const;
 
+  /*! @brief Polygon faces, for ray intersection.
+   *
+   * Coplanar triangles of the same face number are merged into one convex polygon when they exactly cover it,
+   * e.g. a hexagon basal face made of 4 triangles. Otherwise every triangle is a polygon of its own. Triangles are
+   * still used for sampling and export.
+   */
+  int TotalPolygons() const;
+  const float* GetPolygonPlane() const;        // 4 floats per polygon, (nx, ny, nz, d). n.x = d on the plane.
+  const float* GetPolygonEdge() const;         // 4 floats per edge, (mx, my, mz, c). m.x >= c inside.
+  const float* GetPolygonVertex() const;       // 3 floats per vertex. Edge k goes from vertex k to the next one.
+  const int* GetPolygonEdgeOffset() const;     // Edges of polygon i are [offset[i], offset[i + 1]).
+  const int* GetPolygonFaceId() const;         // A triangle within the polygon, as its face id.
+  int GetPolygonMaxEdges() const;
+
+  /*! @brief Get the BVH over polygons. It is only built for crystals with many polygons, e.g. custom ones.
+   *
+   * @return the BVH, or nullptr if there is none.
+   */
+  const PolygonBvh* GetBvh() const;
+
+  /*! @brief Make a deep copy, including face tables, polygons and BVH.
+   */
+  std::unique_ptr<Crystal> Clone() const;
+
+  /*! @brief Write all geometry tables into a binary file.
+   */
+  bool SaveState(File& file) const;
+
+  /*! @brief Read a crystal written by SaveState(). Tables are read as they are, nothing is rebuilt except BVH.
+   *
+   * @return a pointer to the crystal, or nullptr if data are broken.
+   */
+  static std::unique_ptr<Crystal> LoadState(File& file);
+
   static constexpr float kC = 1.629f;
+  static constexpr int kBvhMinPolygons = 32;  // Below this, testing all polygons is faster than traversing a BVH.
 
   /*! @brief Create a regular hexagon prism crystal
    *
@@ -146,6 +222,7 @@ class Crystal {
 
  protected:
   void InitNorm();
+  void InitPolygons();
   void InitFaceNumber();
   void InitFaceNumberHex();
   void InitFaceNumberCubic();
@@ -165,7 +242,18 @@ class Crystal {
   float* face_norm_;
   float* face_area_;
 
+  std::vector<float> polygon_plane_;
+  std::vector<float> polygon_edge_;
+  std::vector<float> polygon_vertex_;
+  std::vector<int> polygon_edge_offset_;
+  std::vector<int> polygon_face_id_;
+  int polygon_max_edges_;
+  std::unique_ptr<PolygonBvh> bvh_;
+
  private:
+  Crystal();
+  Crystal(const Crystal& other);
+
   /*! @brief Constructor, given vertexes and faces
    *
    * @param vertexes
@@ -193,6 +281,44 @@ class Crystal {
 
 using CrystalPtrU = std::unique_ptr<Crystal>;
 
+
+/*! @brief Cache of built crystals, keyed by crystal type and parameters.
+ *
+ * Building a crystal from half-spaces takes a while. Crystals are kept in memory once built, and also saved into
+ * a cache folder if one is given, so later processes with the same crystals need not build them again.
+ */
+class CrystalCache {
+ public:
+  using Builder = std::function<CrystalPtrU()>;
+
+  static CrystalCache* GetInstance();
+
+  /*! @brief Get a copy of the crystal of given key. It is built only if found neither in memory nor in folder.
+   *
+   * @param key crystal type and parameters, which must determine the crystal.
+   * @param builder builds the crystal if it is not cached.
+   * @param dir cache folder. Empty for in-memory cache only.
+   * @return a pointer to the crystal. It is what builder returns, if the crystal is built.
+   */
+  CrystalPtrU Get(const std::string& key, const Builder& builder, const std::string& dir = "");
+
+  void Clear();  // Clear in-memory cache. Files are kept.
+  size_t Size();
+
+  static std::string GetFilePath(const std::string& key, const std::string& dir);
+
+ private:
+  CrystalCache() = default;
+
+  CrystalPtrU LoadFile(const std::string& key, const std::string& dir);
+  void SaveFile(const std::string& key, const std::string& dir, const Crystal& crystal);
+
+  static CrystalCache* instance_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, CrystalPtrU> crystals_;
+};
+
 }  // namespace IceHalo
 
 
@@ -1,22 +1,184 @@
+#include <atomic>
 #include <chrono>
 #include <cstdio>
+#include <limits>
+#include <cstring>
+#include <memory>
 #include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
 
 #include "context.h"
-#include "mymath.h"
 #include "render.h"
 #include "simulation.h"
+#include "threadingpool.h"
+
+
+namespace {
+
+struct RayBatch {
+  float wavelength;
+  float weight;
+  size_t init_ray_num;            // Initial rays this batch is traced from.
+  size_t ray_num;
+  std::unique_ptr<float[]> data;  // ray_num x 4, [dx, dy, dz, w]
+  bool round_end;                 // Whether it is the last batch of a round over all wavelengths.
+  size_t total_ray_num;           // Only for round end. Total traced rays after this round.
+  std::string rng_state;          // Only for round end. RNG state after this round.
+};
+
+
+struct PipelineState {
+  std::atomic<bool> stop;
+  std::atomic<float> noise;  // Noise level after the latest complete round. Written by the render thread.
+};
+
+
+// At most this many batches are queued. The simulation thread fills one while the render thread consumes another.
+constexpr size_t kMaxQueuedBatches = 2;
+
+/*! @brief Save checkpoint into data folder, and report the time it takes.
+ */
+bool SaveCheckpoint(IceHalo::ProjectContextPtr proj_ctx, const IceHalo::SpectrumRenderer* renderer,
+                    size_t total_ray_num, const std::string& rng_state) {
+  auto t0 = std::chrono::system_clock::now();
+  if (!IceHalo::SaveCheckpoint(proj_ctx->GetCheckpointPath(), *renderer, total_ray_num, rng_state)) {
+    return false;
+  }
+
+  auto t1 = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = t1 - t0;
+  std::printf("Checkpoint (%zu rays): %.2fms\n", total_ray_num, diff.count());
+  return true;
+}
+
+
+bool LoadCheckpoint(IceHalo::ProjectContextPtr proj_ctx, IceHalo::SpectrumRenderer* renderer,
+                    size_t* total_ray_num) {
+  auto path = proj_ctx->GetCheckpointPath();
+  std::string rng_state;
+  if (!IceHalo::LoadCheckpoint(path, renderer, total_ray_num, &rng_state)) {
+    return false;
+  }
+  // A merged checkpoint has no RNG state. It can be rendered but cannot be continued.
+  if (!IceHalo::Math::RandomNumberGenerator::GetInstance()->LoadState(rng_state)) {
+    std::fprintf(stderr, "Checkpoint file %s cannot be resumed!\n", path.c_str());
+    return false;
+  }
+
+  std::printf("Resumed from checkpoint: %zu rays\n", *total_ray_num);
+  return true;
+}
+
+
+bool SaveSnapshot(IceHalo::ProjectContextPtr proj_ctx, IceHalo::SpectrumRenderer* renderer, uint8_t* rgb_data) {
+  auto t0 = std::chrono::system_clock::now();
+  renderer->RenderToRgb(rgb_data);
+
+  cv::Mat img(proj_ctx->render_ctx_.GetImageHeight(), proj_ctx->render_ctx_.GetImageWidth(), CV_8UC3, rgb_data);
+  cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
+  try {
+    cv::imwrite(proj_ctx->GetDefaultImagePath(), img);
+  } catch (cv::Exception& ex) {
+    std::fprintf(stderr, "Exception converting image to PNG format: %s\n", ex.what());
+    return false;
+  }
+
+  auto t1 = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = t1 - t0;
+  std::printf("Snapshot: %.2fms\n", diff.count());
+  return true;
+}
+
+
+/*! @brief Consume ray batches and accumulate them into the renderer. Save a snapshot image every interval.
+ *
+ * The renderer is owned by this thread only, so the simulation thread never waits for rendering or encoding,
+ * except when the queue is full.
+ */
+void RenderLoop(IceHalo::ProjectContextPtr proj_ctx, IceHalo::SpectrumRenderer* renderer,
+                IceHalo::BoundedQueue<RayBatch>* queue, PipelineState* state) {
+  auto* flat_rgb_data =
+      new uint8_t[3 * proj_ctx->render_ctx_.GetImageWidth() * proj_ctx->render_ctx_.GetImageHeight()];
+  std::chrono::duration<float> interval(proj_ctx->render_ctx_.GetSnapshotInterval());
+  std::chrono::duration<float> checkpoint_interval(proj_ctx->render_ctx_.GetCheckpointInterval());
+  bool use_checkpoint = checkpoint_interval.count() > 0;
+  auto last_snapshot = std::chrono::system_clock::now();
+  auto last_checkpoint = last_snapshot;
+  bool dirty = false;
+  bool checkpoint_dirty = false;  // Whether there is a complete round not saved into checkpoint yet.
+  RayBatch last_round_end;
+
+  RayBatch batch;
+  while (queue->Pop(&batch)) {
+    renderer->LoadData(batch.wavelength, batch.weight, batch.data.get(), batch.ray_num, batch.init_ray_num);
+    batch.data.reset();
+    dirty = true;
+    checkpoint_dirty = batch.round_end;
+    if (batch.round_end) {
+      state->noise = renderer->GetNoiseLevel();
+      last_round_end.total_ray_num = batch.total_ray_num;
+      last_round_end.rng_state = std::move(batch.rng_state);
+    }
+
+    auto t = std::chrono::system_clock::now();
+    if (t - last_snapshot >= interval) {
+      if (!SaveSnapshot(proj_ctx, renderer, flat_rgb_data)) {
+        state->stop = true;
+        queue->Close();
+        break;
+      }
+      last_snapshot = t;
+      dirty = false;
+    }
+
+    // Only a state at round end can be resumed exactly.
+    if (use_checkpoint && batch.round_end && t - last_checkpoint >= checkpoint_interval) {
+      SaveCheckpoint(proj_ctx, renderer, last_round_end.total_ray_num, last_round_end.rng_state);
+      last_checkpoint = t;
+      checkpoint_dirty = false;
+    }
+  }
+
+  if (dirty && !state->stop) {
+    SaveSnapshot(proj_ctx, renderer, flat_rgb_data);
+  }
+  if (use_checkpoint && checkpoint_dirty) {
+    SaveCheckpoint(proj_ctx, renderer, last_round_end.total_ray_num, last_round_end.rng_state);
+  }
+  delete[] flat_rgb_data;
+}
+
+}  // namespace
+
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::printf("USAGE: %s <config-file>\n", argv[0]);
+  bool resume = false;
+  int shard_index = 0;
+  int shard_num = 1;
+  bool args_ok = argc >= 2;
+  for (int i = 2; i < argc && args_ok; i++) {
+    if (std::strcmp(argv[i], "--resume") == 0) {
+      resume = true;
+    } else if (std::strcmp(argv[i], "--shard") == 0 && i + 1 < argc) {
+      args_ok = IceHalo::ParseShardOption(argv[++i], &shard_index, &shard_num);
+    } else {
+      args_ok = false;
+    }
+  }
+  if (!args_ok) {
+    std::printf("USAGE: %s <config-file> [--resume] [--shard <index>/<number>]\n", argv[0]);
     return -1;
   }
 
   auto start = std::chrono::system_clock::now();
   IceHalo::ProjectContextPtr proj_ctx = IceHalo::ProjectContext::CreateFromFile(argv[1]);
+  if (shard_num > 1) {
+    proj_ctx->SetShard(shard_index, shard_num);
+  }
   IceHalo::Simulator simulator(proj_ctx);
   IceHalo::SpectrumRenderer renderer(proj_ctx);
+  renderer.EnableNoiseEstimation(true);
 
   auto t = std::chrono::system_clock::now();
   std::chrono::duration<float, std::ratio<1, 1000>> diff = t - start;
@@ -30,55 +192,79 @@ int main(int argc, char* argv[]) {
   file.Close();
 
   size_t total_ray_num = 0;
-  auto flat_rgb_data = new uint8_t[3 * proj_ctx->render_ctx_.GetImageWidth() * proj_ctx->render_ctx_.GetImageHeight()];
-  while (true) {
-    const auto& wavelengths = proj_ctx->wavelengths_;
-    for (decltype(wavelengths.size()) i = 0; i < wavelengths.size(); i++) {
-      std::printf("starting at wavelength: %d\n", wavelengths[i].wavelength);
-      simulator.SetWavelengthIndex(i);
+  if (resume && !LoadCheckpoint(proj_ctx, &renderer, &total_ray_num)) {
+    return -1;
+  }
+  const size_t resumed_ray_num = total_ray_num;
+
+  PipelineState state;
+  state.stop = false;
+  state.noise = std::numeric_limits<float>::infinity();
+  IceHalo::BoundedQueue<RayBatch> queue(kMaxQueuedBatches);
+  std::thread render_thread(RenderLoop, proj_ctx, &renderer, &queue, &state);
+
+  float target_noise = proj_ctx->GetTargetNoise();
+  float time_budget = proj_ctx->GetTimeBudget();
+  while (!state.stop) {
+    auto wavelengths = proj_ctx->GetRoundWavelengths();
+    for (decltype(wavelengths.size()) i = 0; i < wavelengths.size() && !state.stop; i++) {
+      std::printf("starting at wavelength: %.1f\n", wavelengths[i].wavelength);
+      simulator.SetWavelength(wavelengths[i]);
 
+      // A wavelength may be traced in several batches. They are pushed to the render thread one by one.
+      bool queue_closed = false;
+      size_t traced_ray_num = 0;
       auto t0 = std::chrono::system_clock::now();
-      simulator.Start();
+      simulator.Start([&](size_t batch_ray_num) {
+        traced_ray_num += batch_ray_num;
+        if (queue_closed) {
+          return;
+        }
+
+        RayBatch batch;
+        batch.wavelength = wavelengths[i].wavelength;
+        batch.weight = wavelengths[i].weight;
+        batch.init_ray_num = batch_ray_num;
+        batch.ray_num = simulator.GetFinalRaySegments().size();
+        batch.data.reset(new float[batch.ray_num * 4]);
+        batch.round_end = i + 1 == wavelengths.size() && traced_ray_num == proj_ctx->GetInitRayNum();
+        batch.total_ray_num = total_ray_num + proj_ctx->GetInitRayNum() * wavelengths.size();
+        if (batch.round_end) {
+          batch.rng_state = IceHalo::Math::RandomNumberGenerator::GetInstance()->SaveState();
+        }
+        simulator.GetFinalDirections(batch.data.get());
+        queue_closed = !queue.Push(std::move(batch));
+      });
       auto t1 = std::chrono::system_clock::now();
       diff = t1 - t0;
       std::printf("Ray tracing: %.2fms\n", diff.count());
-
-      auto num = simulator.GetFinalRaySegments().size();
-      auto* curr_data = new float[num * 4];
-      auto* p = curr_data;
-      for (const auto& r : simulator.GetFinalRaySegments()) {
-        const auto axis_rot = r->root_ctx->main_axis_rot.val();
-        assert(r->root_ctx);
-        IceHalo::Math::RotateZBack(axis_rot, r->dir.val(), p);
-        p[3] = r->w;
-        p += 4;
+      if (queue_closed) {
+        break;
       }
-      renderer.LoadData(wavelengths[i].wavelength, wavelengths[i].weight, curr_data, num);
-      delete[] curr_data;
-    }
-
-    renderer.RenderToRgb(flat_rgb_data);
-
-    cv::Mat img(proj_ctx->render_ctx_.GetImageHeight(), proj_ctx->render_ctx_.GetImageWidth(), CV_8UC3, flat_rgb_data);
-    cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
-    try {
-      cv::imwrite(proj_ctx->GetDefaultImagePath(), img);
-    } catch (cv::Exception& ex) {
-      std::fprintf(stderr, "Exception converting image to PNG format: %s\n", ex.what());
-      break;
     }
 
     t = std::chrono::system_clock::now();
     total_ray_num += proj_ctx->GetInitRayNum() * wavelengths.size();
     diff = t - start;
+    float noise = state.noise;
     std::printf("=== Total %zu rays finished! ===\n", total_ray_num);
     std::printf("=== Spent %.3f sec!          ===\n", diff.count() / 1000);
+    std::printf("=== %.0f rays/sec, noise level %.4f ===\n", (total_ray_num - resumed_ray_num) / (diff.count() / 1000),
+                noise);
+
+    if ((target_noise > 0 && noise <= target_noise) || (time_budget > 0 && diff.count() / 1000 >= time_budget)) {
+      state.stop = true;
+    }
   }
 
+  queue.Close();
+  render_thread.join();
+
   auto end = std::chrono::system_clock::now();
   diff = end - start;
   std::printf("Total: %.3fs\n", diff.count() / 1e3);
+  std::printf("Traced %zu rays, %.0f rays/sec, achieved noise level %.4f\n", total_ray_num,
+              (total_ray_num - resumed_ray_num) / (diff.count() / 1e3), renderer.GetNoiseLevel());
 
-  delete[] flat_rgb_data;
   return 0;
-}
\ No newline at end of file
+}
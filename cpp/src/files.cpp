@@ -36,6 +36,29 @@ std::string PathJoin(const std::string& p1, const std::string& p2) {
 }
 
 
+bool RenameFile(const std::string& from, const std::string& to) {
+  boost::system::error_code ec;
+  boost::filesystem::rename(from, to, ec);
+  return !ec;
+}
+
+
+bool WriteFileAtomically(const std::string& path, const std::function<bool(File&)>& write_func) {
+  auto tmp_path = path + ".tmp-" + boost::filesystem::unique_path().string();
+  File file(tmp_path.c_str());
+  if (!file.Open(OpenMode::kWrite | OpenMode::kBinary)) {
+    return false;
+  }
+  bool ok = write_func(file);
+  file.Close();
+  if (!ok || !RenameFile(tmp_path, path)) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+
 File::File(const char* filename) : file_(nullptr), file_opened_(false), path_(filename) {}
 
 
@@ -1,6 +1,7 @@
 #ifndef SRC_FILES_H_
 #define SRC_FILES_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -84,6 +85,13 @@ std::vector<File> ListDataFiles(const char* dir);
 
 std::string PathJoin(const std::string& p1, const std::string& p2);
 
+bool RenameFile(const std::string& from, const std::string& to);  // Atomically replace target if on same disk
+
+/*! @brief Write a file by write_func into a uniquely named temporary file, then rename it to path.
+ *         Readers never see a partial file, and the temporary file is removed on failure.
+ */
+bool WriteFileAtomically(const std::string& path, const std::function<bool(File&)>& write_func);
+
 }  // namespace IceHalo
 
 #endif  // SRC_FILES_H_
@@ -0,0 +1,27 @@
+#include "image.h"
+
+#include <cstdio>
+#include <opencv2/opencv.hpp>
+
+
+namespace IceHalo {
+
+bool SaveImage(const std::string& path, ProjectContextPtr proj_ctx, SpectrumRenderer* renderer,
+               std::vector<uint8_t>* rgb_data) {
+  auto img_wid = proj_ctx->render_ctx_.GetImageWidth();
+  auto img_hei = proj_ctx->render_ctx_.GetImageHeight();
+  rgb_data->resize(3 * img_wid * img_hei);
+  renderer->RenderToRgb(rgb_data->data());
+
+  cv::Mat img(img_hei, img_wid, CV_8UC3, rgb_data->data());
+  cv::cvtColor(img, img, cv::COLOR_RGB2BGR);
+  try {
+    cv::imwrite(path, img);
+  } catch (cv::Exception& ex) {
+    std::fprintf(stderr, "Exception writing image %s: %s\n", path.c_str(), ex.what());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace IceHalo
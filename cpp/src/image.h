@@ -0,0 +1,22 @@
+#ifndef SRC_IMAGE_H_
+#define SRC_IMAGE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "context.h"
+#include "render.h"
+
+
+namespace IceHalo {
+
+/*! @brief Render to RGB and write the image to path, in the format given by its extension.
+ *         rgb_data is a buffer reused between calls.
+ */
+bool SaveImage(const std::string& path, ProjectContextPtr proj_ctx, SpectrumRenderer* renderer,
+               std::vector<uint8_t>* rgb_data);
+
+}  // namespace IceHalo
+
+#endif  // SRC_IMAGE_H_
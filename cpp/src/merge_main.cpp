@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "context.h"
+#include "files.h"
+#include "image.h"
+#include "render.h"
+
+
+namespace {
+
+struct RayFile {
+  long long timestamp;
+  std::string path;
+};
+
+
+/*! @brief Concatenate ray data files of different shards into one file, so it contains as many rays as
+ *         a single process would have traced.
+ *
+ * Files are grouped by wavelength and shard. For every wavelength, the k-th file (in time order) of every shard
+ * are merged into one file.
+ */
+int MergeRays(const char* output_dir, const std::vector<const char*>& input_dirs) {
+  namespace fs = boost::filesystem;
+
+  if (fs::exists(output_dir)) {
+    for (fs::directory_iterator it(output_dir); it != fs::directory_iterator(); ++it) {
+      if (it->path().extension() == ".bin") {
+        std::fprintf(stderr, "Output folder %s already contains ray data!\n", output_dir);
+        return -1;
+      }
+    }
+  }
+
+  // wavelength -> shard tag -> files
+  std::map<int, std::map<std::string, std::vector<RayFile>>> ray_files;
+  for (const auto& dir : input_dirs) {
+    if (!fs::is_directory(dir)) {
+      std::fprintf(stderr, "Input folder %s does not exist!\n", dir);
+      return -1;
+    }
+    for (fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+      if (it->path().extension() != ".bin") {
+        continue;
+      }
+      auto stem = it->path().stem().string();
+      int wavelength = 0;
+      long long timestamp = 0;
+      int n = 0;
+      if (std::sscanf(stem.c_str(), "directions_%d_%lld%n", &wavelength, &timestamp, &n) != 2) {
+        std::fprintf(stderr, "Skip unknown file %s\n", it->path().c_str());
+        continue;
+      }
+      ray_files[wavelength][stem.substr(n)].emplace_back(RayFile{ timestamp, it->path().string() });
+    }
+  }
+
+  for (auto& wl_files : ray_files) {
+    size_t round_num = 0;
+    for (auto& kv : wl_files.second) {
+      std::sort(kv.second.begin(), kv.second.end(),
+                [](const RayFile& a, const RayFile& b) { return a.timestamp < b.timestamp; });
+      round_num = std::max(round_num, kv.second.size());
+    }
+
+    for (size_t k = 0; k < round_num; k++) {
+      char filename[256];
+      std::snprintf(filename, sizeof(filename), "directions_%d_%zu_merged.bin", wl_files.first, k);
+      IceHalo::File out(output_dir, filename);
+      if (!out.Open(IceHalo::OpenMode::kWrite | IceHalo::OpenMode::kBinary)) {
+        std::fprintf(stderr, "Cannot create file %s!\n", filename);
+        return -1;
+      }
+
+      bool header_written = false;
+      size_t total_ray_num = 0;
+      for (const auto& kv : wl_files.second) {
+        if (k >= kv.second.size()) {
+          continue;
+        }
+        IceHalo::File in(kv.second[k].path.c_str());
+        auto value_num = in.GetSize() / sizeof(float);
+        if (value_num < 2 || !in.Open(IceHalo::OpenMode::kRead | IceHalo::OpenMode::kBinary)) {
+          std::fprintf(stderr, "Cannot read file %s!\n", kv.second[k].path.c_str());
+          return -1;
+        }
+        std::vector<float> buffer(value_num);
+        auto read_count = in.Read(buffer.data(), value_num);
+        in.Close();
+
+        auto ray_num = (read_count - 2) / 4;
+        if (!header_written) {
+          out.Write(buffer.data(), 2);  // wavelength, weight
+          header_written = true;
+        }
+        out.Write(buffer.data() + 2, ray_num * 4);
+        total_ray_num += ray_num;
+      }
+      out.Close();
+      std::printf("%s: %zu shards, %zu rays\n", filename, wl_files.second.size(), total_ray_num);
+    }
+  }
+  return 0;
+}
+
+
+/*! @brief Sum up checkpoints of different shards, then write the merged checkpoint and image into data folder.
+ */
+int MergeCheckpoints(const char* config_file, const std::vector<const char*>& checkpoints) {
+  IceHalo::ProjectContextPtr proj_ctx = IceHalo::ProjectContext::CreateFromFile(config_file);
+  IceHalo::SpectrumRenderer renderer(proj_ctx);
+  IceHalo::SpectrumRenderer shard_renderer(proj_ctx);
+  renderer.EnableNoiseEstimation(true);
+  shard_renderer.EnableNoiseEstimation(true);
+
+  size_t total_ray_num = 0;
+  for (size_t i = 0; i < checkpoints.size(); i++) {
+    size_t ray_num = 0;
+    std::string rng_state;
+    auto* target = i == 0 ? &renderer : &shard_renderer;
+    if (!IceHalo::LoadCheckpoint(checkpoints[i], target, &ray_num, &rng_state)) {
+      return -1;
+    }
+    if (i > 0 && !renderer.Merge(shard_renderer)) {
+      return -1;
+    }
+    total_ray_num += ray_num;
+    std::printf("%s: %zu rays\n", checkpoints[i], ray_num);
+  }
+
+  // Merged data come from several RNG streams, so they cannot be resumed.
+  auto data_dir = proj_ctx->GetDataDirectory();
+  if (!IceHalo::SaveCheckpoint(IceHalo::PathJoin(data_dir, "checkpoint_merged.dat"), renderer, total_ray_num, "")) {
+    return -1;
+  }
+
+  std::vector<uint8_t> rgb_data;
+  if (!IceHalo::SaveImage(IceHalo::PathJoin(data_dir, "img_merged.jpg"), proj_ctx, &renderer, &rgb_data)) {
+    return -1;
+  }
+
+  std::printf("Merged %zu rays, noise level %.4f\n", total_ray_num, renderer.GetNoiseLevel());
+  return 0;
+}
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  bool rays_mode = argc >= 4 && std::strcmp(argv[1], "rays") == 0;
+  bool hist_mode = argc >= 4 && std::strcmp(argv[1], "hist") == 0;
+  if (!rays_mode && !hist_mode) {
+    std::printf("USAGE: %s rays <output-folder> <input-folder>...\n", argv[0]);
+    std::printf("       %s hist <config-file> <checkpoint-file>...\n", argv[0]);
+    return -1;
+  }
+
+  auto start = std::chrono::system_clock::now();
+  std::vector<const char*> inputs(argv + 3, argv + argc);
+  int ret = rays_mode ? MergeRays(argv[2], inputs) : MergeCheckpoints(argv[2], inputs);
+
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = end - start;
+  std::printf("Total: %.2fms\n", diff.count());
+  return ret;
+}
@@ -7,6 +7,8 @@
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <limits>
+#include <sstream>
 
 #include "context.h"
 
@@ -221,6 +223,175 @@ void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* outpu
 }
 
 
+void RotateZMatrix(const float* lon_lat_roll, float* mat) {
+  float c0 = std::cos(lon_lat_roll[0]);
+  float s0 = std::sin(lon_lat_roll[0]);
+  float c1 = std::cos(lon_lat_roll[1]);
+  float s1 = std::sin(lon_lat_roll[1]);
+  float c2 = std::cos(lon_lat_roll[2]);
+  float s2 = std::sin(lon_lat_roll[2]);
+
+  mat[0] = -c2 * s0 - c0 * s1 * s2;
+  mat[1] = c0 * c2 - s0 * s1 * s2;
+  mat[2] = c1 * s2;
+  mat[3] = -c0 * c2 * s1 + s0 * s2;
+  mat[4] = -c2 * s0 * s1 - c0 * s2;
+  mat[5] = c1 * c2;
+  mat[6] = c0 * c1;
+  mat[7] = c1 * s0;
+  mat[8] = s1;
+}
+
+
+namespace {
+
+// out = mat * in, or mat^T * in if transposed. Every vector has its own matrix.
+template <bool kTranspose>
+void RotateByMatrices(const float* mat, const float* input_vec, float* output_vec, size_t data_num,
+                      size_t output_step) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  // 8 vectors a time, one in each lane. Components are gathered from arrays of vectors and matrices.
+  const __m256i kVecIdx = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256i kMatIdx = _mm256_setr_epi32(0, 9, 18, 27, 36, 45, 54, 63);
+  for (; i + 8 <= data_num; i += 8) {
+    const float* tmp_v = input_vec + i * 3;
+    const float* tmp_m = mat + i * 9;
+    __m256 v[3];
+    for (int k = 0; k < 3; k++) {
+      v[k] = _mm256_i32gather_ps(tmp_v + k, kVecIdx, 4);
+    }
+    __m256 m[9];
+    for (int k = 0; k < 9; k++) {
+      m[k] = _mm256_i32gather_ps(tmp_m + k, kMatIdx, 4);
+    }
+
+    float out[3][8];
+    for (int j = 0; j < 3; j++) {
+      __m256 res = _mm256_setzero_ps();
+      for (int k = 0; k < 3; k++) {
+        res = _mm256_add_ps(res, _mm256_mul_ps(v[k], m[kTranspose ? k * 3 + j : j * 3 + k]));
+      }
+      _mm256_storeu_ps(out[j], res);
+    }
+    for (int l = 0; l < 8; l++) {
+      float* tmp_out = output_vec + (i + l) * output_step;
+      tmp_out[0] = out[0][l];
+      tmp_out[1] = out[1][l];
+      tmp_out[2] = out[2][l];
+    }
+  }
+#endif
+  for (; i < data_num; i++) {
+    const float* tmp_v = input_vec + i * 3;
+    const float* tmp_m = mat + i * 9;
+    float* tmp_out = output_vec + i * output_step;
+    for (int j = 0; j < 3; j++) {
+      tmp_out[j] = kTranspose ? tmp_v[0] * tmp_m[j] + tmp_v[1] * tmp_m[3 + j] + tmp_v[2] * tmp_m[6 + j] :
+                                Dot3(tmp_v, tmp_m + j * 3);
+    }
+  }
+}
+
+}  // namespace
+
+
+void RotateByMatrix(const float* mat, const float* input_vec, float* output_vec, size_t data_num,
+                    size_t output_step) {
+  RotateByMatrices<false>(mat, input_vec, output_vec, data_num, output_step);
+}
+
+
+void RotateBackByMatrix(const float* mat, const float* input_vec, float* output_vec, size_t data_num,
+                        size_t output_step) {
+  RotateByMatrices<true>(mat, input_vec, output_vec, data_num, output_step);
+}
+
+
+int CubeMapBin(const float* dir, int res) {
+  int axis = 0;
+  for (int i = 1; i < 3; i++) {
+    if (std::abs(dir[i]) > std::abs(dir[axis])) {
+      axis = i;
+    }
+  }
+  int face = axis * 2 + (dir[axis] < 0 ? 1 : 0);
+  float a = std::max(std::abs(dir[axis]), std::numeric_limits<float>::min());
+  float u = dir[(axis + 1) % 3] / a;
+  float v = dir[(axis + 2) % 3] / a;
+  int iu = std::min(std::max(static_cast<int>((u + 1) * 0.5f * res), 0), res - 1);
+  int iv = std::min(std::max(static_cast<int>((v + 1) * 0.5f * res), 0), res - 1);
+  return (face * res + iv) * res + iu;
+}
+
+
+float CubeMapBinCenter(int bin, int res, float* center) {
+  int iu = bin % res;
+  int iv = bin / res % res;
+  int face = bin / (res * res);
+  int axis = face / 2;
+  float sign = face % 2 ? -1.0f : 1.0f;
+
+  auto to_dir = [=](float u, float v, float* d) {
+    d[axis] = sign;
+    d[(axis + 1) % 3] = u * 2.0f / res - 1;
+    d[(axis + 2) % 3] = v * 2.0f / res - 1;
+    Normalize3(d);
+  };
+
+  to_dir(iu + 0.5f, iv + 0.5f, center);
+
+  // The bin is a convex spherical quadrilateral, so the farthest point from its center is one of the corners.
+  float radius = 0;
+  for (int i = 0; i < 4; i++) {
+    float corner[3];
+    to_dir(iu + (i & 1), iv + (i >> 1), corner);
+    radius = std::max(radius, DiffNorm3(center, corner));
+  }
+  return radius;
+}
+
+
+uint16_t FloatToHalf(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  auto sign = static_cast<uint16_t>((x >> 16) & 0x8000u);
+  uint32_t abs_x = x & 0x7fffffffu;
+
+  if (abs_x >= 0x7f800000u) {  // Infinity or NaN
+    return sign | 0x7c00u | (abs_x > 0x7f800000u ? 0x200u : 0u);
+  }
+  if (abs_x >= 0x477ff000u) {  // Not less than 65520, which rounds to infinity
+    return sign | 0x7c00u;
+  }
+  if (abs_x < 0x38800000u) {  // Less than 2^-14, subnormal in half precision
+    float abs_f;
+    std::memcpy(&abs_f, &abs_x, sizeof(abs_f));
+    return sign | static_cast<uint16_t>(std::nearbyint(abs_f * 16777216.0f));  // In unit of 2^-24
+  }
+  abs_x += 0xc8000fffu + ((abs_x >> 13) & 1u);  // Re-bias exponent by -112, and round to nearest even
+  return sign | static_cast<uint16_t>(abs_x >> 13);
+}
+
+
+float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000u) << 16;
+  uint32_t exponent = (h >> 10) & 0x1fu;
+  uint32_t mantissa = h & 0x3ffu;
+
+  if (exponent == 0) {  // Zero or subnormal
+    float f = mantissa / 16777216.0f;
+    return sign ? -f : f;
+  }
+
+  uint32_t x = sign | (mantissa << 13);
+  x |= exponent == 0x1fu ? 0x7f800000u : (exponent + 112) << 23;
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+
 std::vector<Vec3f> FindInnerPoints(const HalfSpaceSet& hss) {
   float *a = hss.a, *b = hss.b, *c = hss.c, *d = hss.d;
   int n = hss.n;
@@ -579,7 +750,9 @@ HalfSpaceSet::HalfSpaceSet(int n, float* a, float* b, float* c, float* d) : n(n)
 
 
 RandomNumberGenerator::RandomNumberGenerator(uint32_t seed)
-    : generator_{ static_cast<std::mt19937::result_type>(seed) } {}
+    : seed_(seed), generator_{ static_cast<std::mt19937::result_type>(seed) } {
+  SeedBulk(0);
+}
 
 
 RngPtrU RandomNumberGenerator::instance_ = nullptr;
@@ -612,6 +785,155 @@ float RandomNumberGenerator::GetUniform() {
 }
 
 
+uint32_t RandomNumberGenerator::GetUInt() {
+  return static_cast<uint32_t>(generator_());
+}
+
+
+void RandomNumberGenerator::FillUniform(float* data, size_t num) {
+  size_t i = 0;
+  for (; i + kBulkLanes <= num; i += kBulkLanes) {
+    NextBulk(data + i);
+  }
+  if (i < num) {
+    float tmp[kBulkLanes];
+    NextBulk(tmp);
+    std::copy(tmp, tmp + (num - i), data + i);
+  }
+}
+
+
+void RandomNumberGenerator::FillGaussian(float* data, size_t num) {
+  // Box-Muller transform, a pair of uniform numbers gives a pair of normal ones.
+  constexpr size_t kBlockSize = 256;
+  float u[kBlockSize];
+  for (size_t i = 0; i < num; i += kBlockSize) {
+    size_t block_num = std::min(num - i, kBlockSize);
+    FillUniform(u, (block_num + 1) / 2 * 2);
+    for (size_t j = 0; j < block_num; j += 2) {
+      float r = std::sqrt(-2.0f * std::log(1.0f - u[j]));  // 1 - u is in (0, 1]
+      float q = u[j + 1] * 2 * kPi;
+      data[i + j] = r * std::cos(q);
+      if (j + 1 < block_num) {
+        data[i + j + 1] = r * std::sin(q);
+      }
+    }
+  }
+}
+
+
+void RandomNumberGenerator::Fill(Distribution dist, float mean, float std, float* data, size_t num) {
+  switch (dist) {
+    case Distribution::kUniform:
+      FillUniform(data, num);
+      for (size_t i = 0; i < num; i++) {
+        data[i] = (data[i] - 0.5f) * 2 * std + mean;
+      }
+      break;
+    case Distribution::kGaussian:
+      FillGaussian(data, num);
+      for (size_t i = 0; i < num; i++) {
+        data[i] = data[i] * std + mean;
+      }
+      break;
+  }
+}
+
+
+// xoshiro128+, see http://prng.di.unimi.it/. Lanes are independent generators, so they vectorize naturally.
+void RandomNumberGenerator::NextBulk(float* data) {
+#if defined(__AVX2__)
+  __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bulk_state_[0]));
+  __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bulk_state_[1]));
+  __m256i s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bulk_state_[2]));
+  __m256i s3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bulk_state_[3]));
+
+  __m256i res = _mm256_srli_epi32(_mm256_add_epi32(s0, s3), 8);
+  __m256i t = _mm256_slli_epi32(s1, 9);
+  s2 = _mm256_xor_si256(s2, s0);
+  s3 = _mm256_xor_si256(s3, s1);
+  s1 = _mm256_xor_si256(s1, s2);
+  s0 = _mm256_xor_si256(s0, s3);
+  s2 = _mm256_xor_si256(s2, t);
+  s3 = _mm256_or_si256(_mm256_slli_epi32(s3, 11), _mm256_srli_epi32(s3, 21));
+
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(bulk_state_[0]), s0);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(bulk_state_[1]), s1);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(bulk_state_[2]), s2);
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(bulk_state_[3]), s3);
+  _mm256_storeu_ps(data, _mm256_mul_ps(_mm256_cvtepi32_ps(res), _mm256_set1_ps(1.0f / (1 << 24))));
+#else
+  for (int l = 0; l < kBulkLanes; l++) {
+    uint32_t* s0 = bulk_state_[0] + l;
+    uint32_t* s1 = bulk_state_[1] + l;
+    uint32_t* s2 = bulk_state_[2] + l;
+    uint32_t* s3 = bulk_state_[3] + l;
+
+    uint32_t res = (*s0 + *s3) >> 8;
+    uint32_t t = *s1 << 9;
+    *s2 ^= *s0;
+    *s3 ^= *s1;
+    *s1 ^= *s2;
+    *s0 ^= *s3;
+    *s2 ^= t;
+    *s3 = (*s3 << 11) | (*s3 >> 21);
+    data[l] = res * (1.0f / (1 << 24));
+  }
+#endif
+}
+
+
+void RandomNumberGenerator::SeedBulk(uint32_t stream) {
+  std::seed_seq seq{ seed_, stream, kBulkSeedTag };
+  seq.generate(&bulk_state_[0][0], &bulk_state_[0][0] + 4 * kBulkLanes);
+}
+
+
+std::string RandomNumberGenerator::SaveState() const {
+  std::ostringstream os;
+  os << generator_ << ' ' << gauss_dist_ << ' ' << uniform_dist_;
+  for (const auto& s : bulk_state_) {
+    for (auto v : s) {
+      os << ' ' << v;
+    }
+  }
+  return os.str();
+}
+
+
+bool RandomNumberGenerator::LoadState(const std::string& state) {
+  std::istringstream is(state);
+  std::mt19937 generator;
+  std::normal_distribution<float> gauss_dist;
+  std::uniform_real_distribution<float> uniform_dist;
+  uint32_t bulk_state[4][kBulkLanes];
+  is >> generator >> gauss_dist >> uniform_dist;
+  for (auto& s : bulk_state) {
+    for (auto& v : s) {
+      is >> v;
+    }
+  }
+  if (is.fail()) {
+    return false;
+  }
+
+  generator_ = generator;
+  gauss_dist_ = gauss_dist;
+  uniform_dist_ = uniform_dist;
+  std::memcpy(bulk_state_, bulk_state, sizeof(bulk_state_));
+  return true;
+}
+
+
+void RandomNumberGenerator::SetStream(uint32_t stream) {
+  std::seed_seq seq{ seed_, stream };
+  generator_.seed(seq);
+  gauss_dist_.reset();
+  uniform_dist_.reset();
+  SeedBulk(stream);
+}
+
+
 float RandomNumberGenerator::Get(Distribution dist, float mean, float std) {
   switch (dist) {
     case Distribution::kUniform:
@@ -622,6 +944,100 @@ float RandomNumberGenerator::Get(Distribution dist, float mean, float std) {
 }
 
 
+AliasTable::AliasTable(const float* weights, int num) : prob_(num), alias_(num), total_weight_(0) {
+  for (int i = 0; i < num; i++) {
+    total_weight_ += weights[i];
+  }
+  if (num <= 0 || total_weight_ <= 0) {
+    prob_.clear();
+    alias_.clear();
+    return;
+  }
+
+  // Vose's method. Scaled weights average to 1, and every under-full slot is topped up by an over-full one.
+  std::vector<int> small;
+  std::vector<int> large;
+  for (int i = 0; i < num; i++) {
+    prob_[i] = weights[i] * num / total_weight_;
+    alias_[i] = i;
+    (prob_[i] < 1.0f ? small : large).emplace_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    int s = small.back();
+    int l = large.back();
+    small.pop_back();
+    alias_[s] = l;
+    prob_[l] -= 1.0f - prob_[s];
+    if (prob_[l] < 1.0f) {
+      large.pop_back();
+      small.emplace_back(l);
+    }
+  }
+  // Whatever left is full, up to rounding error.
+  for (auto i : small) {
+    prob_[i] = 1.0f;
+  }
+  for (auto i : large) {
+    prob_[i] = 1.0f;
+  }
+}
+
+
+int AliasTable::Sample(float u) const {
+  if (prob_.empty()) {
+    return -1;
+  }
+  auto num = static_cast<int>(prob_.size());
+  float x = u * num;
+  int i = std::min(static_cast<int>(x), num - 1);
+  return x - i < prob_[i] ? i : alias_[i];
+}
+
+
+float AliasTable::TotalWeight() const {
+  return total_weight_;
+}
+
+
+float NormalQuantile(float p) {
+  constexpr double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                           1.383577518672690e+02,  -3.066479806614716e+01, 2.506628277459239e+00 };
+  constexpr double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                           6.680131188771972e+01,  -1.328068155288572e+01 };
+  constexpr double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                           -2.549732539343734e+00, 4.374664141464968e+00,  2.938163982698783e+00 };
+  constexpr double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+                           3.754408661907416e+00 };
+  constexpr double kLow = 0.02425;
+  constexpr double kMinP = 1e-12;
+
+  double x = std::min(std::max(static_cast<double>(p), kMinP), 1 - kMinP);
+  if (x < kLow || x > 1 - kLow) {
+    // Tails
+    double q = std::sqrt(-2 * std::log(std::min(x, 1 - x)));
+    double r = (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+               ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    return static_cast<float>(x < kLow ? r : -r);
+  }
+
+  double q = x - 0.5;
+  double r = q * q;
+  return static_cast<float>((((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+                            (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1));
+}
+
+
+float Quantile(Distribution dist, float mean, float std, float p) {
+  switch (dist) {
+    case Distribution::kUniform:
+      return (p - 0.5f) * 2 * std + mean;
+    case Distribution::kGaussian:
+      return NormalQuantile(p) * std + mean;
+  }
+  return mean;
+}
+
+
 void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float* data, size_t num) {
   auto rng = RandomNumberGenerator::GetInstance();
 
@@ -629,12 +1045,14 @@ void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float
   float lat = std::asin(dir[2] / Math::Norm3(dir));
   float rot[3] = { lon, lat, 0 };
 
+  std::vector<float> u(num * 2);
+  rng->FillUniform(u.data(), num * 2);
   auto* tmp_dir = new float[num * 3];
 
   double dz = 2 * std::sin(std / 2.0 * kDegreeToRad) * std::sin(std / 2.0 * kDegreeToRad);
   for (decltype(num) i = 0; i < num; i++) {
-    double udz = rng->GetUniform() * dz;
-    double q = rng->GetUniform() * 2 * Math::kPi;
+    double udz = u[i * 2 + 0] * dz;
+    double q = u[i * 2 + 1] * 2 * Math::kPi;
 
     double r = std::sqrt((2.0f - udz) * udz);
     tmp_dir[i * 3 + 0] = static_cast<float>(std::cos(q) * r);
@@ -648,23 +1066,50 @@ void RandomSampler::SampleSphericalPointsCart(const float* dir, float std, float
 
 
 void RandomSampler::SampleSphericalPointsSph(float* data, size_t num, size_t step) {
-  auto rng = RandomNumberGenerator::GetInstance();
-  for (decltype(num) i = 0; i < num; i++) {
-    float u = rng->GetUniform() * 2 - 1;
-    float lambda = rng->GetUniform() * 2 * Math::kPi;
+  std::vector<float> u(num * 2);
+  RandomNumberGenerator::GetInstance()->FillUniform(u.data(), num * 2);
+  MapSphericalPointsSph(u.data(), 2, data, num, step);
+}
 
-    data[i * step + 0] = lambda;
-    data[i * step + 1] = std::asin(u);
+
+void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num,
+                                             size_t step) {
+  std::vector<float> u(num * 2);
+  RandomNumberGenerator::GetInstance()->FillUniform(u.data(), num * 2);
+  MapSphericalPointsSph(axis_dist, u.data(), 2, data, num, step);
+}
+
+
+void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, size_t num) {
+  std::vector<float> u(num * 2);
+  RandomNumberGenerator::GetInstance()->FillUniform(u.data(), num * 2);
+  std::vector<int> face_id(num, 0);
+  MapTriangularPoints(vertexes, face_id.data(), u.data(), 2, data, num);
+}
+
+
+void RandomSampler::SampleTriangularPoints(const float* face_vertexes, const int* face_id, float* data, size_t num) {
+  std::vector<float> u(num * 2);
+  RandomNumberGenerator::GetInstance()->FillUniform(u.data(), num * 2);
+  MapTriangularPoints(face_vertexes, face_id, u.data(), 2, data, num);
+}
+
+
+void RandomSampler::MapSphericalPointsSph(const float* u, size_t u_step, float* data, size_t num, size_t step) {
+  for (decltype(num) i = 0; i < num; i++) {
+    data[i * step + 0] = u[i * u_step + 1] * 2 * Math::kPi;
+    data[i * step + 1] = std::asin(u[i * u_step + 0] * 2 - 1);
   }
 }
 
 
-void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+void RandomSampler::MapSphericalPointsSph(const AxisDistribution& axis_dist, const float* u, size_t u_step,
+                                          float* data, size_t num, size_t step) {
   for (decltype(num) i = 0; i < num; i++) {
-    float phi = rng->Get(axis_dist.latitude_dist,                 // distribute
+    float phi = Quantile(axis_dist.latitude_dist,                 // distribute
                          axis_dist.latitude_mean * kDegreeToRad,  // mean
-                         axis_dist.latitude_std * kDegreeToRad);  // standard deviation
+                         axis_dist.latitude_std * kDegreeToRad,   // standard deviation
+                         u[i * u_step + 0]);
     if (phi > kPi / 2) {
       phi = kPi - phi;
     }
@@ -673,30 +1118,32 @@ void RandomSampler::SampleSphericalPointsSph(const AxisDistribution& axis_dist,
     }
     float lambda = 0;
     if (axis_dist.azimuth_dist == Distribution::kUniform) {
-      lambda = rng->GetUniform() * 2 * Math::kPi;
+      lambda = u[i * u_step + 1] * 2 * Math::kPi;
     } else {
-      lambda = rng->Get(axis_dist.azimuth_dist,                 // distribution
+      lambda = Quantile(axis_dist.azimuth_dist,                 // distribution
                         axis_dist.azimuth_mean * kDegreeToRad,  // mean
-                        axis_dist.azimuth_std * kDegreeToRad);  // standard deviation
+                        axis_dist.azimuth_std * kDegreeToRad,   // standard deviation
+                        u[i * u_step + 1]);
     }
 
-    data[i * 2 + 0] = lambda;
-    data[i * 2 + 1] = phi;
+    data[i * step + 0] = lambda;
+    data[i * step + 1] = phi;
   }
 }
 
 
-void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, size_t num) {
-  auto rng = RandomNumberGenerator::GetInstance();
+void RandomSampler::MapTriangularPoints(const float* face_vertexes, const int* face_id, const float* u,
+                                        size_t u_step, float* data, size_t num) {
   for (decltype(num) i = 0; i < num; i++) {
-    float a = rng->GetUniform();
-    float b = rng->GetUniform();
+    float a = u[i * u_step + 0];
+    float b = u[i * u_step + 1];
 
     if (a + b > 1.0f) {
       a = 1.0f - a;
       b = 1.0f - b;
     }
 
+    const float* vertexes = face_vertexes + face_id[i] * 9;
     for (int j = 0; j < 3; j++) {
       data[i * 3 + j] = (vertexes[j + 3] - vertexes[j]) * a + (vertexes[j + 6] - vertexes[j]) * b + vertexes[j];
     }
@@ -704,6 +1151,103 @@ void RandomSampler::SampleTriangularPoints(const float* vertexes, float* data, s
 }
 
 
+namespace {
+
+// Direction numbers of Sobol sequence, from new-joe-kuo-6.21201 by S. Joe and F. Y. Kuo.
+// The first dimension is van der Corput sequence. Others are given by degree s, coefficients a, and initial m.
+struct SobolInitNumbers {
+  int s;
+  uint32_t a;
+  uint32_t m[5];
+};
+
+constexpr SobolInitNumbers kSobolInitNumbers[] = {
+  { 1, 0, { 1 } },
+  { 2, 1, { 1, 3 } },
+  { 3, 1, { 1, 3, 1 } },
+  { 3, 2, { 1, 1, 1 } },
+  { 4, 1, { 1, 1, 3, 3 } },
+  { 4, 4, { 1, 3, 5, 13 } },
+  { 5, 2, { 1, 1, 5, 5, 17 } },
+};
+
+constexpr int kSobolBits = 32;
+
+
+struct SobolDirections {
+  uint32_t v[RandomSampler::kSobolMaxDim][kSobolBits];
+
+  SobolDirections() : v{} {
+    for (int k = 0; k < kSobolBits; k++) {
+      v[0][k] = 1u << (31 - k);
+    }
+    for (int d = 1; d < RandomSampler::kSobolMaxDim; d++) {
+      const auto& init = kSobolInitNumbers[d - 1];
+      for (int k = 0; k < kSobolBits; k++) {
+        if (k < init.s) {
+          v[d][k] = init.m[k] << (31 - k);
+          continue;
+        }
+        v[d][k] = v[d][k - init.s] ^ (v[d][k - init.s] >> init.s);
+        for (int j = 1; j < init.s; j++) {
+          if ((init.a >> (init.s - 1 - j)) & 1u) {
+            v[d][k] ^= v[d][k - j];
+          }
+        }
+      }
+    }
+  }
+};
+
+
+uint32_t ReverseBits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+
+// Hash based Owen scrambling, from B. Burley, Practical Hash-based Owen Scrambling, JCGT 2020.
+// A higher bit is flipped depending only on the bits above it, which is what nested uniform scrambling needs.
+uint32_t OwenScramble(uint32_t x, uint32_t seed) {
+  x = ReverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return ReverseBits(x);
+}
+
+}  // namespace
+
+
+void RandomSampler::SampleSobolPoints(int dim, float* data, size_t num) {
+  static const SobolDirections directions;
+
+  auto rng = RandomNumberGenerator::GetInstance();
+  uint32_t seeds[kSobolMaxDim];
+  for (int d = 0; d < dim; d++) {
+    seeds[d] = rng->GetUInt();
+  }
+
+  for (size_t i = 0; i < num; i++) {
+    auto index = static_cast<uint32_t>(i);
+    for (int d = 0; d < dim; d++) {
+      uint32_t x = 0;
+      for (int k = 0; index >> k; k++) {
+        if ((index >> k) & 1u) {
+          x ^= directions.v[d][k];
+        }
+      }
+      data[i * dim + d] = (OwenScramble(x, seeds[d]) >> 8) * (1.0f / (1 << 24));
+    }
+  }
+}
+
+
 int RandomSampler::SampleInt(const float* p, int max) {
   auto rng = RandomNumberGenerator::GetInstance();
 
@@ -721,6 +1265,12 @@ int RandomSampler::SampleInt(const float* p, int max) {
 }
 
 
+int RandomSampler::SampleInt(const AliasTable& table) {
+  auto rng = RandomNumberGenerator::GetInstance();
+  return table.Sample(rng->GetUniform());
+}
+
+
 int RandomSampler::SampleInt(int max) {
   auto rng = RandomNumberGenerator::GetInstance();
   return std::min(static_cast<int>(rng->GetUniform() * max), max - 1);
@@ -5,6 +5,7 @@
 #include <memory>
 #include <mutex>
 #include <random>
+#include <string>
 #include <vector>
 
 namespace IceHalo {
@@ -103,18 +104,52 @@ class RandomNumberGenerator {
  public:
   float GetGaussian();
   float GetUniform();
+  uint32_t GetUInt();  // Raw output of the generator, e.g. to seed generators of parallel jobs.
   float Get(Distribution dist, float mean, float std);
 
+  /*! @brief Fill an array with uniform random numbers in [0, 1).
+   *
+   * Bulk numbers come from a separate xoshiro128+ generator of kBulkLanes interleaved lanes, which runs with
+   * AVX2 if available, and gives the same sequence either way. It is seeded and saved along with the main one.
+   */
+  void FillUniform(float* data, size_t num);
+
+  /*! @brief Fill an array with standard normal random numbers, by Box-Muller transform of bulk uniform numbers.
+   */
+  void FillGaussian(float* data, size_t num);
+
+  /*! @brief Fill an array, as Get() does for every element.
+   */
+  void Fill(Distribution dist, float mean, float std, float* data, size_t num);
+
+  std::string SaveState() const;             // Text form of the generator and distribution states
+  bool LoadState(const std::string& state);  // Restore states from SaveState() output
+
+  /*! @brief Re-seed the generator with a stream derived from its seed and the stream id.
+   *
+   * Different processes sharing one job use different stream ids. The seeds of different streams are mixed
+   * by std::seed_seq, so their sequences are independent and will not repeat each other in practice.
+   */
+  void SetStream(uint32_t stream);
+
   static RandomNumberGenerator* GetInstance();
 
  private:
   explicit RandomNumberGenerator(uint32_t seed);
 
+  void SeedBulk(uint32_t stream);
+  void NextBulk(float* data);  // Output kBulkLanes uniform numbers.
+
+  static constexpr int kBulkLanes = 8;
+
+  uint32_t seed_;
   std::mt19937 generator_;
   std::normal_distribution<float> gauss_dist_;
   std::uniform_real_distribution<float> uniform_dist_;
+  uint32_t bulk_state_[4][kBulkLanes];  // xoshiro128+ state, lane by lane
 
   static constexpr uint32_t kDefaultRandomSeed = 1;
+  static constexpr uint32_t kBulkSeedTag = 0x6a09e667;  // Keeps bulk state apart from the main one
   static std::unique_ptr<RandomNumberGenerator> instance_;
   static std::mutex instance_mutex_;
 };
@@ -122,6 +157,46 @@ class RandomNumberGenerator {
 using RngPtrU = std::unique_ptr<RandomNumberGenerator>;
 
 
+/*! @brief Walker's alias table, for sampling an index proportional to given weights in constant time.
+ */
+class AliasTable {
+ public:
+  AliasTable() = default;
+
+  /*! @brief Build the table.
+   *
+   * @param weights non-negative weights, need not be normalized.
+   * @param num number of weights.
+   */
+  AliasTable(const float* weights, int num);
+
+  /*! @brief Map a uniform random number to an index.
+   *
+   * @param u uniform random number in [0, 1).
+   * @return sampled index, or -1 if all weights are zero.
+   */
+  int Sample(float u) const;
+
+  float TotalWeight() const;
+
+ private:
+  std::vector<float> prob_;
+  std::vector<int> alias_;
+  float total_weight_ = 0;
+};
+
+
+/*! @brief Inverse of standard normal CDF, by Acklam's rational approximation, with relative error below 1.2e-9.
+ *
+ * @param p probability, clamped into (0, 1) so the result is always finite.
+ */
+float NormalQuantile(float p);
+
+/*! @brief Map a uniform number in [0, 1) to the given distribution, as RandomNumberGenerator::Get() samples it.
+ */
+float Quantile(Distribution dist, float mean, float std, float p);
+
+
 class RandomSampler {
  public:
   /*! @brief Generate points distributed uniformly on sphere around a give point, in Cartesian form.
@@ -145,8 +220,10 @@ class RandomSampler {
    * @param axis_dist axis distribution, including information of zenith / azimuth / roll.
    * @param data output data, (lon, lat), in rad
    * @param num number of points.
+   * @param step floats between adjacent points in data.
    */
-  static void SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num = 1);
+  static void SampleSphericalPointsSph(const AxisDistribution& axis_dist, float* data, size_t num = 1,
+                                       size_t step = 2);
 
   /*! @brief Generate points evenly distributed on a triangle, in Cartesian form, xyz.
    *
@@ -156,6 +233,45 @@ class RandomSampler {
    */
   static void SampleTriangularPoints(const float* vertexes, float* data, size_t num = 1);
 
+  /*! @brief Generate one point on every given face, in Cartesian form, xyz.
+   *
+   * @param face_vertexes vertexes of all faces, 9 floats each.
+   * @param face_id face of every point.
+   * @param data output data, xyz.
+   * @param num number of points.
+   */
+  static void SampleTriangularPoints(const float* face_vertexes, const int* face_id, float* data, size_t num);
+
+  /*! @brief Map given uniform numbers to points, as SampleSphericalPointsSph() does.
+   *
+   * @param u uniform numbers in [0, 1), u[0] for latitude and u[1] for longitude.
+   * @param u_step floats between adjacent points in u.
+   */
+  static void MapSphericalPointsSph(const float* u, size_t u_step, float* data, size_t num = 1, size_t step = 3);
+  static void MapSphericalPointsSph(const AxisDistribution& axis_dist, const float* u, size_t u_step, float* data,
+                                    size_t num = 1, size_t step = 2);
+
+  /*! @brief Map given uniform numbers to points, as SampleTriangularPoints() does.
+   *
+   * @param u uniform numbers in [0, 1), 2 for a point.
+   * @param u_step floats between adjacent points in u.
+   */
+  static void MapTriangularPoints(const float* face_vertexes, const int* face_id, const float* u, size_t u_step,
+                                  float* data, size_t num);
+
+  /*! @brief Generate points of Owen-scrambled Sobol sequence, in [0, 1)^dim.
+   *
+   * Every call starts from the first point, with new scrambling drawn from the global generator. So points of
+   * one call are well stratified, and calls are independent of each other.
+   *
+   * @param dim dimension, no more than kSobolMaxDim.
+   * @param data output data, num x dim.
+   * @param num number of points.
+   */
+  static void SampleSobolPoints(int dim, float* data, size_t num);
+
+  static constexpr int kSobolMaxDim = 8;
+
   /*! @brief Random choose an integer index from [0, max), proportional to probabilities in p.
    *
    * @param p probabilities, must have max values, sum of all p should be 1.0f.
@@ -164,6 +280,13 @@ class RandomSampler {
    */
   static int SampleInt(const float* p, int max);
 
+  /*! @brief Random choose an integer index with an alias table.
+   *
+   * @param table alias table built from weights of all indices.
+   * @return chosen index, or -1 if the table is empty.
+   */
+  static int SampleInt(const AliasTable& table);
+
   /*! @brief Random choose an integer from [0, max)
    *
    * @param max range bound.
@@ -194,6 +317,53 @@ void RotateZWithDataStep(const float* lon_lat_roll, const float* input_vec, floa
                          size_t output_step, size_t data_num = 1);
 void RotateZBack(const float* lon_lat_roll, const float* input_vec, float* output_vec, size_t data_num = 1);
 
+/*! @brief Build the rotation matrix used by RotateZ(), so it can be computed once and applied many times.
+ *
+ * RotateZ() maps v to mat * v, and RotateZBack() maps v to mat^T * v.
+ *
+ * @param lon_lat_roll longitude, latitude, roll.
+ * @param mat output matrix, 3 x 3, row major.
+ */
+void RotateZMatrix(const float* lon_lat_roll, float* mat);
+
+/*! @brief Rotate every vector by its own matrix, as RotateZ() does. 8 vectors are done at a time with AVX2.
+ *
+ * @param mat matrices from RotateZMatrix(), data_num x 9.
+ * @param input_vec input vectors, data_num x 3.
+ * @param output_vec output vectors, with output_step floats between adjacent ones.
+ */
+void RotateByMatrix(const float* mat, const float* input_vec, float* output_vec, size_t data_num = 1,
+                    size_t output_step = 3);
+
+/*! @brief Rotate every vector back by its own matrix, as RotateZBack() does. See RotateByMatrix().
+ */
+void RotateBackByMatrix(const float* mat, const float* input_vec, float* output_vec, size_t data_num = 1,
+                        size_t output_step = 3);
+
+/*! @brief Find the bin a direction falls in. Directions are binned by a cube map, with every cube face divided
+ *         into res x res bins. So there are 6 * res * res bins in total.
+ *
+ * @param dir direction, need not be normalized.
+ * @param res bin number along an edge of cube face.
+ * @return bin index.
+ */
+int CubeMapBin(const float* dir, int res);
+
+/*! @brief Get the center direction of a bin, and the max distance from it to any unit direction in the bin.
+ *
+ * @param bin bin index.
+ * @param res bin number along an edge of cube face.
+ * @param center output center direction, normalized.
+ * @return max distance (chord length) from center to directions in the bin.
+ */
+float CubeMapBinCenter(int bin, int res, float* center);
+
+/*! @brief Convert a float into IEEE 754 half precision, rounding to nearest even. Out of range values become
+ *         infinity.
+ */
+uint16_t FloatToHalf(float f);
+float HalfToFloat(uint16_t h);
+
 std::vector<Vec3f> FindInnerPoints(const HalfSpaceSet& hss);
 void SortAndRemoveDuplicate(std::vector<Vec3f>* pts);
 std::vector<int> FindCoplanarPoints(const std::vector<Vec3f>& pts, const Vec3f& n0, float d0);
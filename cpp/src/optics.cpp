@@ -5,8 +5,10 @@
 #include <xmmintrin.h>
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <limits>
+#include <utility>
 
 #include "context.h"
 #include "mymath.h"
@@ -15,29 +17,138 @@
 
 namespace IceHalo {
 
-RaySegment::RaySegment()
-    : next_reflect(nullptr), next_refract(nullptr), prev(nullptr), root_ctx(nullptr), pt(0, 0, 0), dir(0, 0, 0), w(0),
-      face_id(-1), is_finished(false) {}
+namespace {
+
+/*! @brief Polygon faces of a crystal, padded to a fixed size so that all loops over them have constant trip counts.
+ *
+ * Padding polygons have zero normals and are never hit. Padding edges have zero normals and always pass.
+ */
+template <int kPolyNum, int kMaxEdges>
+struct FixedPolygonTable {
+  explicit FixedPolygonTable(const Crystal* crystal);
+
+  float plane[kPolyNum][4];
+  float edge[kPolyNum][kMaxEdges][4];
+  int face_id[kPolyNum];
+};
+
+
+template <int kPolyNum, int kMaxEdges>
+FixedPolygonTable<kPolyNum, kMaxEdges>::FixedPolygonTable(const Crystal* crystal) : plane{}, edge{}, face_id{} {
+  auto* planes = crystal->GetPolygonPlane();
+  auto* edges = crystal->GetPolygonEdge();
+  auto* edge_offsets = crystal->GetPolygonEdgeOffset();
+  auto* polygon_face_ids = crystal->GetPolygonFaceId();
+  for (int i = 0; i < kPolyNum; i++) {
+    for (int k = 0; k < kMaxEdges; k++) {
+      edge[i][k][3] = -1.0f;
+    }
+  }
+  for (int i = 0; i < crystal->TotalPolygons(); i++) {
+    std::copy(planes + i * 4, planes + i * 4 + 4, plane[i]);
+    for (int k = 0; k < edge_offsets[i + 1] - edge_offsets[i]; k++) {
+      std::copy(edges + (edge_offsets[i] + k) * 4, edges + (edge_offsets[i] + k) * 4 + 4, edge[i][k]);
+    }
+    face_id[i] = polygon_face_ids[i];
+  }
+}
 
 
-void RaySegment::ResetWith(const float* pt, const float* dir, float w, int face_id) {
-  next_reflect = nullptr;
-  next_refract = nullptr;
-  prev = nullptr;
-  root_ctx = nullptr;
+/*! @brief The same as Optics::IntersectLineWithPolygons() for all rays, with polygon number and edge number known
+ *         at compile time. The face table is copied onto the stack once, then kept hot for all rays.
+ */
+template <int kPolyNum, int kMaxEdges>
+void PropagateFixed(const Crystal* crystal, size_t num,                          // input
+                    const float* pt_in, const float* dir_in, const float* w_in,  // input
+                    const int* face_id_in,                                       // input
+                    float* pt_out, int* face_id_out) {                           // output
+  const FixedPolygonTable<kPolyNum, kMaxEdges> table(crystal);
+  auto* face_norm = crystal->GetFaceNorm();
 
-  this->pt.val(pt);
-  this->dir.val(dir);
-  this->w = w;
-  this->face_id = face_id;
+  for (decltype(num) r = 0; r < num; r++) {
+    if (w_in[r] < ProjectContext::kPropMinW) {
+      continue;
+    }
+    const float* pt = pt_in + r / 2 * 3;
+    const float* dir = dir_in + r * 3;
+    float flag_in = Math::Dot3(dir, face_norm + face_id_in[r / 2] * 3);
+
+    float min_t = std::numeric_limits<float>::max();
+    int hit = -1;
+    for (int i = 0; i < kPolyNum; i++) {
+      const float* n = table.plane[i];
+      float c = dir[0] * n[0] + dir[1] * n[1] + dir[2] * n[2];
+      if (c * flag_in >= 0 || Math::FloatEqualZero(c)) {
+        continue;
+      }
+      float t = (n[3] - (pt[0] * n[0] + pt[1] * n[1] + pt[2] * n[2])) / c;
+      if (t <= Math::kFloatEps || t >= min_t) {
+        continue;
+      }
 
-  is_finished = false;
+      float p[3] = { pt[0] + t * dir[0], pt[1] + t * dir[1], pt[2] + t * dir[2] };
+      bool inside = true;
+      for (int k = 0; k < kMaxEdges; k++) {
+        const float* m = table.edge[i][k];
+        inside &= p[0] * m[0] + p[1] * m[1] + p[2] * m[2] >= m[3] - Math::kFloatEps;
+      }
+      if (inside) {
+        min_t = t;
+        hit = i;
+      }
+    }
+
+    if (hit >= 0) {
+      for (int j = 0; j < 3; j++) {
+        pt_out[r * 3 + j] = pt[j] + min_t * dir[j];
+      }
+      face_id_out[r] = table.face_id[hit];
+    }
+  }
+}
+
+
+using PropagateKernel = void (*)(const Crystal*, size_t, const float*, const float*, const float*, const int*,
+                                 float*, int*);
+
+template <int kPolyNum, int kMaxEdges>
+PropagateKernel SelectIfFits(const Crystal* crystal) {
+  if (crystal->TotalPolygons() <= kPolyNum && crystal->GetPolygonMaxEdges() <= kMaxEdges) {
+    return &PropagateFixed<kPolyNum, kMaxEdges>;
+  }
+  return nullptr;
+}
+
+
+/*! @brief Pick a specialized kernel for built-in crystal types. Parameters may still change the topology, e.g.
+ *         a pyramid with zero pyramidal heights, so the real polygon numbers are checked too.
+ *
+ * @return the kernel, or nullptr if none fits.
+ */
+PropagateKernel SelectPropagateKernel(const Crystal* crystal) {
+  switch (crystal->GetType()) {
+    case CrystalType::kPrism:
+      return SelectIfFits<8, 6>(crystal);
+    case CrystalType::kPyramid:
+      return SelectIfFits<20, 6>(crystal);
+    case CrystalType::kStackPyramid:
+      return SelectIfFits<20, 8>(crystal);
+    case CrystalType::kCubicPyramid:
+      return SelectIfFits<10, 6>(crystal);
+    case CrystalType::kCustom:
+    case CrystalType::kUnknown:
+    default:
+      return nullptr;
+  }
 }
 
+}  // namespace
+
 
 void Optics::HitSurface(const Crystal* crystal, float n, size_t num,                    // input
                         const float* dir_in, const int* face_id_in, const float* w_in,  // input
-                        float* dir_out, float* w_out) {                                 // output
+                        float* dir_out, float* w_out,                                   // output
+                        const float* rand_in) {                                         // input, optional
   auto face_norm = crystal->GetFaceNorm();
 
   for (decltype(num) i = 0; i < num; i++) {
@@ -52,6 +163,11 @@ void Optics::HitSurface(const Crystal* crystal, float n, size_t num,
 
     w_out[2 * i + 0] = GetReflectRatio(cos_theta, rr) * w_in[i];
     w_out[2 * i + 1] = is_total_reflected ? -1 : w_in[i] - w_out[2 * i + 0];
+    if (rand_in && !is_total_reflected) {
+      bool is_reflected = rand_in[i] * w_in[i] < w_out[2 * i + 0];
+      w_out[2 * i + 0] = is_reflected ? w_in[i] : 0.0f;
+      w_out[2 * i + 1] = is_reflected ? 0.0f : w_in[i];
+    }
 
     float* tmp_dir_reflection = dir_out + (i * 2 + 0) * 3;
     float* tmp_dir_refraction = dir_out + (i * 2 + 1) * 3;
@@ -72,29 +188,30 @@ void Optics::Propagate(const Crystal* crystal, size_t num,
     face_id_out[i] = -1;
   }
 
-  auto total_faces = crystal->TotalFaces();
-  auto face_bases = crystal->GetFaceBaseVector();
-  auto face_vertexes = crystal->GetFaceVertex();
-  auto face_norms = crystal->GetFaceNorm();
+  auto kernel = SelectPropagateKernel(crystal);
+  if (kernel) {
+    kernel(crystal, num, pt_in, dir_in, w_in, face_id_in, pt_out, face_id_out);
+    return;
+  }
+
+  auto bvh = crystal->GetBvh();
   for (decltype(num) i = 0; i < num; i++) {
     if (w_in[i] < ProjectContext::kPropMinW) {
       continue;
     }
-#if defined(__SSE4_1__) && defined(__AVX__)
-    IntersectLineWithTrianglesSimd(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
-                                   face_bases, face_vertexes, face_norms,                              //
-                                   pt_out + i * 3, face_id_out + i);                                   // output
-#else
-    IntersectLineWithTriangles(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], total_faces,  //
-                               face_bases, face_vertexes, face_norms,                              //
-                               pt_out + i * 3, face_id_out + i);                                   // output
-#endif
+    if (bvh) {
+      IntersectLineWithBvh(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], crystal, *bvh,  //
+                           pt_out + i * 3, face_id_out + i);                                    // output
+    } else {
+      IntersectLineWithPolygons(pt_in + i / 2 * 3, dir_in + i * 3, face_id_in[i / 2], crystal,  //
+                                pt_out + i * 3, face_id_out + i);                                // output
+    }
   }
 }
 
 
 float Optics::GetReflectRatio(float cos_angle, float rr) {
-  float s = std::sqrt(1.0f - cos_angle * cos_angle);
+  float s = std::sqrt(std::max(1.0f - cos_angle * cos_angle, 0.0f));  // |cos_angle| may exceed 1 by rounding
   float c = std::abs(cos_angle);
   float d = std::max(1.0f - (rr * s) * (rr * s), 0.0f);
   float d_sqrt = std::sqrt(d);
@@ -108,6 +225,63 @@ float Optics::GetReflectRatio(float cos_angle, float rr) {
 }
 
 
+bool Optics::IntersectLineWithTriangle(const float* pt, const float* dir,  // input
+                                       const float* face_base,             // input (pt1 - pt2, pt1 - pt3)
+                                       const float* face_point,            // input (pt1, pt2, pt3)
+                                       float* t_out) {                     // output
+  float ff04 = face_base[0] * face_base[4];
+  float ff05 = face_base[0] * face_base[5];
+  float ff13 = face_base[1] * face_base[3];
+  float ff15 = face_base[1] * face_base[5];
+  float ff23 = face_base[2] * face_base[3];
+  float ff24 = face_base[2] * face_base[4];
+
+  float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 - dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
+  if (Math::FloatEqualZero(c)) {
+    return false;
+  }
+
+
+  float a = ff15 * face_point[0] + ff23 * face_point[1] + ff04 * face_point[2] -
+            ff24 * face_point[0] - ff05 * face_point[1] - ff13 * face_point[2];
+  float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 - pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
+  float t = (a - b) / c;
+  if (t <= Math::kFloatEps) {
+    return false;
+  }
+
+  float dp01 = dir[0] * pt[1];
+  float dp02 = dir[0] * pt[2];
+  float dp10 = dir[1] * pt[0];
+  float dp12 = dir[1] * pt[2];
+  float dp20 = dir[2] * pt[0];
+  float dp21 = dir[2] * pt[1];
+
+  a = dp12 * face_base[3] + dp20 * face_base[4] + dp01 * face_base[5] - dp21 * face_base[3] -
+      dp02 * face_base[4] - dp10 * face_base[5];
+  b = dir[0] * face_base[4] * face_point[2] + dir[1] * face_base[5] * face_point[0] +
+      dir[2] * face_base[3] * face_point[1] - dir[0] * face_base[5] * face_point[1] -
+      dir[1] * face_base[3] * face_point[2] - dir[2] * face_base[4] * face_point[0];
+  float alpha = (a + b) / c;
+  if (alpha < 0 || alpha > 1) {
+    return false;
+  }
+
+  a = dp12 * face_base[0] + dp20 * face_base[1] + dp01 * face_base[2] - dp21 * face_base[0] -
+      dp02 * face_base[1] - dp10 * face_base[2];
+  b = dir[0] * face_base[1] * face_point[2] + dir[1] * face_base[2] * face_point[0] +
+      dir[2] * face_base[0] * face_point[1] - dir[0] * face_base[2] * face_point[1] -
+      dir[1] * face_base[0] * face_point[2] - dir[2] * face_base[1] * face_point[0];
+  float beta = -(a + b) / c;
+
+  if (beta < 0 || alpha + beta > 1) {
+    return false;
+  }
+  *t_out = t;
+  return true;
+}
+
+
 void Optics::IntersectLineWithTriangles(const float* pt, const float* dir,  // input
                                         int face_id, int face_num,          // input
                                         const float* face_bases,            // input (pt1 - pt2, pt1 - pt3)
@@ -119,65 +293,154 @@ void Optics::IntersectLineWithTriangles(const float* pt, const float* dir,  // i
   float flag_in = Math::Dot3(dir, norm_in);
 
   for (int i = 0; i < face_num; i++) {
-    const float* curr_face_point = face_points + i * 9;
-    const float* curr_face_base = face_bases + i * 6;
-    const float* curr_face_norm = face_norm + i * 3;
-
-    if (Math::Dot3(dir, curr_face_norm) * flag_in >= 0) {
+    if (Math::Dot3(dir, face_norm + i * 3) * flag_in >= 0) {
       continue;
     }
 
-    float ff04 = curr_face_base[0] * curr_face_base[4];
-    float ff05 = curr_face_base[0] * curr_face_base[5];
-    float ff13 = curr_face_base[1] * curr_face_base[3];
-    float ff15 = curr_face_base[1] * curr_face_base[5];
-    float ff23 = curr_face_base[2] * curr_face_base[3];
-    float ff24 = curr_face_base[2] * curr_face_base[4];
-
-    float c = dir[0] * ff15 + dir[1] * ff23 + dir[2] * ff04 - dir[0] * ff24 - dir[1] * ff05 - dir[2] * ff13;
-    if (Math::FloatEqualZero(c)) {
-      continue;
+    float t;
+    if (IntersectLineWithTriangle(pt, dir, face_bases + i * 6, face_points + i * 9, &t) && t < min_t) {
+      min_t = t;
+      p[0] = pt[0] + t * dir[0];
+      p[1] = pt[1] + t * dir[1];
+      p[2] = pt[2] + t * dir[2];
+      *idx = i;
     }
+  }
+}
 
 
-    float a = ff15 * curr_face_point[0] + ff23 * curr_face_point[1] + ff04 * curr_face_point[2] -
-              ff24 * curr_face_point[0] - ff05 * curr_face_point[1] - ff13 * curr_face_point[2];
-    float b = pt[0] * ff15 + pt[1] * ff23 + pt[2] * ff04 - pt[0] * ff24 - pt[1] * ff05 - pt[2] * ff13;
-    float t = (a - b) / c;
-    if (t <= Math::kFloatEps) {
-      continue;
+bool Optics::IntersectLineWithPolygon(const float* pt, const float* dir,  // input
+                                      const float* plane,                 // input (nx, ny, nz, d)
+                                      const float* edges, int edge_num,   // input (mx, my, mz, c) per edge
+                                      float* t_out) {                     // output
+  float c = Math::Dot3(dir, plane);
+  if (Math::FloatEqualZero(c)) {
+    return false;
+  }
+  float t = (plane[3] - Math::Dot3(pt, plane)) / c;
+  if (t <= Math::kFloatEps) {
+    return false;
+  }
+
+  float p[3] = { pt[0] + t * dir[0], pt[1] + t * dir[1], pt[2] + t * dir[2] };
+  for (int k = 0; k < edge_num; k++) {
+    if (Math::Dot3(p, edges + k * 4) < edges[k * 4 + 3] - Math::kFloatEps) {
+      return false;
     }
+  }
+  *t_out = t;
+  return true;
+}
 
-    float dp01 = dir[0] * pt[1];
-    float dp02 = dir[0] * pt[2];
-    float dp10 = dir[1] * pt[0];
-    float dp12 = dir[1] * pt[2];
-    float dp20 = dir[2] * pt[0];
-    float dp21 = dir[2] * pt[1];
-
-    a = dp12 * curr_face_base[3] + dp20 * curr_face_base[4] + dp01 * curr_face_base[5] - dp21 * curr_face_base[3] -
-        dp02 * curr_face_base[4] - dp10 * curr_face_base[5];
-    b = dir[0] * curr_face_base[4] * curr_face_point[2] + dir[1] * curr_face_base[5] * curr_face_point[0] +
-        dir[2] * curr_face_base[3] * curr_face_point[1] - dir[0] * curr_face_base[5] * curr_face_point[1] -
-        dir[1] * curr_face_base[3] * curr_face_point[2] - dir[2] * curr_face_base[4] * curr_face_point[0];
-    float alpha = (a + b) / c;
-    if (alpha < 0 || alpha > 1) {
+
+void Optics::IntersectLineWithPolygons(const float* pt, const float* dir,  // input
+                                       int face_id, const Crystal* crystal,  // input
+                                       float* p, int* idx) {               // output
+  float min_t = std::numeric_limits<float>::max();
+  float flag_in = Math::Dot3(dir, crystal->GetFaceNorm() + face_id * 3);
+
+  auto polygon_num = crystal->TotalPolygons();
+  auto* planes = crystal->GetPolygonPlane();
+  auto* edges = crystal->GetPolygonEdge();
+  auto* edge_offsets = crystal->GetPolygonEdgeOffset();
+  auto* polygon_face_ids = crystal->GetPolygonFaceId();
+  for (int i = 0; i < polygon_num; i++) {
+    if (Math::Dot3(dir, planes + i * 4) * flag_in >= 0) {
       continue;
     }
 
-    a = dp12 * curr_face_base[0] + dp20 * curr_face_base[1] + dp01 * curr_face_base[2] - dp21 * curr_face_base[0] -
-        dp02 * curr_face_base[1] - dp10 * curr_face_base[2];
-    b = dir[0] * curr_face_base[1] * curr_face_point[2] + dir[1] * curr_face_base[2] * curr_face_point[0] +
-        dir[2] * curr_face_base[0] * curr_face_point[1] - dir[0] * curr_face_base[2] * curr_face_point[1] -
-        dir[1] * curr_face_base[0] * curr_face_point[2] - dir[2] * curr_face_base[1] * curr_face_point[0];
-    float beta = -(a + b) / c;
-
-    if (t < min_t && alpha >= 0 && beta >= 0 && alpha + beta <= 1) {
+    float t;
+    if (IntersectLineWithPolygon(pt, dir, planes + i * 4, edges + edge_offsets[i] * 4,
+                                 edge_offsets[i + 1] - edge_offsets[i], &t) &&
+        t < min_t) {
       min_t = t;
       p[0] = pt[0] + t * dir[0];
       p[1] = pt[1] + t * dir[1];
       p[2] = pt[2] + t * dir[2];
-      *idx = i;
+      *idx = polygon_face_ids[i];
+    }
+  }
+}
+
+
+void Optics::IntersectLineWithBvh(const float* pt, const float* dir,    // input
+                                  int face_id, const Crystal* crystal,  // input
+                                  const PolygonBvh& bvh,                // input
+                                  float* p, int* idx) {                 // output
+  float min_t = std::numeric_limits<float>::max();
+  float flag_in = Math::Dot3(dir, crystal->GetFaceNorm() + face_id * 3);
+
+  auto* planes = crystal->GetPolygonPlane();
+  auto* edges = crystal->GetPolygonEdge();
+  auto* edge_offsets = crystal->GetPolygonEdgeOffset();
+  auto* polygon_face_ids = crystal->GetPolygonFaceId();
+  const auto& nodes = bvh.GetNodes();
+  const auto& polygon_indices = bvh.GetPolygonIndices();
+  float inv_dir[3];
+  for (int j = 0; j < 3; j++) {
+    inv_dir[j] = 1.0f / dir[j];
+  }
+
+  // Slab test. Returns the entering distance of the box, or infinity if missed.
+  auto box_distance = [&](const PolygonBvh::Node& node) {
+    float t_near = 0;
+    float t_far = min_t;
+    for (int j = 0; j < 3; j++) {
+      if (dir[j] == 0) {
+        if (pt[j] < node.box_min[j] || pt[j] > node.box_max[j]) {
+          return std::numeric_limits<float>::infinity();
+        }
+        continue;
+      }
+      float t0 = (node.box_min[j] - pt[j]) * inv_dir[j];
+      float t1 = (node.box_max[j] - pt[j]) * inv_dir[j];
+      t_near = std::max(t_near, std::min(t0, t1));
+      t_far = std::min(t_far, std::max(t0, t1));
+    }
+    return t_near <= t_far ? t_near : std::numeric_limits<float>::infinity();
+  };
+
+  int stack[PolygonBvh::kMaxDepth * 2];
+  int stack_size = 0;
+  if (!nodes.empty() && box_distance(nodes[0]) < std::numeric_limits<float>::infinity()) {
+    stack[stack_size++] = 0;
+  }
+  while (stack_size > 0) {
+    const auto& node = nodes[stack[--stack_size]];
+    if (node.count > 0) {
+      for (int k = node.start; k < node.start + node.count; k++) {
+        int i = polygon_indices[k];
+        if (Math::Dot3(dir, planes + i * 4) * flag_in >= 0) {
+          continue;
+        }
+        float t;
+        if (IntersectLineWithPolygon(pt, dir, planes + i * 4, edges + edge_offsets[i] * 4,
+                                     edge_offsets[i + 1] - edge_offsets[i], &t) &&
+            t < min_t) {
+          min_t = t;
+          p[0] = pt[0] + t * dir[0];
+          p[1] = pt[1] + t * dir[1];
+          p[2] = pt[2] + t * dir[2];
+          *idx = polygon_face_ids[i];
+        }
+      }
+      continue;
+    }
+
+    // Visit the nearer child first, so that farther boxes are more likely to be culled by min_t.
+    int left = static_cast<int>(&node - nodes.data()) + 1;
+    int right = node.start;
+    float t_left = box_distance(nodes[left]);
+    float t_right = box_distance(nodes[right]);
+    if (t_left > t_right) {
+      std::swap(left, right);
+      std::swap(t_left, t_right);
+    }
+    if (t_right < std::numeric_limits<float>::infinity()) {
+      stack[stack_size++] = right;
+    }
+    if (t_left < std::numeric_limits<float>::infinity()) {
+      stack[stack_size++] = left;
     }
   }
 }
@@ -371,19 +634,15 @@ float IceRefractiveIndex::Get(float wave_length) {
 }
 
 
+constexpr uint32_t RaySegmentPool::kInvalidId;
+constexpr int RaySegmentPool::kMaxFaceId;
+constexpr size_t RaySegmentPool::kInitCapacity;
 RaySegmentPool* RaySegmentPool::instance_ = nullptr;
 
-RaySegmentPool::RaySegmentPool() : current_chunk_id_(0), next_unused_id_(0) {
-  auto* raySegPool = new RaySegment[kChunkSize];
-  segments_.push_back(raySegPool);
+RaySegmentPool::RaySegmentPool() : size_(0) {
+  Grow();
 }
 
-RaySegmentPool::~RaySegmentPool() {
-  for (auto seg : segments_) {
-    delete[] seg;
-  }
-  segments_.clear();
-}
 
 RaySegmentPool* RaySegmentPool::GetInstance() {
   if (!instance_) {
@@ -392,36 +651,76 @@ RaySegmentPool* RaySegmentPool::GetInstance() {
   return instance_;
 }
 
-RaySegment* RaySegmentPool::GetRaySegment(const float* pt, const float* dir, float w, int faceId) {
-  RaySegment* seg;
-
-  auto id = next_unused_id_.fetch_add(1);
-  if (id >= kChunkSize) {
-    std::unique_lock<std::mutex> lock(id_mutex_);
-    id = next_unused_id_;
-    if (id > kChunkSize) {
-      auto seg_size = segments_.size();
-      if (current_chunk_id_ >= seg_size - 1) {
-        auto* ray_seg_pool = new RaySegment[kChunkSize];
-        segments_.push_back(ray_seg_pool);
-        current_chunk_id_ = seg_size;
-      } else {
-        current_chunk_id_++;
-      }
-      id = 0;
-      next_unused_id_ = 0;
-    }
+
+uint32_t RaySegmentPool::GetRaySegment(const float* pt, const float* dir, float w, int face_id) {
+  if (size_ >= this->w.size()) {
+    Grow();
+  }
+
+  auto id = size_++;
+  prev[id] = kInvalidId;
+  next_reflect[id] = kInvalidId;
+  next_refract[id] = kInvalidId;
+  root_ctx[id] = nullptr;
+  std::copy(dir, dir + 3, this->dir.data() + id * 3);
+  this->w[id] = w;
+  assert(face_id <= kMaxFaceId);
+  this->face_id[id] = static_cast<int16_t>(face_id);
+  is_finished[id] = 0;
+  for (int i = 0; i < 3; i++) {
+#ifdef HALF_RAY_POINT
+    this->pt[id * 3 + i] = Math::FloatToHalf(pt[i]);
+#else
+    this->pt[id * 3 + i] = pt[i];
+#endif
+  }
+  return static_cast<uint32_t>(id);
+}
+
+
+void RaySegmentPool::GetPoint(uint32_t id, float* pt) const {
+  for (size_t i = 0; i < 3; i++) {
+#ifdef HALF_RAY_POINT
+    pt[i] = Math::HalfToFloat(this->pt[static_cast<size_t>(id) * 3 + i]);
+#else
+    pt[i] = this->pt[static_cast<size_t>(id) * 3 + i];
+#endif
   }
+}
+
+
+const float* RaySegmentPool::GetDirection(uint32_t id) const {
+  return dir.data() + static_cast<size_t>(id) * 3;
+}
 
-  seg = segments_[current_chunk_id_] + id;
-  seg->ResetWith(pt, dir, w, faceId);
 
-  return seg;
+size_t RaySegmentPool::BytesPerSegment() {
+  return sizeof(uint32_t) * 3 + sizeof(RayInfo*) + sizeof(float) * 4 + sizeof(int16_t) + sizeof(uint8_t) +
+         sizeof(pt[0]) * 3;
 }
 
+
+void RaySegmentPool::Grow() {
+  auto capacity = std::max(w.size() * 2, kInitCapacity);
+  prev.resize(capacity);
+  next_reflect.resize(capacity);
+  next_refract.resize(capacity);
+  root_ctx.resize(capacity);
+  dir.resize(capacity * 3);
+  w.resize(capacity);
+  face_id.resize(capacity);
+  is_finished.resize(capacity);
+  pt.resize(capacity * 3);
+}
+
+
 void RaySegmentPool::Clear() {
-  next_unused_id_ = 0;
-  current_chunk_id_ = 0;
+  size_ = 0;
+}
+
+
+size_t RaySegmentPool::Size() const {
+  return size_;
 }
 
 
@@ -1,9 +1,8 @@
 #ifndef SRC_OPTICS_H_
 #define SRC_OPTICS_H_
 
-#include <atomic>
+#include <cstdint>
 #include <memory>
-#include <mutex>
 #include <vector>
 
 #include "crystal.h"
@@ -12,61 +11,72 @@
 
 namespace IceHalo {
 
-class RaySegmentPool;
 struct RayInfo;
 
-struct RaySegment {
-  friend class RaySegmentPool;
-
- public:
-  void ResetWith(const float* pt, const float* dir, float w, int face_id);
-
-  RaySegment* next_reflect;
-  RaySegment* next_refract;
-  RaySegment* prev;
-  RayInfo* root_ctx;
-
-  Math::Vec3f pt;
-  Math::Vec3f dir;
-  float w;
-  int face_id;
-
-  bool is_finished;
-
- private:
-  RaySegment();
-};
-
-
+/*! @brief Storage of all ray segments, in structure-of-arrays layout.
+ *
+ * A segment is referred by its 32-bit index. Links between segments are indices too, and kInvalidId means none.
+ * Every array holds one field of all segments, so walking along a ray path only touches prev and face_id.
+ * Storage is kept after Clear(), so later simulations reuse it.
+ *
+ * Points are only for debug output. With HALF_RAY_POINT defined they are kept in half precision.
+ */
 class RaySegmentPool {
  public:
-  ~RaySegmentPool();
   RaySegmentPool(RaySegmentPool const&) = delete;
   void operator=(RaySegmentPool const&) = delete;
 
-  RaySegment* GetRaySegment(const float* pt, const float* dir, float w, int faceId);
+  uint32_t GetRaySegment(const float* pt, const float* dir, float w, int face_id);  // Not thread safe.
   void Clear();
+  size_t Size() const;
+  void GetPoint(uint32_t id, float* pt) const;
+  const float* GetDirection(uint32_t id) const;
+  static size_t BytesPerSegment();
 
   static RaySegmentPool* GetInstance();
 
+  static constexpr uint32_t kInvalidId = 0xffffffffu;
+  static constexpr int kMaxFaceId = INT16_MAX;  // Face ids are stored as int16_t. See face_id.
+
+  std::vector<uint32_t> prev;
+  std::vector<uint32_t> next_reflect;
+  std::vector<uint32_t> next_refract;
+  std::vector<RayInfo*> root_ctx;
+  std::vector<float> dir;  // 3 floats for each segment
+  std::vector<float> w;
+  std::vector<int16_t> face_id;
+  std::vector<uint8_t> is_finished;
+#ifdef HALF_RAY_POINT
+  std::vector<uint16_t> pt;  // 3 half floats for each segment
+#else
+  std::vector<float> pt;  // 3 floats for each segment
+#endif
+
  private:
   RaySegmentPool();
+  void Grow();
 
-  static constexpr uint32_t kChunkSize = 1024 * 512;
+  static constexpr size_t kInitCapacity = 1024 * 512;
   static RaySegmentPool* instance_;
 
-  std::vector<RaySegment*> segments_;
-  size_t current_chunk_id_;
-  std::atomic<uint32_t> next_unused_id_;
-  std::mutex id_mutex_;
+  size_t size_;
 };
 
 
 class Optics {
  public:
+  /*! \brief Compute reflected and refracted rays on the surface a ray hits.
+   *
+   * Rays go into dir_out and w_out in pairs of (reflection, refraction). A branch with non-positive weight
+   * should not be traced.
+   *
+   * \param rand_in optional, one uniform random number per ray. If given, only one branch is kept, chosen with
+   *        probability of Fresnel ratio, and it takes the whole weight.
+   */
   static void HitSurface(const Crystal* crystal, float n, size_t num,                    // input
                          const float* dir_in, const int* face_id_in, const float* w_in,  // input
-                         float* dir_out, float* w_out);                                  // output
+                         float* dir_out, float* w_out,                                   // output
+                         const float* rand_in = nullptr);                                // input, optional
 
   static void Propagate(const Crystal* crystal, size_t num,                                                 // input
                         const float* pt_in, const float* dir_in, const float* w_in, const int* face_id_in,  // input
@@ -91,6 +101,46 @@ class Optics {
                                          const float* face_norm,             // input
                                          float* p, int* idx);                // output
 
+  /*! \brief Intersect a line with polygon faces of a crystal and find the nearest intersection point.
+   *
+   * \param pt a point on the line, 3 floats
+   * \param dir the direction of the line, 3 floats
+   * \param face_id the face where pt lies
+   * \param crystal the crystal
+   * \param p output argument, the intersection point
+   * \param idx output argument, the face index (a triangle within the hit polygon) of the intersection point
+   */
+  static void IntersectLineWithPolygons(const float* pt, const float* dir,    // input
+                                        int face_id, const Crystal* crystal,  // input
+                                        float* p, int* idx);                  // output
+
+  /*! \brief The same as IntersectLineWithPolygons(), but only tests polygons whose bounding boxes are hit.
+   */
+  static void IntersectLineWithBvh(const float* pt, const float* dir,    // input
+                                   int face_id, const Crystal* crystal,  // input
+                                   const PolygonBvh& bvh,                // input
+                                   float* p, int* idx);                  // output
+
+  /*! \brief Intersect a line with a convex polygon.
+   *
+   * \param t output argument, the distance along dir to the intersection point.
+   * \return true if they intersect in front of pt.
+   */
+  static bool IntersectLineWithPolygon(const float* pt, const float* dir,  // input
+                                       const float* plane,                 // input, (nx, ny, nz, d)
+                                       const float* edges, int edge_num,   // input, (mx, my, mz, c) per edge
+                                       float* t);                          // output
+
+  /*! \brief Intersect a line with a triangle.
+   *
+   * \param t output argument, the distance along dir to the intersection point.
+   * \return true if they intersect in front of pt.
+   */
+  static bool IntersectLineWithTriangle(const float* pt, const float* dir,  // input
+                                        const float* face_base,             // input, (pt1 - pt2, pt1 - pt3)
+                                        const float* face_point,            // input (pt1, pt2, pt3)
+                                        float* t);                          // output
+
   static void IntersectLineWithTrianglesSimd(const float* pt, const float* dir,  // input
                                              int face_id, int face_num,          // input
                                              const float* face_bases,            //
@@ -1,9 +1,11 @@
 #include "render.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <limits>
 #include <utility>
+#include <vector>
 
 #include "context.h"
 #include "mymath.h"
@@ -206,9 +208,99 @@ void SrgbGamma(float* linear_rgb) {
 }
 
 
+PixelAccumulator::PixelAccumulator(AccumulatorType type, size_t pixel_num) : type_(type), pixel_num_(pixel_num) {
+  if (type_ == AccumulatorType::kDouble) {
+    data_double_.resize(pixel_num_, 0.0);
+  } else {
+    data_.resize(pixel_num_, 0.0f);
+    compensation_.resize(pixel_num_, 0.0f);
+  }
+}
+
+
+AccumulatorType PixelAccumulator::GetType() const {
+  return type_;
+}
+
+
+size_t PixelAccumulator::GetPixelNum() const {
+  return pixel_num_;
+}
+
+
+void PixelAccumulator::Add(const uint32_t* idx, const float* val, size_t num, float scale) {
+  if (type_ == AccumulatorType::kDouble) {
+    for (size_t i = 0; i < num; i++) {
+      data_double_[idx[i]] += val[i] * scale;
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < num; i++) {
+    auto k = idx[i];
+    auto tmp_val = val[i] * scale - compensation_[k];
+    auto tmp_sum = data_[k] + tmp_val;
+    compensation_[k] = tmp_sum - data_[k] - tmp_val;
+    data_[k] = tmp_sum;
+  }
+}
+
+
+void PixelAccumulator::Add(const PixelAccumulator& other) {
+  for (size_t i = 0; i < pixel_num_; i++) {
+    auto v = other.Get(i);
+    if (type_ == AccumulatorType::kDouble) {
+      data_double_[i] += v;
+    } else {
+      auto tmp_val = static_cast<float>(v) - compensation_[i];
+      auto tmp_sum = data_[i] + tmp_val;
+      compensation_[i] = tmp_sum - data_[i] - tmp_val;
+      data_[i] = tmp_sum;
+    }
+  }
+}
+
+
+double PixelAccumulator::Get(size_t i) const {
+  if (type_ == AccumulatorType::kDouble) {
+    return data_double_[i];
+  } else {
+    return static_cast<double>(data_[i]) - compensation_[i];
+  }
+}
+
+
+bool PixelAccumulator::SaveState(File& file) const {
+  bool ok = file.Write(static_cast<uint8_t>(type_)) == 1;
+  if (type_ == AccumulatorType::kDouble) {
+    ok = ok && file.Write(data_double_.data(), pixel_num_) == pixel_num_;
+  } else {
+    ok = ok && file.Write(data_.data(), pixel_num_) == pixel_num_;
+    ok = ok && file.Write(compensation_.data(), pixel_num_) == pixel_num_;
+  }
+  return ok;
+}
+
+
+bool PixelAccumulator::LoadState(File& file) {
+  uint8_t type = 0;
+  if (file.Read(&type) != 1 || type > static_cast<uint8_t>(AccumulatorType::kDouble)) {
+    return false;
+  }
+  *this = PixelAccumulator(static_cast<AccumulatorType>(type), pixel_num_);
+  if (type_ == AccumulatorType::kDouble) {
+    return file.Read(data_double_.data(), pixel_num_) == pixel_num_;
+  } else {
+    return file.Read(data_.data(), pixel_num_) == pixel_num_ &&
+           file.Read(compensation_.data(), pixel_num_) == pixel_num_;
+  }
+}
+
+
 constexpr int SpectrumRenderer::kMinWavelength;
 constexpr int SpectrumRenderer::kMaxWaveLength;
 constexpr uint8_t SpectrumRenderer::kColorMaxVal;
+constexpr uint32_t SpectrumRenderer::kStateMagic;
 constexpr float SpectrumRenderer::kWhitePointD65[];
 constexpr float SpectrumRenderer::kXyzToRgb[];
 constexpr float SpectrumRenderer::kCmfX[];
@@ -216,7 +308,9 @@ constexpr float SpectrumRenderer::kCmfY[];
 constexpr float SpectrumRenderer::kCmfZ[];
 
 
-SpectrumRenderer::SpectrumRenderer(ProjectContextPtr context) : context_(std::move(context)), total_w_(0) {}
+SpectrumRenderer::SpectrumRenderer(ProjectContextPtr context)
+    : context_(std::move(context)), total_w_(0), noise_estimation_(false), noise_sum_(nullptr),
+      noise_sq_sum_(nullptr) {}
 
 
 SpectrumRenderer::~SpectrumRenderer() {
@@ -246,6 +340,16 @@ void SpectrumRenderer::LoadData() {
 
 
 void SpectrumRenderer::LoadData(float wl, float weight, const float* ray_data, size_t num) {
+  LoadData(wl, weight, ray_data, num, context_->GetInitRayNum());
+}
+
+
+// Data are traced from init_ray_num initial rays, which is needed for normalization.
+//
+// By default every wavelength has a plane of its own. In XYZ accumulation mode, or in continuous spectrum mode where
+// wavelengths hardly repeat, rays are weighted by color matching functions at their wavelength when splatted, into
+// X, Y, Z planes. Then memory does not grow with wavelength number.
+void SpectrumRenderer::LoadData(float wl, float weight, const float* ray_data, size_t num, size_t init_ray_num) {
   auto projection_type = context_->cam_ctx_.GetLensType();
   auto& projection_functions = GetProjectionFunctions();
   if (projection_functions.find(projection_type) == projection_functions.end()) {
@@ -254,8 +358,7 @@ void SpectrumRenderer::LoadData(float wl, float weight, const float* ray_data, s
   }
   auto& pf = projection_functions[projection_type];
 
-  auto wavelength = static_cast<int>(wl);
-  if (wavelength < SpectrumRenderer::kMinWavelength || wavelength > SpectrumRenderer::kMaxWaveLength || weight < 0) {
+  if (wl < SpectrumRenderer::kMinWavelength || wl > SpectrumRenderer::kMaxWaveLength || weight < 0) {
     std::fprintf(stderr, "Wavelength out of range!\n");
     return;
   }
@@ -276,23 +379,12 @@ void SpectrumRenderer::LoadData(float wl, float weight, const float* ray_data, s
   }
   threading_pool->WaitFinish();
 
-  float* current_data = nullptr;
-  float* current_data_compensation = nullptr;
-  auto it = spectrum_data_.find(wavelength);
-  if (it != spectrum_data_.end()) {
-    current_data = it->second;
-    current_data_compensation = spectrum_data_compensation_[wavelength];
-  } else {
-    current_data = new float[img_hei * img_wid];
-    current_data_compensation = new float[img_hei * img_wid];
-    for (decltype(img_hei) i = 0; i < img_hei * img_wid; i++) {
-      current_data[i] = 0;
-      current_data_compensation[i] = 0;
-    }
-    spectrum_data_[wavelength] = current_data;
-    spectrum_data_compensation_[wavelength] = current_data_compensation;
-  }
-
+  // Rays out of image are dropped, and the rest are turned into (pixel, value) pairs.
+  auto pixel_num = static_cast<size_t>(img_hei * img_wid);
+  std::vector<uint32_t> pixel_idx;
+  std::vector<float> pixel_val;
+  pixel_idx.reserve(num);
+  pixel_val.reserve(num);
   for (decltype(num) i = 0; i < num; i++) {
     int x = tmp_xy[i * 2 + 0];
     int y = tmp_xy[i * 2 + 1];
@@ -306,46 +398,110 @@ void SpectrumRenderer::LoadData(float wl, float weight, const float* ray_data, s
     if (x < 0 || x >= static_cast<int>(img_wid) || y < 0 || y >= static_cast<int>(img_hei)) {
       continue;
     }
-    auto tmp_val = ray_data[i * 4 + 3] * weight - current_data_compensation[y * img_wid + x];
-    auto tmp_sum = current_data[y * img_wid + x] + tmp_val;
-    current_data_compensation[y * img_wid + x] = tmp_sum - current_data[y * img_wid + x] - tmp_val;
-    current_data[y * img_wid + x] = tmp_sum;
+    pixel_idx.emplace_back(static_cast<uint32_t>(y * img_wid + x));
+    pixel_val.emplace_back(ray_data[i * 4 + 3] * weight);
   }
   delete[] tmp_xy;
 
-  total_w_ += context_->GetInitRayNum() * weight;
+  if (context_->GetSpectrumMode() == SpectrumMode::kContinuous ||
+      context_->render_ctx_.GetAccumulationMode() == AccumulationMode::kXyz) {
+    if (xyz_data_.empty()) {
+      xyz_data_.assign(3, PixelAccumulator(context_->render_ctx_.GetAccumulatorType(), pixel_num));
+    }
+    float cmf[3];
+    GetCmf(wl, cmf);
+    for (int c = 0; c < 3; c++) {
+      xyz_data_[c].Add(pixel_idx.data(), pixel_val.data(), pixel_idx.size(), cmf[c]);
+    }
+  } else {
+    auto wavelength = static_cast<int>(wl);
+    auto it = spectrum_data_.find(wavelength);
+    if (it == spectrum_data_.end()) {
+      it = spectrum_data_.emplace(wavelength, PixelAccumulator(context_->render_ctx_.GetAccumulatorType(), pixel_num))
+               .first;
+    }
+    it->second.Add(pixel_idx.data(), pixel_val.data(), pixel_idx.size(), 1.0f);
+  }
+
+  if (noise_estimation_ && noise_sum_ == nullptr) {
+    noise_sum_ = new double[pixel_num]{};
+    noise_sq_sum_ = new double[pixel_num]{};
+  }
+  if (noise_sum_) {
+    for (size_t i = 0; i < pixel_idx.size(); i++) {
+      double dv = pixel_val[i];
+      noise_sum_[pixel_idx[i]] += dv;
+      noise_sq_sum_[pixel_idx[i]] += dv * dv;
+    }
+  }
+
+  total_w_ += init_ray_num * weight;
 }
 
 
 void SpectrumRenderer::ResetData() {
   total_w_ = 0;
-  for (const auto& kv : spectrum_data_) {
-    delete[] kv.second;
+  spectrum_data_.clear();
+  xyz_data_.clear();
+
+  delete[] noise_sum_;
+  delete[] noise_sq_sum_;
+  noise_sum_ = nullptr;
+  noise_sq_sum_ = nullptr;
+}
+
+
+void SpectrumRenderer::EnableNoiseEstimation(bool enable) {
+  noise_estimation_ = enable;
+  if (!enable) {
+    delete[] noise_sum_;
+    delete[] noise_sq_sum_;
+    noise_sum_ = nullptr;
+    noise_sq_sum_ = nullptr;
   }
-  for (const auto& kv : spectrum_data_compensation_) {
-    delete[] kv.second;
+}
+
+
+float SpectrumRenderer::GetNoiseLevel() const {
+  if (noise_sum_ == nullptr) {
+    return std::numeric_limits<float>::infinity();
   }
-  spectrum_data_.clear();
-  spectrum_data_compensation_.clear();
+
+  // For pixel p with sum s and sum of squares q, the squared relative error is q / s^2. Weighted by s,
+  // the average is sum(q / s) / sum(s).
+  auto img_hei = context_->render_ctx_.GetImageHeight();
+  auto img_wid = context_->render_ctx_.GetImageWidth();
+  auto pixel_num = static_cast<size_t>(img_hei * img_wid);
+  double weighted_err2 = 0;
+  double total_sum = 0;
+  for (size_t i = 0; i < pixel_num; i++) {
+    if (noise_sum_[i] <= 0) {
+      continue;
+    }
+    weighted_err2 += noise_sq_sum_[i] / noise_sum_[i];
+    total_sum += noise_sum_[i];
+  }
+  if (total_sum <= 0) {
+    return std::numeric_limits<float>::infinity();
+  }
+  return static_cast<float>(std::sqrt(weighted_err2 / total_sum));
 }
 
 
 void SpectrumRenderer::RenderToRgb(uint8_t* rgb_data) {
   auto img_hei = context_->render_ctx_.GetImageHeight();
   auto img_wid = context_->render_ctx_.GetImageWidth();
-  auto wl_num = spectrum_data_.size();
-  auto* wl_data = new float[wl_num];
-  auto* flat_spec_data = new float[wl_num * img_wid * img_hei];
+  auto* xyz_data = new float[img_wid * img_hei * 3];
 
-  GatherSpectrumData(wl_data, flat_spec_data);
+  GatherXyzData(xyz_data);
   auto ray_color = context_->render_ctx_.GetRayColor();
   auto background_color = context_->render_ctx_.GetBackgroundColor();
   bool use_rgb = ray_color[0] < 0;
 
   if (use_rgb) {
-    Rgb(wl_num, img_wid * img_hei, wl_data, flat_spec_data, rgb_data);
+    Rgb(img_wid * img_hei, xyz_data, rgb_data);
   } else {
-    Gray(wl_num, img_wid * img_hei, wl_data, flat_spec_data, rgb_data);
+    Gray(img_wid * img_hei, xyz_data, rgb_data);
   }
   for (decltype(img_wid) i = 0; i < img_wid * img_hei; i++) {
     for (int c = 0; c < 3; c++) {
@@ -364,8 +520,143 @@ void SpectrumRenderer::RenderToRgb(uint8_t* rgb_data) {
   // float imgR = std::min(img_wid_ / 2, img_hei_) / 2.0f;
   // TODO
 
-  delete[] wl_data;
-  delete[] flat_spec_data;
+  delete[] xyz_data;
+}
+
+
+bool SpectrumRenderer::SaveState(File& file) const {
+  auto img_hei = context_->render_ctx_.GetImageHeight();
+  auto img_wid = context_->render_ctx_.GetImageWidth();
+  auto pixel_num = static_cast<size_t>(img_hei * img_wid);
+
+  bool ok = file.Write(kStateMagic) == 1;
+  ok = ok && file.Write(static_cast<int32_t>(img_wid)) == 1 && file.Write(static_cast<int32_t>(img_hei)) == 1;
+  ok = ok && file.Write(total_w_) == 1;
+  ok = ok && file.Write(static_cast<uint32_t>(spectrum_data_.size())) == 1;
+  std::vector<int> wavelengths;
+  for (const auto& kv : spectrum_data_) {
+    wavelengths.emplace_back(kv.first);
+  }
+  std::sort(wavelengths.begin(), wavelengths.end());  // Same data, same file.
+  for (auto wl : wavelengths) {
+    ok = ok && file.Write(static_cast<int32_t>(wl)) == 1;
+    ok = ok && spectrum_data_.at(wl).SaveState(file);
+  }
+  ok = ok && file.Write(static_cast<uint8_t>(!xyz_data_.empty())) == 1;
+  for (const auto& a : xyz_data_) {
+    ok = ok && a.SaveState(file);
+  }
+  ok = ok && file.Write(static_cast<uint8_t>(noise_sum_ != nullptr)) == 1;
+  if (noise_sum_) {
+    ok = ok && file.Write(noise_sum_, pixel_num) == pixel_num;
+    ok = ok && file.Write(noise_sq_sum_, pixel_num) == pixel_num;
+  }
+  return ok;
+}
+
+
+bool SpectrumRenderer::LoadState(File& file) {
+  ResetData();
+
+  auto img_hei = context_->render_ctx_.GetImageHeight();
+  auto img_wid = context_->render_ctx_.GetImageWidth();
+  auto pixel_num = static_cast<size_t>(img_hei * img_wid);
+
+  uint32_t magic = 0;
+  int32_t wid = 0;
+  int32_t hei = 0;
+  uint32_t wl_num = 0;
+  if (file.Read(&magic) != 1 || magic != kStateMagic || file.Read(&wid) != 1 || file.Read(&hei) != 1 ||
+      wid != img_wid || hei != img_hei) {
+    std::fprintf(stderr, "Renderer state does not match current image settings!\n");
+    return false;
+  }
+  if (file.Read(&total_w_) != 1 || file.Read(&wl_num) != 1) {
+    ResetData();
+    return false;
+  }
+
+  for (uint32_t i = 0; i < wl_num; i++) {
+    int32_t wavelength = 0;
+    PixelAccumulator data(context_->render_ctx_.GetAccumulatorType(), pixel_num);
+    if (file.Read(&wavelength) != 1 || !data.LoadState(file) || spectrum_data_.count(wavelength)) {
+      ResetData();
+      return false;
+    }
+    spectrum_data_.emplace(wavelength, std::move(data));
+  }
+
+  uint8_t has_xyz = 0;
+  if (file.Read(&has_xyz) != 1) {
+    ResetData();
+    return false;
+  }
+  if (has_xyz) {
+    xyz_data_.assign(3, PixelAccumulator(context_->render_ctx_.GetAccumulatorType(), pixel_num));
+    for (auto& a : xyz_data_) {
+      if (!a.LoadState(file)) {
+        ResetData();
+        return false;
+      }
+    }
+  }
+
+  uint8_t has_noise = 0;
+  if (file.Read(&has_noise) != 1) {
+    ResetData();
+    return false;
+  }
+  if (has_noise) {
+    noise_sum_ = new double[pixel_num];
+    noise_sq_sum_ = new double[pixel_num];
+    if (file.Read(noise_sum_, pixel_num) != pixel_num || file.Read(noise_sq_sum_, pixel_num) != pixel_num) {
+      ResetData();
+      return false;
+    }
+  }
+  if (!noise_estimation_) {
+    EnableNoiseEstimation(false);  // Drop noise data that are not wanted.
+  }
+  return true;
+}
+
+
+bool SpectrumRenderer::Merge(const SpectrumRenderer& other) {
+  auto img_hei = context_->render_ctx_.GetImageHeight();
+  auto img_wid = context_->render_ctx_.GetImageWidth();
+  if (other.context_->render_ctx_.GetImageHeight() != img_hei ||
+      other.context_->render_ctx_.GetImageWidth() != img_wid) {
+    std::fprintf(stderr, "Cannot merge renderers with different image sizes!\n");
+    return false;
+  }
+  auto pixel_num = static_cast<size_t>(img_hei * img_wid);
+
+  for (const auto& kv : other.spectrum_data_) {
+    auto it = spectrum_data_.find(kv.first);
+    if (it == spectrum_data_.end()) {
+      spectrum_data_.emplace(kv.first, kv.second);
+    } else {
+      it->second.Add(kv.second);
+    }
+  }
+  if (!other.xyz_data_.empty() && xyz_data_.empty()) {
+    xyz_data_ = other.xyz_data_;
+  } else if (!other.xyz_data_.empty()) {
+    for (int c = 0; c < 3; c++) {
+      xyz_data_[c].Add(other.xyz_data_[c]);
+    }
+  }
+  total_w_ += other.total_w_;
+
+  if (noise_sum_ && other.noise_sum_) {
+    for (size_t i = 0; i < pixel_num; i++) {
+      noise_sum_[i] += other.noise_sum_[i];
+      noise_sq_sum_[i] += other.noise_sq_sum_[i];
+    }
+  } else if (noise_sum_ || other.noise_sum_) {
+    EnableNoiseEstimation(false);  // Partial noise data are meaningless.
+  }
+  return true;
 }
 
 
@@ -382,7 +673,7 @@ int SpectrumRenderer::LoadDataFromFile(IceHalo::File& file) {
     return -1;
   }
 
-  auto wavelength = static_cast<int>(read_buffer[0]);
+  auto wavelength = read_buffer[0];
   auto wavelength_weight = read_buffer[1];
   if (wavelength < SpectrumRenderer::kMinWavelength || wavelength > SpectrumRenderer::kMaxWaveLength ||
       wavelength_weight < 0) {
@@ -408,44 +699,55 @@ int SpectrumRenderer::LoadDataFromFile(IceHalo::File& file) {
 }
 
 
-void SpectrumRenderer::GatherSpectrumData(float* wl_data_out, float* sp_data_out) {
+// Both per-wavelength planes and X, Y, Z planes go into the result, so data of both spectrum modes can be merged.
+void SpectrumRenderer::GatherXyzData(float* xyz_data_out) const {
   auto img_hei = context_->render_ctx_.GetImageHeight();
   auto img_wid = context_->render_ctx_.GetImageWidth();
-  auto intensity_factor = static_cast<float>(context_->render_ctx_.GetIntensity());
+  auto pixel_num = static_cast<size_t>(img_hei * img_wid);
+  auto factor = 1e5f / total_w_ * static_cast<float>(context_->render_ctx_.GetIntensity());
 
-  int k = 0;
+  for (size_t i = 0; i < pixel_num; i++) {
+    for (int c = 0; c < 3; c++) {
+      xyz_data_out[i * 3 + c] = xyz_data_.empty() ? 0.0f : static_cast<float>(xyz_data_[c].Get(i));
+    }
+  }
   for (const auto& kv : spectrum_data_) {
-    wl_data_out[k] = kv.first;
-    std::memcpy(sp_data_out + k * img_wid * img_hei, kv.second, img_wid * img_hei * sizeof(float));
-    k++;
+    float cmf[3];
+    GetCmf(kv.first, cmf);
+    for (size_t i = 0; i < pixel_num; i++) {
+      for (int c = 0; c < 3; c++) {
+        xyz_data_out[i * 3 + c] += cmf[c] * static_cast<float>(kv.second.Get(i));
+      }
+    }
+  }
+  for (size_t i = 0; i < pixel_num * 3; i++) {
+    xyz_data_out[i] *= factor;
   }
+}
+
 
-  auto factor = 1e5f / total_w_ * intensity_factor;
-  for (decltype(spectrum_data_.size()) i = 0; i < img_wid * img_hei * spectrum_data_.size(); i++) {
-    sp_data_out[i] *= factor;
+void SpectrumRenderer::GetCmf(float wavelength, float* cmf) {
+  constexpr int kCmfNum = kMaxWaveLength - kMinWavelength + 1;
+  if (wavelength < kMinWavelength || wavelength > kMaxWaveLength) {
+    cmf[0] = cmf[1] = cmf[2] = 0;
+    return;
   }
+  float t = wavelength - kMinWavelength;
+  int i0 = std::min(static_cast<int>(t), kCmfNum - 1);
+  int i1 = std::min(i0 + 1, kCmfNum - 1);
+  float a = t - i0;
+  cmf[0] = kCmfX[i0] * (1 - a) + kCmfX[i1] * a;
+  cmf[1] = kCmfY[i0] * (1 - a) + kCmfY[i1] * a;
+  cmf[2] = kCmfZ[i0] * (1 - a) + kCmfZ[i1] * a;
 }
 
 
-void SpectrumRenderer::Rgb(size_t wavelength_number, size_t data_number,  //
-                           const float* wavelengths,
-                           const float* spec_data,  // spec_data: wavelength_number x data_number
-                           uint8_t* rgb_data) {     // rgb data, data_number x 3
+void SpectrumRenderer::Rgb(size_t data_number, const float* xyz_data,  // xyz_data: data_number x 3
+                           uint8_t* rgb_data) {                        // rgb data, data_number x 3
   for (decltype(data_number) i = 0; i < data_number; i++) {
-    /* Step 1. Spectrum to XYZ */
-    float xyz[3] = { 0 };
-    for (decltype(wavelength_number) j = 0; j < wavelength_number; j++) {
-      auto wl = static_cast<int>(wavelengths[j]);
-      if (wl < kMinWavelength || wl > kMaxWaveLength) {
-        continue;
-      }
-      float v = spec_data[j * data_number + i];
-      xyz[0] += kCmfX[wl - kMinWavelength] * v;
-      xyz[1] += kCmfY[wl - kMinWavelength] * v;
-      xyz[2] += kCmfZ[wl - kMinWavelength] * v;
-    }
-
-    /* Step 2. XYZ to linear RGB */
+    /* Step 1. XYZ to linear RGB */
+    float xyz[3];
+    std::memcpy(xyz, xyz_data + i * 3, sizeof(float) * 3);
     float gray[3];
     for (int j = 0; j < 3; j++) {
       gray[j] = kWhitePointD65[j] * xyz[1];
@@ -474,7 +776,7 @@ void SpectrumRenderer::Rgb(size_t wavelength_number, size_t data_number,  //
       rgb[j] = std::min(std::max(rgb[j], 0.0f), 1.0f);
     }
 
-    /* Step 3. Convert linear sRGB to sRGB */
+    /* Step 2. Convert linear sRGB to sRGB */
     SrgbGamma(rgb);
     for (int j = 0; j < 3; j++) {
       rgb_data[i * 3 + j] = static_cast<uint8_t>(rgb[j] * 255);
@@ -483,28 +785,13 @@ void SpectrumRenderer::Rgb(size_t wavelength_number, size_t data_number,  //
 }
 
 
-void SpectrumRenderer::Gray(size_t wavelength_number, size_t data_number,  //
-                            const float* wavelengths,
-                            const float* spec_data,  // spec_data: wavelength_number x data_number
-                            uint8_t* rgb_data) {     // rgb data, data_number x 3
+void SpectrumRenderer::Gray(size_t data_number, const float* xyz_data,  // xyz_data: data_number x 3
+                            uint8_t* rgb_data) {                        // rgb data, data_number x 3
   for (decltype(data_number) i = 0; i < data_number; i++) {
-    /* Step 1. Spectrum to XYZ */
-    float xyz[3] = { 0 };
-    for (decltype(wavelength_number) j = 0; j < wavelength_number; j++) {
-      auto wl = static_cast<int>(wavelengths[j]);
-      if (wl < kMinWavelength || wl > kMaxWaveLength) {
-        continue;
-      }
-      float v = spec_data[j * data_number + i];
-      xyz[0] += kCmfX[wl - kMinWavelength] * v;
-      xyz[1] += kCmfY[wl - kMinWavelength] * v;
-      xyz[2] += kCmfZ[wl - kMinWavelength] * v;
-    }
-
-    /* Step 2. XYZ to linear RGB */
+    /* Step 1. XYZ to linear RGB */
     float gray[3];
     for (int j = 0; j < 3; j++) {
-      gray[j] = kWhitePointD65[j] * xyz[1];
+      gray[j] = kWhitePointD65[j] * xyz_data[i * 3 + 1];
     }
 
     float rgb[3] = { 0 };
@@ -515,7 +802,7 @@ void SpectrumRenderer::Gray(size_t wavelength_number, size_t data_number,  //
       rgb[j] = std::min(std::max(rgb[j], 0.0f), 1.0f);
     }
 
-    /* Step 3. Convert linear sRGB to sRGB */
+    /* Step 2. Convert linear sRGB to sRGB */
     SrgbGamma(rgb);
     for (int j = 0; j < 3; j++) {
       rgb_data[i * 3 + j] = static_cast<uint8_t>(rgb[j] * 255);
@@ -523,4 +810,58 @@ void SpectrumRenderer::Gray(size_t wavelength_number, size_t data_number,  //
   }
 }
 
+
+namespace {
+
+constexpr uint32_t kCheckpointMagic = 0x4b434849;  // "IHCK"
+constexpr uint32_t kCheckpointVersion = 4;
+
+}  // namespace
+
+
+bool SaveCheckpoint(const std::string& path, const SpectrumRenderer& renderer, size_t total_ray_num,
+                    const std::string& rng_state) {
+  bool saved = WriteFileAtomically(path, [&](File& file) {
+    bool ok = file.Write(kCheckpointMagic) == 1 && file.Write(kCheckpointVersion) == 1;
+    ok = ok && file.Write(static_cast<uint64_t>(total_ray_num)) == 1;
+    ok = ok && file.Write(static_cast<uint32_t>(rng_state.size())) == 1;
+    ok = ok && file.Write(rng_state.data(), rng_state.size()) == rng_state.size();
+    return ok && renderer.SaveState(file);
+  });
+  if (!saved) {
+    std::fprintf(stderr, "Failed to write checkpoint %s!\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+bool LoadCheckpoint(const std::string& path, SpectrumRenderer* renderer, size_t* total_ray_num,
+                    std::string* rng_state) {
+  File file(path.c_str());
+  if (!file.Open(OpenMode::kRead | OpenMode::kBinary)) {
+    std::fprintf(stderr, "Cannot open checkpoint file %s!\n", path.c_str());
+    return false;
+  }
+
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  uint64_t ray_num = 0;
+  uint32_t state_len = 0;
+  if (file.Read(&magic) != 1 || magic != kCheckpointMagic || file.Read(&version) != 1 ||
+      version != kCheckpointVersion || file.Read(&ray_num) != 1 || file.Read(&state_len) != 1) {
+    std::fprintf(stderr, "Checkpoint file %s cannot be recognized!\n", path.c_str());
+    return false;
+  }
+  std::string state(state_len, '\0');
+  if (file.Read(&state[0], state_len) != state_len || !renderer->LoadState(file)) {
+    std::fprintf(stderr, "Checkpoint file %s is broken!\n", path.c_str());
+    return false;
+  }
+
+  *total_ray_num = static_cast<size_t>(ray_num);
+  *rng_state = std::move(state);
+  return true;
+}
+
 }  // namespace IceHalo
@@ -1,8 +1,11 @@
 #ifndef SRC_RENDER_H_
 #define SRC_RENDER_H_
 
+#include <cstdint>
 #include <functional>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "context.h"
 #include "files.h"
@@ -88,6 +91,43 @@ MyUnorderedMap<LensType, ProjectionFunction>& GetProjectionFunctions();
 void SrgbGamma(float* linear_rgb);
 
 
+/*! @brief A plane of per-pixel sums of splatted values.
+ *
+ * Sums are kept in double, or in float with Kahan compensation. Both take 8 bytes per pixel, while a double sum
+ * is as accurate and costs one add per splat rather than a dependent chain of four.
+ */
+class PixelAccumulator {
+ public:
+  PixelAccumulator(AccumulatorType type, size_t pixel_num);
+
+  AccumulatorType GetType() const;
+  size_t GetPixelNum() const;
+
+  /*! @brief Add val[i] * scale to pixel idx[i], for every i in [0, num).
+   */
+  void Add(const uint32_t* idx, const float* val, size_t num, float scale);
+
+  /*! @brief Add sums of another accumulator of the same pixel number, of whatever type.
+   */
+  void Add(const PixelAccumulator& other);
+
+  double Get(size_t i) const;
+
+  bool SaveState(File& file) const;
+
+  /*! @brief Replace sums with those written by SaveState(). The type is taken from file.
+   */
+  bool LoadState(File& file);
+
+ private:
+  AccumulatorType type_;
+  size_t pixel_num_;
+  std::vector<float> data_;          // Only for Kahan type
+  std::vector<float> compensation_;  // Only for Kahan type
+  std::vector<double> data_double_;  // Only for double type
+};
+
+
 class SpectrumRenderer {
  public:
   explicit SpectrumRenderer(ProjectContextPtr context);
@@ -95,29 +135,68 @@ class SpectrumRenderer {
 
   void LoadData();
   void LoadData(float wavelength, float weight, const float* ray_data, size_t num = 1);
+  void LoadData(float wavelength, float weight, const float* ray_data, size_t num, size_t init_ray_num);
   void ResetData();
   void RenderToRgb(uint8_t* rgb_data);
 
+  void EnableNoiseEstimation(bool enable);
+
+  /*! @brief Estimate the noise level of current accumulated image.
+   *
+   * Every pixel keeps a running sum and sum of squares of its splatted weights, from which the relative
+   * standard error of the pixel is computed. The result is the RMS of these errors, weighted by pixel
+   * brightness, so it follows the halo-bearing pixels rather than the sparse background.
+   *
+   * @return the relative standard error, or infinity if noise estimation is disabled or there is no data.
+   */
+  float GetNoiseLevel() const;
+
+  /*! @brief Write all accumulated data into an opened file, including noise estimation data if enabled.
+   *
+   * @param file an opened file, in binary write mode.
+   * @return true if succeeded.
+   */
+  bool SaveState(File& file) const;
+
+  /*! @brief Replace all accumulated data with those written by SaveState().
+   *
+   * @param file an opened file, in binary read mode.
+   * @return true if succeeded. On failure, current data are cleared.
+   */
+  bool LoadState(File& file);
+
+  /*! @brief Add all accumulated data of another renderer into this one, e.g. results of different shards.
+   *
+   * Both renderers should share the same image settings. Noise estimation data are kept only if both have them.
+   *
+   * @return true if succeeded.
+   */
+  bool Merge(const SpectrumRenderer& other);
+
   static constexpr int kMinWavelength = 360;
   static constexpr int kMaxWaveLength = 830;
   static constexpr uint8_t kColorMaxVal = 255;
+  static constexpr uint32_t kStateMagic = 0x52534849;  // "IHSR"
 
  private:
   int LoadDataFromFile(File& file);
-  void GatherSpectrumData(float* wl_data_out, float* sp_data_out);
+  void GatherXyzData(float* xyz_data_out) const;
 
-  static void Rgb(size_t wavelength_number, size_t data_number,       //
-                  const float* wavelengths, const float* spec_data,   // spec_data: wavelength_number x data_number
-                  uint8_t* rgb_data);                                 // rgb data, data_number x 3
-  static void Gray(size_t wavelength_number, size_t data_number,      //
-                   const float* wavelengths, const float* spec_data,  // spec_data: wavelength_number x data_number
-                   uint8_t* rgb_data);                                // rgb data, data_number x 3
+  static void GetCmf(float wavelength, float* cmf);  // Linear between 1nm samples
+  static void Rgb(size_t data_number, const float* xyz_data,  // xyz_data: data_number x 3
+                  uint8_t* rgb_data);                         // rgb data, data_number x 3
+  static void Gray(size_t data_number, const float* xyz_data,  // xyz_data: data_number x 3
+                   uint8_t* rgb_data);                         // rgb data, data_number x 3
 
   ProjectContextPtr context_;
-  std::unordered_map<int, float*> spectrum_data_;
-  std::unordered_map<int, float*> spectrum_data_compensation_;
+  std::unordered_map<int, PixelAccumulator> spectrum_data_;
+  std::vector<PixelAccumulator> xyz_data_;  // X, Y, Z planes. Empty if no data are splatted into them.
   float total_w_;
 
+  bool noise_estimation_;
+  double* noise_sum_;     // Per-pixel sum of splatted weights, over all wavelengths.
+  double* noise_sq_sum_;  // Per-pixel sum of squared splatted weights.
+
   static constexpr float kWhitePointD65[] = { 0.95047f, 1.00000f, 1.08883f };  // D65 for sRGB
   static constexpr float kXyzToRgb[] = { 3.2405f, -1.5371f, -0.4985f, -0.9693f, 1.8760f,
                                          0.0416f, 0.0556f,  -0.2040f, 1.0572f };
@@ -368,6 +447,26 @@ class SpectrumRenderer {
   };
 };
 
+
+/*! @brief Save a checkpoint file, from which accumulation can be resumed. It is written into a temporary file then
+ *         renamed, so a crash during saving never corrupts the previous checkpoint.
+ *
+ * @param path checkpoint file path.
+ * @param renderer the renderer holding accumulated data.
+ * @param total_ray_num number of rays traced so far.
+ * @param rng_state state of random number generator. May be empty, e.g. for a merged checkpoint.
+ * @return true if succeeded.
+ */
+bool SaveCheckpoint(const std::string& path, const SpectrumRenderer& renderer, size_t total_ray_num,
+                    const std::string& rng_state);
+
+/*! @brief Load a checkpoint file written by SaveCheckpoint().
+ *
+ * @return true if succeeded.
+ */
+bool LoadCheckpoint(const std::string& path, SpectrumRenderer* renderer, size_t* total_ray_num,
+                    std::string* rng_state);
+
 }  // namespace IceHalo
 
 
@@ -1,8 +1,13 @@
 #include "simulation.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <random>
 #include <stack>
 #include <utility>
+#include <vector>
 
 #include "mymath.h"
 #include "threadingpool.h"
@@ -10,7 +15,7 @@
 namespace IceHalo {
 
 SimulationBufferData::SimulationBufferData()
-    : pt{ nullptr }, dir{ nullptr }, w{ nullptr }, face_id{ nullptr }, ray_seg{ nullptr }, ray_num(0) {}
+    : pt{ nullptr }, dir{ nullptr }, w{ nullptr }, face_id{ nullptr }, ray_seg{ nullptr }, capacity{ 0, 0 } {}
 
 
 SimulationBufferData::~SimulationBufferData() {
@@ -22,7 +27,6 @@ void SimulationBufferData::Clean() {
   for (int i = 0; i < 2; i++) {
     DeleteBuffer(i);
   }
-  ray_num = 0;
 }
 
 
@@ -38,48 +42,52 @@ void SimulationBufferData::DeleteBuffer(int idx) {
   w[idx] = nullptr;
   face_id[idx] = nullptr;
   ray_seg[idx] = nullptr;
+  capacity[idx] = 0;
 }
 
 
-void SimulationBufferData::Allocate(size_t ray_number) {
+void SimulationBufferData::Reserve(size_t ray_number) {
   for (int i = 0; i < 2; i++) {
-    auto tmp_pt = new float[ray_number * 3];
-    auto tmp_dir = new float[ray_number * 3];
-    auto tmp_w = new float[ray_number];
-    auto tmp_face_id = new int[ray_number];
-    auto tmp_ray_seg = new RaySegment*[ray_number];
-
-    if (pt[i]) {
-      size_t n = std::min(this->ray_num, ray_number);
-      std::memcpy(tmp_pt, pt[i], sizeof(float) * 3 * n);
-      std::memcpy(tmp_dir, dir[i], sizeof(float) * 3 * n);
-      std::memcpy(tmp_w, w[i], sizeof(float) * n);
-      std::memcpy(tmp_face_id, face_id[i], sizeof(int) * n);
-      std::memcpy(tmp_ray_seg, ray_seg[i], sizeof(void*) * n);
-
-      DeleteBuffer(i);
-    }
+    Reserve(i, ray_number);
+  }
+}
+
 
-    pt[i] = tmp_pt;
-    dir[i] = tmp_dir;
-    w[i] = tmp_w;
-    face_id[i] = tmp_face_id;
-    ray_seg[i] = tmp_ray_seg;
+void SimulationBufferData::Reserve(int idx, size_t ray_number) {
+  if (capacity[idx] >= ray_number) {
+    return;
   }
-  this->ray_num = ray_number;
+
+  DeleteBuffer(idx);
+  pt[idx] = new float[ray_number * 3];
+  dir[idx] = new float[ray_number * 3];
+  w[idx] = new float[ray_number];
+  face_id[idx] = new int[ray_number];
+  ray_seg[idx] = new uint32_t[ray_number];
+  capacity[idx] = ray_number;
+}
+
+
+void SimulationBufferData::SwapSides() {
+  std::swap(pt[0], pt[1]);
+  std::swap(dir[0], dir[1]);
+  std::swap(w[0], w[1]);
+  std::swap(face_id[0], face_id[1]);
+  std::swap(ray_seg[0], ray_seg[1]);
+  std::swap(capacity[0], capacity[1]);
 }
 
 
 void SimulationBufferData::Print() {
   std::printf("pt[0]                    dir[0]                   w[0]\n");
-  for (decltype(ray_num) i = 0; i < ray_num; i++) {
+  for (size_t i = 0; i < capacity[0]; i++) {
     std::printf("%+.4f,%+.4f,%+.4f  ", pt[0][i * 3 + 0], pt[0][i * 3 + 1], pt[0][i * 3 + 2]);
     std::printf("%+.4f,%+.4f,%+.4f  ", dir[0][i * 3 + 0], dir[0][i * 3 + 1], dir[0][i * 3 + 2]);
     std::printf("%+.4f\n", w[0][i]);
   }
 
   std::printf("pt[1]                    dir[1]                   w[1]\n");
-  for (decltype(ray_num) i = 0; i < ray_num; i++) {
+  for (size_t i = 0; i < capacity[1]; i++) {
     std::printf("%+.4f,%+.4f,%+.4f  ", pt[1][i * 3 + 0], pt[1][i * 3 + 1], pt[1][i * 3 + 2]);
     std::printf("%+.4f,%+.4f,%+.4f  ", dir[1][i * 3 + 0], dir[1][i * 3 + 1], dir[1][i * 3 + 2]);
     std::printf("%+.4f\n", w[1][i]);
@@ -105,13 +113,13 @@ void EnterRayData::Allocate(size_t ray_number) {
   DeleteBuffer();
 
   ray_dir = new float[ray_number * 3];
-  ray_seg = new RaySegment*[ray_number];
+  ray_seg = new uint32_t[ray_number];
 
   for (decltype(ray_number) i = 0; i < ray_number; i++) {
     ray_dir[i * 3 + 0] = 0;
     ray_dir[i * 3 + 1] = 0;
     ray_dir[i * 3 + 2] = 0;
-    ray_seg[i] = nullptr;
+    ray_seg[i] = RaySegmentPool::kInvalidId;
   }
 
   this->ray_num = ray_number;
@@ -127,59 +135,184 @@ void EnterRayData::DeleteBuffer() {
 }
 
 
+constexpr int EntryFaceSampler::kBinResolution;
+constexpr int EntryFaceSampler::kMaxTries;
+
+EntryFaceSampler::EntryFaceSampler(const Crystal* crystal)
+    : crystal_(crystal), bin_tables_(6 * kBinResolution * kBinResolution) {}
+
+
+int EntryFaceSampler::Sample(const float* dir) {
+  const auto& bin_table = GetBinTable(Math::CubeMapBin(dir, kBinResolution));
+  auto rng = Math::RandomNumberGenerator::GetInstance();
+  for (int i = 0; i < kMaxTries; i++) {
+    int face = Math::RandomSampler::SampleInt(bin_table.table);
+    if (face < 0) {
+      break;
+    }
+    if (rng->GetUniform() * bin_table.bound[face] < ProjectedArea(face, dir)) {
+      return face;
+    }
+  }
+  return SampleLinear(dir);  // Only for degenerated crystals.
+}
+
+
+const EntryFaceSampler::BinTable& EntryFaceSampler::GetBinTable(int bin) {
+  auto& bin_table = bin_tables_[bin];
+  if (bin_table) {
+    return *bin_table;
+  }
+
+  // For any direction d in the bin, -n.d <= -n.c + |d - c| <= -n.c + radius.
+  float center[3];
+  float radius = Math::CubeMapBinCenter(bin, kBinResolution, center);
+  auto total_faces = crystal_->TotalFaces();
+  auto* face_norm = crystal_->GetFaceNorm();
+  auto* face_area = crystal_->GetFaceArea();
+
+  bin_table.reset(new BinTable);
+  bin_table->bound.resize(total_faces);
+  for (int k = 0; k < total_faces; k++) {
+    float b = 0;
+    if (!std::isnan(face_norm[k * 3 + 0]) && face_area[k] > 0) {
+      b = std::min(std::max(-Math::Dot3(face_norm + k * 3, center) + radius, 0.0f), 1.0f) * face_area[k];
+    }
+    bin_table->bound[k] = b;
+  }
+  bin_table->table = Math::AliasTable(bin_table->bound.data(), total_faces);
+  return *bin_table;
+}
+
+
+float EntryFaceSampler::ProjectedArea(int face, const float* dir) const {
+  auto* face_norm = crystal_->GetFaceNorm();
+  auto* face_area = crystal_->GetFaceArea();
+  if (std::isnan(face_norm[face * 3 + 0]) || face_area[face] <= 0) {
+    return 0;
+  }
+  return std::max(-Math::Dot3(face_norm + face * 3, dir) * face_area[face], 0.0f);
+}
+
+
+int EntryFaceSampler::SampleLinear(const float* dir) const {
+  auto total_faces = crystal_->TotalFaces();
+  std::vector<float> prob(total_faces);
+  float sum = 0;
+  for (int k = 0; k < total_faces; k++) {
+    prob[k] = ProjectedArea(k, dir);
+    sum += prob[k];
+  }
+  for (int k = 0; k < total_faces; k++) {
+    prob[k] /= sum;
+  }
+  return Math::RandomSampler::SampleInt(prob.data(), total_faces);
+}
+
+
+constexpr size_t Simulator::kMinBatchRayNum;
+constexpr size_t Simulator::kSortBlockSize;
+
 Simulator::Simulator(ProjectContextPtr context)
-    : context_(std::move(context)), current_wavelength_index_(-1), total_ray_num_(0), active_ray_num_(0),
-      buffer_size_(0), enter_ray_offset_(0) {}
+    : context_(std::move(context)), current_wavelength_{ -1.0f, 0.0f }, current_scatter_index_(0),
+      total_ray_num_(0), active_ray_num_(0), enter_ray_offset_(0) {
+  auto batch_ray_num = GetBatchRayNum();
+  buffer_.Reserve(batch_ray_num * GetBufferSizeFactor());
+  enter_ray_data_.Allocate(batch_ray_num);
+}
+
+
+void Simulator::SetContext(ProjectContextPtr context) {
+  context_ = std::move(context);
+  current_wavelength_ = ProjectContext::WavelengthInfo{ -1.0f, 0.0f };
+  entry_face_samplers_.clear();  // They are keyed by crystals of the old context.
+}
 
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wsign-compare"
 void Simulator::SetWavelengthIndex(int index) {
   if (index < 0 || index >= context_->wavelengths_.size()) {
-    current_wavelength_index_ = -1;
+    current_wavelength_ = ProjectContext::WavelengthInfo{ -1.0f, 0.0f };
     return;
   }
 
-  current_wavelength_index_ = index;
+  current_wavelength_ = context_->wavelengths_[index];
 }
 #pragma clang diagnostic pop
 
 
+void Simulator::SetWavelength(const ProjectContext::WavelengthInfo& wavelength) {
+  current_wavelength_ = wavelength;
+}
+
+
 // Start simulation
 void Simulator::Start() {
-  rays_.clear();
-  exit_ray_segments_.clear();
+  Trace(context_->GetInitRayNum());
+}
+
+
+void Simulator::Start(const BatchSink& sink) {
+  auto total_ray_num = context_->GetInitRayNum();
+  auto batch_ray_num = GetBatchRayNum();
+  for (size_t traced_ray_num = 0; traced_ray_num < total_ray_num; traced_ray_num += batch_ray_num) {
+    auto ray_num = std::min(batch_ray_num, total_ray_num - traced_ray_num);
+    Trace(ray_num);
+    sink(ray_num);
+  }
+}
+
+
+// Initial rays of one batch. Limited by max memory, but at least kMinBatchRayNum.
+size_t Simulator::GetBatchRayNum() const {
+  auto ray_num = context_->GetInitRayNum();
+  auto max_memory = context_->GetMaxMemory() * 1024 * 1024;
+  if (max_memory == 0) {
+    return ray_num;
+  }
+  return std::min(ray_num, std::max(max_memory / EstimateRayMemory(), kMinBatchRayNum));
+}
+
+
+// Trace ray_num initial rays.
+// Buffers and containers keep their capacity between calls, so a steady state run does not allocate them again.
+void Simulator::Trace(size_t ray_num) {
+  auto scatter_num = context_->multi_scatter_info_.size();
+  rays_.resize(scatter_num);
+  exit_ray_segments_.resize(scatter_num);
+  for (size_t i = 0; i < scatter_num; i++) {
+    rays_[i].clear();
+    exit_ray_segments_[i].clear();
+  }
   final_ray_segments_.clear();
   active_crystal_ctxs_.clear();
   RaySegmentPool::GetInstance()->Clear();
-  enter_ray_data_.Clean();
   enter_ray_offset_ = 0;
 
-  total_ray_num_ = context_->GetInitRayNum();
+  total_ray_num_ = ray_num;
+  buffer_.Reserve(total_ray_num_ * GetBufferSizeFactor());
   InitSunRays();
 
-  for (auto it = context_->multi_scatter_info_.begin(); it != context_->multi_scatter_info_.end(); ++it) {
-    rays_.emplace_back();
-    rays_.back().reserve(total_ray_num_);
-    exit_ray_segments_.emplace_back();
-    exit_ray_segments_.back().reserve(total_ray_num_ * 2);
+  for (current_scatter_index_ = 0; current_scatter_index_ < scatter_num; current_scatter_index_++) {
+    const auto& scatter = context_->multi_scatter_info_[current_scatter_index_];
+    rays_[current_scatter_index_].reserve(total_ray_num_);
+    exit_ray_segments_[current_scatter_index_].reserve(total_ray_num_ * 2);
 
-    for (const auto& c : it->GetCrystalInfo()) {
+    for (const auto& c : scatter.GetCrystalInfo()) {
       active_ray_num_ = static_cast<size_t>(c.population * total_ray_num_);
-      if (buffer_size_ < total_ray_num_ * kBufferSizeFactor) {
-        buffer_size_ = total_ray_num_ * kBufferSizeFactor;
-        buffer_.Allocate(buffer_size_);
-      }
+      buffer_.Reserve(0, active_ray_num_);
       InitEntryRays(context_->GetCrystalContext(c.crystal_id));
       enter_ray_offset_ += active_ray_num_;
       TraceRays(context_->GetCrystal(c.crystal_id), context_->GetRayPathFilter(c.filter_id));
     }
 
-    if (it != context_->multi_scatter_info_.end() - 1) {
-      RestoreResultRays(it->GetProbability());  // total_ray_num_ is updated.
+    if (current_scatter_index_ + 1 < scatter_num) {
+      RestoreResultRays(scatter.GetProbability());  // total_ray_num_ is updated.
     }
     enter_ray_offset_ = 0;
   }
+  current_scatter_index_ = scatter_num - 1;
 
   for (const auto& r : exit_ray_segments_.back()) {
     final_ray_segments_.emplace_back(r);
@@ -187,6 +320,28 @@ void Simulator::Start() {
 }
 
 
+// Splitting Fresnel mode may double active rays at each hit before weak ones are dropped, and kBufferSizeFactor
+// is a bound that covers common cases. Stochastic mode never grows.
+int Simulator::GetBufferSizeFactor() const {
+  return context_->GetFresnelMode() == FresnelMode::kStochastic ? 2 : kBufferSizeFactor;
+}
+
+
+// Rough memory cost of one initial ray, in bytes. Besides simulation buffers, every active ray leaves a ray
+// segment at each hit, on every scatter level.
+size_t Simulator::EstimateRayMemory() const {
+  size_t factor = GetBufferSizeFactor();
+  size_t level_num = std::max(context_->multi_scatter_info_.size(), static_cast<size_t>(1));
+  size_t hit_num = context_->GetRayHitNum() + 1;
+
+  size_t buffer_cost = factor * 2 * (sizeof(float) * 7 + sizeof(int) + sizeof(uint32_t));
+  size_t enter_cost = sizeof(float) * (3 + kEntryRandDim + 9) + sizeof(uint32_t);  // Also its random numbers and axis
+  size_t segment_cost = RaySegmentPool::BytesPerSegment() + sizeof(uint32_t) * 2;  // Also in exit and final lists
+  size_t info_cost = sizeof(RayInfo) + sizeof(RayInfoPtrU);
+  return buffer_cost + enter_cost + level_num * (factor * hit_num * segment_cost + info_cost);
+}
+
+
 // Init sun rays, and fill into dir[1]. They will be rotated and fill into dir[0] in InitEntryRays().
 // In world frame.
 void Simulator::InitSunRays() {
@@ -197,7 +352,7 @@ void Simulator::InitSunRays() {
   }
   Math::RandomSampler::SampleSphericalPointsCart(sun_ray_dir, sun_r, enter_ray_data_.ray_dir, total_ray_num_);
   for (decltype(enter_ray_data_.ray_num) i = 0; i < enter_ray_data_.ray_num; i++) {
-    enter_ray_data_.ray_seg[i] = nullptr;
+    enter_ray_data_.ray_seg[i] = RaySegmentPool::kInvalidId;
   }
 }
 
@@ -207,111 +362,198 @@ void Simulator::InitSunRays() {
 // Add RayContext and main axis rotation
 void Simulator::InitEntryRays(const CrystalContext* ctx) {
   auto& crystal = ctx->crystal;
-  auto total_faces = crystal->TotalFaces();
-
-  auto* prob = new float[total_faces];
-  auto* face_norm = crystal->GetFaceNorm();
   auto* face_point = crystal->GetFaceVertex();
-  auto* face_area = crystal->GetFaceArea();
+
+  auto& sampler = entry_face_samplers_[crystal.get()];
+  if (!sampler) {
+    sampler.reset(new EntryFaceSampler(crystal.get()));
+  }
 
   auto ray_pool = RaySegmentPool::GetInstance();
 
-  float axis_rot[3];
-  for (decltype(active_ray_num_) i = 0; i < active_ray_num_; i++) {
-    InitMainAxis(ctx, axis_rot);
-    Math::RotateZ(axis_rot, enter_ray_data_.ray_dir + (i + enter_ray_offset_) * 3, buffer_.dir[0] + i * 3);
-
-    float sum = 0;
-    for (int k = 0; k < total_faces; k++) {
-      prob[k] = 0;
-      if (!std::isnan(face_norm[k * 3 + 0]) && face_area[k] > 0) {
-        prob[k] = std::max(-Math::Dot3(face_norm + k * 3, buffer_.dir[0] + i * 3) * face_area[k], 0.0f);
-        sum += prob[k];
-      }
-    }
-    for (int k = 0; k < total_faces; k++) {
-      prob[k] /= sum;
-    }
+  // Uniform numbers of every ray: latitude, longitude and roll of main axis, then entry point on face.
+  entry_rand_.resize(active_ray_num_ * kEntryRandDim);
+  if (context_->GetSamplingMode() == SamplingMode::kSobol) {
+    Math::RandomSampler::SampleSobolPoints(kEntryRandDim, entry_rand_.data(), active_ray_num_);
+  } else {
+    Math::RandomNumberGenerator::GetInstance()->FillUniform(entry_rand_.data(), entry_rand_.size());
+  }
 
-    buffer_.face_id[0][i] = Math::RandomSampler::SampleInt(prob, total_faces);
-    Math::RandomSampler::SampleTriangularPoints(face_point + buffer_.face_id[0][i] * 9, buffer_.pt[0] + i * 3);
+  axis_mat_.resize(active_ray_num_ * 9);
+  InitMainAxis(ctx, entry_rand_.data(), kEntryRandDim, axis_mat_.data(), active_ray_num_);
+  Math::RotateByMatrix(axis_mat_.data(), enter_ray_data_.ray_dir + enter_ray_offset_ * 3, buffer_.dir[0],
+                       active_ray_num_);
 
+  for (decltype(active_ray_num_) i = 0; i < active_ray_num_; i++) {
+    buffer_.face_id[0][i] = sampler->Sample(buffer_.dir[0] + i * 3);
+  }
+  Math::RandomSampler::MapTriangularPoints(face_point, buffer_.face_id[0], entry_rand_.data() + 3, kEntryRandDim,
+                                           buffer_.pt[0], active_ray_num_);
+
+  for (decltype(active_ray_num_) i = 0; i < active_ray_num_; i++) {
     auto prev_r = enter_ray_data_.ray_seg[enter_ray_offset_ + i];
-    buffer_.w[0][i] = prev_r ? prev_r->w : 1.0f;
+    buffer_.w[0][i] = prev_r != RaySegmentPool::kInvalidId ? ray_pool->w[prev_r] : 1.0f;
 
     auto r =
         ray_pool->GetRaySegment(buffer_.pt[0] + i * 3, buffer_.dir[0] + i * 3, buffer_.w[0][i], buffer_.face_id[0][i]);
     buffer_.ray_seg[0][i] = r;
-    r->root_ctx = new RayInfo(r, ctx, axis_rot);
-    r->root_ctx->prev_ray_segment = prev_r;
-    rays_.back().emplace_back(r->root_ctx);
+    auto* ray_info = new RayInfo(r, ctx, axis_mat_.data() + i * 9);
+    ray_info->prev_ray_segment = prev_r;
+    ray_pool->root_ctx[r] = ray_info;
+    rays_[current_scatter_index_].emplace_back(ray_info);
   }
-
-  delete[] prob;
 }
 
 
-// Init crystal main axis.
-// Random sample points on a sphere with given parameters.
-void Simulator::InitMainAxis(const CrystalContext* ctx, float* axis) {
-  auto rng = Math::RandomNumberGenerator::GetInstance();
-
+// Init crystal main axes, and output their rotation matrices. See Math::RotateZMatrix().
+// Map uniform numbers u[0], u[1], u[2] of every axis to points on a sphere and roll, with given parameters.
+void Simulator::InitMainAxis(const CrystalContext* ctx, const float* u, size_t u_step, float* axis_mat, size_t num) {
+  std::vector<float> axis(num * 3);
   if (ctx->axis.latitude_dist == Math::Distribution::kUniform) {
     // Random sample on full sphere, ignore other parameters.
-    Math::RandomSampler::SampleSphericalPointsSph(axis);
+    Math::RandomSampler::MapSphericalPointsSph(u, u_step, axis.data(), num, 3);
   } else {
-    Math::RandomSampler::SampleSphericalPointsSph(ctx->axis, axis);
+    Math::RandomSampler::MapSphericalPointsSph(ctx->axis, u, u_step, axis.data(), num, 3);
   }
 
-  if (ctx->axis.roll_dist == Math::Distribution::kUniform) {
-    // Random roll, ignore other parameters.
-    axis[2] = rng->GetUniform() * 2 * Math::kPi;
-  } else {
-    axis[2] = rng->Get(ctx->axis.roll_dist, ctx->axis.roll_mean, ctx->axis.roll_std) * Math::kDegreeToRad;
+  for (size_t i = 0; i < num; i++) {
+    float roll_u = u[i * u_step + 2];
+    if (ctx->axis.roll_dist == Math::Distribution::kUniform) {
+      // Random roll, ignore other parameters.
+      axis[i * 3 + 2] = roll_u * 2 * Math::kPi;
+    } else {
+      axis[i * 3 + 2] =
+          Math::Quantile(ctx->axis.roll_dist, ctx->axis.roll_mean, ctx->axis.roll_std, roll_u) * Math::kDegreeToRad;
+    }
+    Math::RotateZMatrix(axis.data() + i * 3, axis_mat + i * 9);
   }
 }
 
 
-// Restore and shuffle resulted rays, and fill into dir[0].
+// Restore and shuffle resulted rays, and fill into enter_ray_data_.
+//
+// Rays are filtered serially, since it draws from the global generator. Then they are rotated back by matrices of
+// their roots in parallel, and shuffled by ShuffleRays().
 void Simulator::RestoreResultRays(float prob) {
-  if (buffer_size_ < exit_ray_segments_.back().size() * 2) {
-    buffer_size_ = exit_ray_segments_.back().size() * 2;
-    buffer_.Allocate(buffer_size_);
-  }
-  if (enter_ray_data_.ray_num < exit_ray_segments_.back().size()) {
-    enter_ray_data_.Allocate(exit_ray_segments_.back().size());
+  const auto& exit_ray_segments = exit_ray_segments_[current_scatter_index_];
+  if (enter_ray_data_.ray_num < exit_ray_segments.size()) {
+    enter_ray_data_.Allocate(exit_ray_segments.size());
   }
 
+  auto ray_pool = RaySegmentPool::GetInstance();
   auto rng = Math::RandomNumberGenerator::GetInstance();
-  size_t idx = 0;
-  for (const auto& r : exit_ray_segments_.back()) {
-    if (!r->is_finished || r->w < context_->kScatMinW) {
+  restore_ray_segs_.clear();
+  for (const auto& r : exit_ray_segments) {
+    if (!ray_pool->is_finished[r] || ray_pool->w[r] < context_->kScatMinW) {
       continue;
     }
     if (rng->GetUniform() > prob) {
       final_ray_segments_.emplace_back(r);
       continue;
     }
-    const auto axis_rot = r->root_ctx->main_axis_rot.val();
-    Math::RotateZBack(axis_rot, r->dir.val(), enter_ray_data_.ray_dir + idx * 3);
-    enter_ray_data_.ray_seg[idx] = r;
-    idx++;
+    restore_ray_segs_.emplace_back(r);
+  }
+  total_ray_num_ = restore_ray_segs_.size();
+  if (total_ray_num_ == 0) {
+    return;
   }
-  total_ray_num_ = idx;
 
-  // Shuffle
-  for (decltype(total_ray_num_) i = 0; i < total_ray_num_; i++) {
-    int tmp_idx = Math::RandomSampler::SampleInt(static_cast<int>(total_ray_num_ - i));
+  const size_t ray_num = total_ray_num_;
+  const size_t step = std::max(ray_num / 100, static_cast<size_t>(10));
+  restore_dir_.resize(ray_num * 3);
 
-    float tmp_dir[3];
-    std::memcpy(tmp_dir, enter_ray_data_.ray_dir + (i + tmp_idx) * 3, sizeof(float) * 3);
-    std::memcpy(enter_ray_data_.ray_dir + (i + tmp_idx) * 3, enter_ray_data_.ray_dir + i * 3, sizeof(float) * 3);
-    std::memcpy(enter_ray_data_.ray_dir + i * 3, tmp_dir, sizeof(float) * 3);
+  auto pool = ThreadingPool::GetInstance();
+  const uint32_t* segs = restore_ray_segs_.data();
+  float* dir = restore_dir_.data();
+  for (size_t begin = 0; begin < ray_num; begin += step) {
+    pool->AddJob([=] {
+      auto end = std::min(begin + step, ray_num);
+      std::vector<float> tmp_dir((end - begin) * 3);
+      std::vector<float> tmp_mat((end - begin) * 9);
+      for (auto i = begin; i < end; i++) {
+        std::memcpy(tmp_dir.data() + (i - begin) * 3, ray_pool->GetDirection(segs[i]), sizeof(float) * 3);
+        std::memcpy(tmp_mat.data() + (i - begin) * 9, ray_pool->root_ctx[segs[i]]->main_axis_mat, sizeof(float) * 9);
+      }
+      Math::RotateBackByMatrix(tmp_mat.data(), tmp_dir.data(), dir + begin * 3, end - begin);
+    });
+  }
+  pool->WaitFinish();
 
-    RaySegment* tmp_r = enter_ray_data_.ray_seg[i + tmp_idx];
-    enter_ray_data_.ray_seg[i + tmp_idx] = enter_ray_data_.ray_seg[i];
-    enter_ray_data_.ray_seg[i] = tmp_r;
+  ShuffleRays(restore_dir_.data(), restore_ray_segs_.data(), ray_num, enter_ray_data_.ray_dir,
+              enter_ray_data_.ray_seg);
+}
+
+
+// Every ray is sent to a random bucket, and every bucket is shuffled on its own, which gives a uniform random
+// permutation as a whole. Generators of jobs are seeded from the global one, so the result does not depend on how
+// jobs are scheduled.
+void Simulator::ShuffleRays(const float* dir_in, const uint32_t* seg_in, size_t num, float* dir_out,
+                            uint32_t* seg_out) {
+  if (num == 0) {
+    return;
+  }
+
+  auto rng = Math::RandomNumberGenerator::GetInstance();
+  const size_t step = std::max(num / 100, static_cast<size_t>(10));
+  const size_t job_num = (num + step - 1) / step;  // Also the number of buckets
+  std::vector<uint32_t> seeds(job_num * 2);
+  for (auto& s : seeds) {
+    s = rng->GetUInt();
+  }
+  restore_bucket_.resize(num);
+  std::vector<size_t> offsets(job_num * job_num, 0);  // job x bucket. Ray count first, then output offset.
+
+  auto pool = ThreadingPool::GetInstance();
+  const uint32_t* seed = seeds.data();
+  uint16_t* bucket = restore_bucket_.data();
+  size_t* offset = offsets.data();
+  for (size_t k = 0; k < job_num; k++) {
+    pool->AddJob([=] {
+      std::mt19937 gen(seed[k]);
+      std::uniform_int_distribution<int> dist(0, static_cast<int>(job_num) - 1);
+      auto end = std::min(k * step + step, num);
+      for (auto i = k * step; i < end; i++) {
+        bucket[i] = static_cast<uint16_t>(dist(gen));
+        offset[k * job_num + bucket[i]]++;
+      }
+    });
+  }
+  pool->WaitFinish();
+
+  std::vector<size_t> bucket_start(job_num + 1, 0);
+  for (size_t b = 0; b < job_num; b++) {
+    bucket_start[b + 1] = bucket_start[b];
+    for (size_t k = 0; k < job_num; k++) {
+      auto count = offsets[k * job_num + b];
+      offsets[k * job_num + b] = bucket_start[b + 1];
+      bucket_start[b + 1] += count;
+    }
   }
+
+  for (size_t k = 0; k < job_num; k++) {
+    pool->AddJob([=] {
+      auto end = std::min(k * step + step, num);
+      for (auto i = k * step; i < end; i++) {
+        auto idx = offset[k * job_num + bucket[i]]++;
+        std::memcpy(dir_out + idx * 3, dir_in + i * 3, sizeof(float) * 3);
+        seg_out[idx] = seg_in[i];
+      }
+    });
+  }
+  pool->WaitFinish();
+
+  const size_t* start = bucket_start.data();
+  for (size_t b = 0; b < job_num; b++) {
+    pool->AddJob([=] {
+      std::mt19937 gen(seed[job_num + b]);
+      for (auto i = start[b + 1]; i > start[b] + 1; i--) {
+        auto idx = std::uniform_int_distribution<size_t>(start[b], i - 1)(gen);
+        std::swap_ranges(dir_out + (i - 1) * 3, dir_out + i * 3, dir_out + idx * 3);
+        std::swap(seg_out[i - 1], seg_out[idx]);
+      }
+    });
+  }
+  pool->WaitFinish();
 }
 
 
@@ -321,11 +563,22 @@ void Simulator::TraceRays(const Crystal* crystal, AbstractRayPathFilter* filter)
   auto pool = ThreadingPool::GetInstance();
 
   int max_recursion_num = context_->GetRayHitNum();
-  float n = IceRefractiveIndex::Get(context_->wavelengths_[current_wavelength_index_].wavelength);
+  float n = IceRefractiveIndex::Get(current_wavelength_.wavelength);
+  bool stochastic = context_->GetFresnelMode() == FresnelMode::kStochastic;
+  auto rng = Math::RandomNumberGenerator::GetInstance();
   for (int i = 0; i < max_recursion_num; i++) {
-    if (buffer_size_ < active_ray_num_ * 2) {
-      buffer_size_ = active_ray_num_ * kBufferSizeFactor;
-      buffer_.Allocate(buffer_size_);
+    if (context_->GetCoherentSort()) {
+      SortActiveRays(crystal);
+    }
+    buffer_.Reserve(1, active_ray_num_ * 2);  // Side 1 is overwritten by every hit.
+    // Draw random numbers here, so the result does not depend on how jobs are scheduled.
+    const float* fresnel_rand = nullptr;
+    if (stochastic) {
+      fresnel_rand_.resize(active_ray_num_);
+      for (auto& r : fresnel_rand_) {
+        r = rng->GetUniform();
+      }
+      fresnel_rand = fresnel_rand_.data();
     }
     auto step = std::max(active_ray_num_ / 100, static_cast<size_t>(10));
     for (decltype(active_ray_num_) j = 0; j < active_ray_num_; j += step) {
@@ -333,7 +586,8 @@ void Simulator::TraceRays(const Crystal* crystal, AbstractRayPathFilter* filter)
       pool->AddJob([=] {
         Optics::HitSurface(crystal, n, current_num,                                              //
                            buffer_.dir[0] + j * 3, buffer_.face_id[0] + j, buffer_.w[0] + j,     //
-                           buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2);                        // output
+                           buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2,                         // output
+                           fresnel_rand ? fresnel_rand + j : nullptr);
         Optics::Propagate(crystal, current_num * 2, buffer_.pt[0] + j * 3,                       //
                           buffer_.dir[1] + j * 6, buffer_.w[1] + j * 2, buffer_.face_id[0] + j,  //
                           buffer_.pt[1] + j * 6, buffer_.face_id[1] + j * 2);
@@ -358,24 +612,24 @@ void Simulator::StoreRaySegments(const Crystal* crystal, AbstractRayPathFilter*
     auto r = ray_pool->GetRaySegment(buffer_.pt[0] + i / 2 * 3, buffer_.dir[1] + i * 3, buffer_.w[1][i],
                                      buffer_.face_id[0][i / 2]);
     if (buffer_.face_id[1][i] < 0) {
-      r->is_finished = true;
+      ray_pool->is_finished[r] = 1;
     }
 
     auto prev_ray_seg = buffer_.ray_seg[0][i / 2];
     if (i % 2 == 0) {
-      prev_ray_seg->next_reflect = r;
+      ray_pool->next_reflect[prev_ray_seg] = r;
     } else {
-      prev_ray_seg->next_refract = r;
+      ray_pool->next_refract[prev_ray_seg] = r;
     }
-    r->prev = prev_ray_seg;
-    r->root_ctx = prev_ray_seg->root_ctx;
+    ray_pool->prev[r] = prev_ray_seg;
+    ray_pool->root_ctx[r] = ray_pool->root_ctx[prev_ray_seg];
     buffer_.ray_seg[1][i] = r;
 
     if (!filter->Filter(crystal, r)) {
       continue;
     }
-    if (r->is_finished || r->w < ProjectContext::kPropMinW) {
-      exit_ray_segments_.back().emplace_back(r);
+    if (ray_pool->is_finished[r] || ray_pool->w[r] < ProjectContext::kPropMinW) {
+      exit_ray_segments_[current_scatter_index_].emplace_back(r);
     }
   }
 }
@@ -383,9 +637,25 @@ void Simulator::StoreRaySegments(const Crystal* crystal, AbstractRayPathFilter*
 
 // Squeeze data, copy into another buffer_ (from buf[1] to buf[0])
 // Update active_ray_num_.
+// With Russian roulette, a ray below the threshold is either killed or re-weighted by 1 / survival.
 void Simulator::RefreshBuffer() {
+  auto ray_pool = RaySegmentPool::GetInstance();
+  auto rng = Math::RandomNumberGenerator::GetInstance();
+  const float roulette_threshold = context_->GetRouletteThreshold();
+  const float roulette_survival = context_->GetRouletteSurvival();
+
+  buffer_.Reserve(0, active_ray_num_ * 2);  // Data in side 0 have been stored into ray segments.
+
   size_t idx = 0;
   for (size_t i = 0; i < active_ray_num_ * 2; i++) {
+    if (buffer_.face_id[1][i] >= 0 && buffer_.w[1][i] > ProjectContext::kPropMinW &&
+        buffer_.w[1][i] < roulette_threshold) {
+      if (rng->GetUniform() >= roulette_survival) {
+        continue;
+      }
+      buffer_.w[1][i] /= roulette_survival;
+      ray_pool->w[buffer_.ray_seg[1][i]] = buffer_.w[1][i];
+    }
     if (buffer_.face_id[1][i] >= 0 && buffer_.w[1][i] > ProjectContext::kPropMinW) {
       std::memcpy(buffer_.pt[0] + idx * 3, buffer_.pt[1] + i * 3, sizeof(float) * 3);
       std::memcpy(buffer_.dir[0] + idx * 3, buffer_.dir[1] + i * 3, sizeof(float) * 3);
@@ -399,65 +669,130 @@ void Simulator::RefreshBuffer() {
 }
 
 
-const std::vector<RaySegment*>& Simulator::GetFinalRaySegments() const {
+// Sort active rays in side 0 by (face, direction octant), so adjacent rays tend to take the same branches and read
+// the same face data in kernels. Keys are small, so a single counting pass (one digit of radix sort) does it.
+//
+// Rays are sorted within blocks of kSortBlockSize only. Ray segments are created in the order of rays, and later
+// bookkeeping follows links between segments of successive hits. A global sort scatters those links over the
+// whole pool, while sorting within blocks keeps them local, and kernels still see coherent neighbours.
+void Simulator::SortActiveRays(const Crystal* crystal) {
+  const size_t key_num = static_cast<size_t>(crystal->TotalFaces()) * 8;
+  sort_keys_.resize(active_ray_num_);
+  for (size_t i = 0; i < active_ray_num_; i++) {
+    const float* d = buffer_.dir[0] + i * 3;
+    uint32_t octant = (d[0] < 0 ? 1u : 0u) | (d[1] < 0 ? 2u : 0u) | (d[2] < 0 ? 4u : 0u);
+    sort_keys_[i] = static_cast<uint32_t>(buffer_.face_id[0][i]) * 8 + octant;
+  }
+
+  // Keys may far outnumber rays of a block on meshes, so only keys used in a block are visited. All counters are
+  // zero between blocks.
+  if (sort_offsets_.size() < key_num) {
+    sort_offsets_.resize(key_num, 0);
+  }
+  buffer_.Reserve(1, active_ray_num_);  // Side 1 holds nothing useful before a hit.
+  for (size_t begin = 0; begin < active_ray_num_; begin += kSortBlockSize) {
+    auto end = std::min(begin + kSortBlockSize, active_ray_num_);
+    sort_used_keys_.clear();
+    for (auto i = begin; i < end; i++) {
+      if (sort_offsets_[sort_keys_[i]]++ == 0) {
+        sort_used_keys_.emplace_back(sort_keys_[i]);
+      }
+    }
+    std::sort(sort_used_keys_.begin(), sort_used_keys_.end());
+    auto offset = begin;
+    for (auto k : sort_used_keys_) {
+      auto count = sort_offsets_[k];
+      sort_offsets_[k] = offset;
+      offset += count;
+    }
+
+    for (auto i = begin; i < end; i++) {
+      auto idx = sort_offsets_[sort_keys_[i]]++;
+      std::memcpy(buffer_.pt[1] + idx * 3, buffer_.pt[0] + i * 3, sizeof(float) * 3);
+      std::memcpy(buffer_.dir[1] + idx * 3, buffer_.dir[0] + i * 3, sizeof(float) * 3);
+      buffer_.w[1][idx] = buffer_.w[0][i];
+      buffer_.face_id[1][idx] = buffer_.face_id[0][i];
+      buffer_.ray_seg[1][idx] = buffer_.ray_seg[0][i];
+    }
+    for (auto k : sort_used_keys_) {
+      sort_offsets_[k] = 0;
+    }
+  }
+  buffer_.SwapSides();
+}
+
+
+const std::vector<uint32_t>& Simulator::GetFinalRaySegments() const {
   return final_ray_segments_;
 }
 
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wsign-compare"
+void Simulator::GetFinalDirections(float* data) const {
+  // Gather a block of rays, then rotate them back in one call.
+  constexpr size_t kBlockSize = 256;
+  float tmp_dir[kBlockSize * 3];
+  float tmp_mat[kBlockSize * 9];
+
+  auto ray_pool = RaySegmentPool::GetInstance();
+  auto ray_num = final_ray_segments_.size();
+  for (size_t i = 0; i < ray_num; i += kBlockSize) {
+    auto block_num = std::min(ray_num - i, kBlockSize);
+    float* curr_data = data + i * 4;
+    for (size_t j = 0; j < block_num; j++) {
+      auto r = final_ray_segments_[i + j];
+      assert(ray_pool->root_ctx[r]);
+      std::memcpy(tmp_dir + j * 3, ray_pool->GetDirection(r), sizeof(float) * 3);
+      std::memcpy(tmp_mat + j * 9, ray_pool->root_ctx[r]->main_axis_mat, sizeof(float) * 9);
+      curr_data[j * 4 + 3] = ray_pool->w[r];
+    }
+    Math::RotateBackByMatrix(tmp_mat, tmp_dir, curr_data, block_num, 4);
+  }
+}
+
+
 void Simulator::SaveFinalDirections(const char* filename) {
   File file(context_->GetDataDirectory().c_str(), filename);
   if (!file.Open(OpenMode::kWrite | OpenMode::kBinary))
     return;
 
-  if (current_wavelength_index_ < 0 || current_wavelength_index_ >= context_->wavelengths_.size()) {
+  if (current_wavelength_.wavelength < 0) {
     return;
   }
 
-  auto& w = context_->wavelengths_[current_wavelength_index_];
-  file.Write(static_cast<float>(w.wavelength));
-  file.Write(w.weight);
+  file.Write(current_wavelength_.wavelength);
+  file.Write(current_wavelength_.weight);
 
   auto ray_num = final_ray_segments_.size();
-  size_t idx = 0;
   auto* data = new float[ray_num * 4];  // dx, dy, dz, w
-
-  float* curr_data = data;
-  for (const auto& r : final_ray_segments_) {
-    const auto axis_rot = r->root_ctx->main_axis_rot.val();
-    assert(r->root_ctx);
-
-    Math::RotateZBack(axis_rot, r->dir.val(), curr_data);
-    curr_data[3] = r->w;
-    curr_data += 4;
-    idx++;
-  }
-  file.Write(data, idx * 4);
+  GetFinalDirections(data);
+  file.Write(data, ray_num * 4);
   file.Close();
 
   delete[] data;
 }
-#pragma clang diagnostic pop
 
 
 void Simulator::PrintRayInfo() {
-  std::stack<RaySegment*> s;
+  auto ray_pool = RaySegmentPool::GetInstance();
+  std::stack<uint32_t> s;
   for (const auto& rs : exit_ray_segments_) {
     for (const auto& r : rs) {
       auto p = r;
-      while (p) {
+      while (p != RaySegmentPool::kInvalidId) {
         s.push(p);
-        p = p->prev;
+        p = ray_pool->prev[p];
       }
       std::printf("%zu,0,0,0,0,0,-1\n", s.size());
       while (!s.empty()) {
         p = s.top();
         s.pop();
+        float pt[3];
+        ray_pool->GetPoint(p, pt);
+        const float* dir = ray_pool->GetDirection(p);
         std::printf("%+.4f,%+.4f,%+.4f,%+.4f,%+.4f,%+.4f,%+.4f\n",  //
-                    p->pt.x(), p->pt.y(), p->pt.z(),                // point
-                    p->dir.x(), p->dir.y(), p->dir.z(),             // direction
-                    p->w);                                          // weight
+                    pt[0], pt[1], pt[2],                            // point
+                    dir[0], dir[1], dir[2],                         // direction
+                    ray_pool->w[p]);                                // weight
       }
     }
   }
@@ -1,6 +1,9 @@
 #ifndef SRC_SIMULATION_H_
 #define SRC_SIMULATION_H_
 
+#include <functional>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "context.h"
@@ -15,16 +18,24 @@ struct SimulationBufferData {
   ~SimulationBufferData();
 
   void Clean();
-  void Allocate(size_t ray_number);
+
+  /*! @brief Make sure both sides can hold at least ray_number rays.
+   *
+   * Buffers never shrink. When a side grows, its old contents are discarded rather than copied, so callers
+   * reserve a side only when its data are not needed any more.
+   */
+  void Reserve(size_t ray_number);
+  void Reserve(int idx, size_t ray_number);
+  void SwapSides();  // Swap data of both sides. Only pointers are swapped.
   void Print();
 
   float* pt[2];
   float* dir[2];
   float* w[2];
   int* face_id[2];
-  RaySegment** ray_seg[2];
+  uint32_t* ray_seg[2];  // Ids in RaySegmentPool
 
-  size_t ray_num;
+  size_t capacity[2];
 
  private:
   void DeleteBuffer(int idx);
@@ -40,7 +51,7 @@ struct EnterRayData {
   void Allocate(size_t ray_number);
 
   float* ray_dir;
-  RaySegment** ray_seg;
+  uint32_t* ray_seg;  // Ids in RaySegmentPool
 
   size_t ray_num;
 
@@ -49,47 +60,136 @@ struct EnterRayData {
 };
 
 
+/*! @brief Sample the face a ray enters a crystal from, proportional to its projected area, max(0, -n.d) * area.
+ *
+ * Directions are binned by a cube map. For every bin, an alias table over upper bounds of projected areas within
+ * the bin is built when the bin is first used, and kept for later rays. A sampled face is then accepted by its
+ * exact projected area, so the result is exact, with O(1) cost per ray on average.
+ */
+class EntryFaceSampler {
+ public:
+  explicit EntryFaceSampler(const Crystal* crystal);
+
+  /*! @brief Sample an entry face.
+   *
+   * @param dir incident direction in crystal frame, normalized.
+   * @return face index.
+   */
+  int Sample(const float* dir);
+
+  static constexpr int kBinResolution = 16;
+  static constexpr int kMaxTries = 64;
+
+ private:
+  struct BinTable {
+    Math::AliasTable table;
+    std::vector<float> bound;  // Upper bound of projected area of every face.
+  };
+
+  const BinTable& GetBinTable(int bin);
+  float ProjectedArea(int face, const float* dir) const;
+  int SampleLinear(const float* dir) const;
+
+  const Crystal* crystal_;
+  std::vector<std::unique_ptr<BinTable>> bin_tables_;
+};
+
+
 class Simulator {
  public:
   explicit Simulator(ProjectContextPtr  context);
   Simulator(const Simulator& other) = delete;
   ~Simulator() = default;
 
+  using BatchSink = std::function<void(size_t)>;
+
+  /*! @brief Switch to another context, e.g. the next point of a parameter sweep. Buffers keep their capacity.
+   */
+  void SetContext(ProjectContextPtr context);
   void SetWavelengthIndex(int index);
-  void Start();
-  const std::vector<RaySegment*>& GetFinalRaySegments() const;
+  void SetWavelength(const ProjectContext::WavelengthInfo& wavelength);  // Any wavelength, e.g. drawn from spectrum
+  void Start();  // Trace all rays of current wavelength in one batch.
+
+  /*! @brief Trace all rays of current wavelength, in several batches if they do not fit in max memory.
+   *
+   * Rays of different batches are independent, so the result is statistically the same as one batch.
+   *
+   * @param sink called after every batch with its initial ray number. Final rays of the batch can be read
+   *        with GetFinalRaySegments() or GetFinalDirections() until the next batch starts.
+   */
+  void Start(const BatchSink& sink);
+  size_t GetBatchRayNum() const;
+  const std::vector<uint32_t>& GetFinalRaySegments() const;  // Ids in RaySegmentPool
+  void GetFinalDirections(float* data) const;  // data: final ray number x 4, [dx, dy, dz, w]
   void SaveFinalDirections(const char* filename);
   void SaveAllRays(const char* filename);
   void PrintRayInfo();  // For debug
 
- private:
-  static void InitMainAxis(const CrystalContext* ctx, float* axis);
+  /*! @brief Sample crystal main axes from uniform numbers, by axis distribution of a crystal.
+   *
+   * @param u uniform numbers in [0, 1), u[0], u[1] for axis and u[2] for roll.
+   * @param u_step floats between adjacent axes in u.
+   * @param axis_mat output rotation matrices, num x 9. See Math::RotateZMatrix().
+   */
+  static void InitMainAxis(const CrystalContext* ctx, const float* u, size_t u_step, float* axis_mat, size_t num);
+
+  /*! @brief Randomly permute rays in parallel, drawing seeds from the global generator.
+   *
+   * @param dir_in ray directions, num x 3.
+   * @param seg_in ray segment ids, num.
+   * @param dir_out permuted directions, num x 3. It must not overlap dir_in.
+   * @param seg_out permuted segment ids, num. It must not overlap seg_in.
+   */
+  void ShuffleRays(const float* dir_in, const uint32_t* seg_in, size_t num, float* dir_out, uint32_t* seg_out);
 
+ private:
+  void Trace(size_t ray_num);
   void InitSunRays();
   void InitEntryRays(const CrystalContext* ctx);
   void TraceRays(const Crystal* crystal, AbstractRayPathFilter* filter);
   void RestoreResultRays(float prob);
   void StoreRaySegments(const Crystal* crystal, AbstractRayPathFilter* filter);
   void RefreshBuffer();
+  void SortActiveRays(const Crystal* crystal);
+  int GetBufferSizeFactor() const;
+  size_t EstimateRayMemory() const;
+
+  static constexpr size_t kMinBatchRayNum = 1000;
 
   static constexpr int kBufferSizeFactor = 4;
+  static constexpr int kEntryRandDim = 5;  // Uniform numbers to init an entry ray
+  static constexpr size_t kSortBlockSize = 512;  // Rays are sorted within blocks of this size
 
   ProjectContextPtr context_;
   std::vector<CrystalContextPtrU> active_crystal_ctxs_;
 
   std::vector<std::vector<RayInfoPtrU>> rays_;
-  std::vector<std::vector<RaySegment*>> exit_ray_segments_;
-  std::vector<RaySegment*> final_ray_segments_;
+  std::vector<std::vector<uint32_t>> exit_ray_segments_;
+  std::vector<uint32_t> final_ray_segments_;
 
-  int current_wavelength_index_;
+  ProjectContext::WavelengthInfo current_wavelength_;  // Negative wavelength if not set
+  size_t current_scatter_index_;
 
   size_t total_ray_num_;
   size_t active_ray_num_;
-  size_t buffer_size_;
 
   SimulationBufferData buffer_;
   EnterRayData enter_ray_data_;
   size_t enter_ray_offset_;
+
+  std::unordered_map<const Crystal*, std::unique_ptr<EntryFaceSampler>> entry_face_samplers_;
+  std::vector<float> fresnel_rand_;  // Random numbers to choose Fresnel branches, in stochastic mode only.
+  std::vector<uint32_t> sort_keys_;   // Working buffers of SortActiveRays()
+  std::vector<size_t> sort_offsets_;
+  std::vector<uint32_t> sort_used_keys_;
+
+  std::vector<float> entry_rand_;  // Uniform numbers of entry rays, kEntryRandDim floats each.
+  std::vector<float> axis_mat_;    // Main axis rotation matrices of entry rays, 9 floats each.
+
+  // Working buffers of RestoreResultRays() and ShuffleRays().
+  std::vector<uint32_t> restore_ray_segs_;
+  std::vector<float> restore_dir_;
+  std::vector<uint16_t> restore_bucket_;
 };
 
 }  // namespace IceHalo
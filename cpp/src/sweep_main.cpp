@@ -0,0 +1,182 @@
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "context.h"
+#include "files.h"
+#include "image.h"
+#include "rapidjson/pointer.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include "render.h"
+#include "simulation.h"
+
+
+namespace {
+
+struct SweepAxis {
+  std::string path;                              // JSON pointer into config, e.g. /sun/altitude
+  std::vector<const rapidjson::Value*> values;  // Points into the config document
+};
+
+
+/*! @brief Parse <sweep> of config. It is an array of axes, and each axis is like
+ *         { "path": "/crystal/0/zenith/std", "values": [1, 5, 10] }.
+ *
+ * @return false if <sweep> is missing or malformed.
+ */
+bool ParseSweepAxes(const rapidjson::Document& d, std::vector<SweepAxis>* axes) {
+  const auto* p = rapidjson::Pointer("/sweep").Get(d);
+  if (p == nullptr || !p->IsArray() || p->Size() == 0) {
+    std::fprintf(stderr, "Config <sweep> is missing or empty!\n");
+    return false;
+  }
+
+  int ai = 0;
+  for (const auto& a : p->GetArray()) {
+    const auto* path = rapidjson::Pointer("/path").Get(a);
+    const auto* values = rapidjson::Pointer("/values").Get(a);
+    if (path == nullptr || !path->IsString() || values == nullptr || !values->IsArray() || values->Size() == 0) {
+      std::fprintf(stderr, "Config <sweep[%d]> cannot recognize!\n", ai);
+      return false;
+    }
+    rapidjson::Pointer pointer(path->GetString());
+    if (!pointer.IsValid() || pointer.Get(d) == nullptr) {
+      std::fprintf(stderr, "Config <sweep[%d].path> %s cannot be found in config!\n", ai, path->GetString());
+      return false;
+    }
+
+    SweepAxis axis;
+    axis.path = path->GetString();
+    for (const auto& v : values->GetArray()) {
+      axis.values.emplace_back(&v);
+    }
+    axes->emplace_back(std::move(axis));
+    ai++;
+  }
+  return true;
+}
+
+
+/*! @brief Make a label for output files from values of a grid point, e.g. 003_sun.altitude=20_crystal.0.zenith.std=5
+ *
+ * Characters that may not fit in a file name are replaced with '_'.
+ */
+std::string MakeLabel(size_t point_index, const std::vector<SweepAxis>& axes, const std::vector<size_t>& value_idx) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%03zu", point_index);
+  std::string label(buffer);
+  for (size_t i = 0; i < axes.size(); i++) {
+    rapidjson::StringBuffer value_buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(value_buffer);
+    axes[i].values[value_idx[i]]->Accept(writer);
+
+    std::string item = axes[i].path.substr(1) + "=" + value_buffer.GetString();
+    for (auto& c : item) {
+      if (c == '/') {
+        c = '.';
+      } else if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '=') {
+        c = '_';
+      }
+    }
+    label += "_" + item;
+  }
+  return label;
+}
+
+}  // namespace
+
+
+// Every grid point is traced and rendered in this process one after another. The threading pool, simulation
+// buffers and built crystals are all kept between points, so a point costs little more than its rays.
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::printf("USAGE: %s <config-file>\n", argv[0]);
+    return -1;
+  }
+
+  auto start = std::chrono::system_clock::now();
+  rapidjson::Document d;
+  std::vector<SweepAxis> axes;
+  if (!IceHalo::ProjectContext::ReadConfigFile(argv[1], &d) || !ParseSweepAxes(d, &axes)) {
+    return -1;
+  }
+  size_t point_num = 1;
+  for (const auto& a : axes) {
+    point_num *= a.values.size();
+  }
+  std::printf("Sweep over %zu axes, %zu points\n", axes.size(), point_num);
+
+  std::unique_ptr<IceHalo::Simulator> simulator;
+  std::vector<uint8_t> rgb_data;
+  std::vector<float> ray_data;
+  std::vector<size_t> value_idx(axes.size());
+  int ret = 0;
+  for (size_t k = 0; k < point_num; k++) {
+    // The last axis changes fastest.
+    for (size_t i = axes.size(), r = k; i-- > 0;) {
+      value_idx[i] = r % axes[i].values.size();
+      r /= axes[i].values.size();
+    }
+    auto label = MakeLabel(k, axes, value_idx);
+    std::printf("=== Point %s ===\n", label.c_str());
+
+    auto t0 = std::chrono::system_clock::now();
+    rapidjson::Document point_d;
+    point_d.CopyFrom(d, point_d.GetAllocator());
+    for (size_t i = 0; i < axes.size(); i++) {
+      rapidjson::Value v(*axes[i].values[value_idx[i]], point_d.GetAllocator());
+      rapidjson::Pointer(axes[i].path.c_str()).Set(point_d, v);
+    }
+
+    IceHalo::ProjectContextPtr proj_ctx;
+    try {
+      proj_ctx = IceHalo::ProjectContext::CreateFromDocument(point_d, argv[1]);
+    } catch (std::invalid_argument& ex) {
+      std::fprintf(stderr, "Skip point %s: %s\n", label.c_str(), ex.what());
+      ret = -1;
+      continue;
+    }
+    if (simulator) {
+      simulator->SetContext(proj_ctx);
+    } else {
+      simulator.reset(new IceHalo::Simulator(proj_ctx));
+    }
+    IceHalo::SpectrumRenderer renderer(proj_ctx);
+
+    auto wavelengths = proj_ctx->GetRoundWavelengths();
+    for (const auto& wl : wavelengths) {
+      simulator->SetWavelength(wl);
+      simulator->Start([&](size_t batch_ray_num) {
+        auto ray_num = simulator->GetFinalRaySegments().size();
+        ray_data.resize(ray_num * 4);
+        simulator->GetFinalDirections(ray_data.data());
+        renderer.LoadData(wl.wavelength, wl.weight, ray_data.data(), ray_num, batch_ray_num);
+      });
+    }
+    auto t1 = std::chrono::system_clock::now();
+
+    // The histogram is saved as a checkpoint without RNG state, which IceHaloMerge can read.
+    auto data_dir = proj_ctx->GetDataDirectory();
+    auto total_ray_num = proj_ctx->GetInitRayNum() * wavelengths.size();
+    if (!IceHalo::SaveCheckpoint(IceHalo::PathJoin(data_dir, "hist_" + label + ".dat"), renderer, total_ray_num,
+                                 "") ||
+        !IceHalo::SaveImage(IceHalo::PathJoin(data_dir, "img_" + label + ".jpg"), proj_ctx, &renderer, &rgb_data)) {
+      ret = -1;
+    }
+    auto t2 = std::chrono::system_clock::now();
+
+    std::chrono::duration<float, std::ratio<1, 1000>> trace_time = t1 - t0;
+    std::chrono::duration<float, std::ratio<1, 1000>> save_time = t2 - t1;
+    std::printf("Ray tracing: %.2fms, saving: %.2fms\n", trace_time.count(), save_time.count());
+  }
+
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = end - start;
+  std::printf("Total: %.3fs\n", diff.count() / 1e3);
+  return ret;
+}
@@ -25,13 +25,13 @@ ThreadingPool* ThreadingPool::GetInstance() {
 }
 
 
-ThreadingPool::ThreadingPool(size_t num) : thread_num_(num), alive_(false), running_jobs_(0), alive_threads_(0) {
+ThreadingPool::ThreadingPool(size_t num) : thread_num_(num), alive_(false), pending_jobs_(0), alive_threads_(0) {
   Start();
 }
 
 
 void ThreadingPool::Start() {
-  if (alive_ || running_jobs_ > 0 || alive_threads_ > 0) {
+  if (alive_ || pending_jobs_ > 0 || alive_threads_ > 0) {
     return;
   }
 
@@ -51,6 +51,10 @@ void ThreadingPool::AddJob(std::function<void()> job) {
     return;
   }
 
+  {
+    std::unique_lock<std::mutex> lk(task_mutex_);
+    pending_jobs_ += 1;
+  }
   {
     std::unique_lock<std::mutex> lock(queue_mutex_);
     queue_.emplace(job);
@@ -65,8 +69,29 @@ void ThreadingPool::WaitFinish() {
 }
 
 
+void ThreadingPool::SetThreadNum(size_t num) {
+  WaitFinish();
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    alive_ = false;
+  }
+  queue_condition_.notify_all();
+  for (auto& t : pool_) {
+    t.join();
+  }
+  thread_num_ = std::max(num, static_cast<size_t>(1));
+  Start();
+}
+
+
+size_t ThreadingPool::GetThreadNum() const {
+  return thread_num_;
+}
+
+
+// The queue is guarded by queue_mutex_, which is not held here, so only the counter of pending jobs is read.
 bool ThreadingPool::TaskRunning() {
-  return running_jobs_ > 0 || !queue_.empty();
+  return pending_jobs_ > 0;
 }
 
 
@@ -77,24 +102,21 @@ void ThreadingPool::WorkingFunction() {
       std::function<void()> job = queue_.front();
       queue_.pop();
       lock.unlock();
-      {
-        std::unique_lock<std::mutex> lk(task_mutex_);
-        running_jobs_ += 1;
-      }
       job();
       {
         std::unique_lock<std::mutex> lk(task_mutex_);
-        running_jobs_ -= 1;
+        pending_jobs_ -= 1;
       }
       lock.lock();
-      task_condition_.notify_one();
+      task_condition_.notify_all();
     } else if (!alive_) {
       alive_threads_ -= 1;
-      task_condition_.notify_one();
+      task_condition_.notify_all();
       queue_condition_.notify_one();
       break;
     } else {
-      task_condition_.notify_one();
+      // There may be more than one thread waiting in WaitFinish(), e.g. the simulator and the renderer.
+      task_condition_.notify_all();
       queue_condition_.wait(lock, [=] { return !this->queue_.empty() || !this->alive_; });
     }
   }
@@ -1,7 +1,9 @@
 #ifndef SRC_THREADINGPOOL_H_
 #define SRC_THREADINGPOOL_H_
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <mutex>
@@ -21,6 +23,11 @@ class ThreadingPool {
   void WaitFinish();
   bool TaskRunning();
 
+  /*! @brief Wait for all jobs, then restart with another number of threads.
+   */
+  void SetThreadNum(size_t num);
+  size_t GetThreadNum() const;
+
   static ThreadingPool* GetInstance();
 
  private:
@@ -34,7 +41,7 @@ class ThreadingPool {
   std::mutex queue_mutex_;
   std::condition_variable queue_condition_;
 
-  std::atomic<int> running_jobs_;
+  std::atomic<int> pending_jobs_;  // Jobs queued or running. Updated under task_mutex_.
   std::atomic<int> alive_threads_;
   std::mutex task_mutex_;
   std::condition_variable task_condition_;
@@ -46,6 +53,83 @@ class ThreadingPool {
   static std::mutex instance_mutex_;
 };
 
+
+/*! @brief A blocking FIFO queue with a fixed capacity.
+ *
+ * Producers block in Push() while the queue is full, and consumers block in Pop() while it is empty.
+ * After Close() is called, Push() fails immediately and Pop() drains the remaining items then fails.
+ */
+template <class T>
+class BoundedQueue {
+ public:
+  explicit BoundedQueue(size_t capacity);
+
+  bool Push(T&& item);
+  bool Pop(T* item);
+  void Close();
+  size_t Size();
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::queue<T> queue_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+};
+
+
+template <class T>
+BoundedQueue<T>::BoundedQueue(size_t capacity)
+    : capacity_(std::max(capacity, static_cast<size_t>(1))), closed_(false) {}
+
+
+template <class T>
+bool BoundedQueue<T>::Push(T&& item) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  not_full_.wait(lock, [=] { return closed_ || queue_.size() < capacity_; });
+  if (closed_) {
+    return false;
+  }
+  queue_.emplace(std::move(item));
+  lock.unlock();
+  not_empty_.notify_one();
+  return true;
+}
+
+
+template <class T>
+bool BoundedQueue<T>::Pop(T* item) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  not_empty_.wait(lock, [=] { return closed_ || !queue_.empty(); });
+  if (queue_.empty()) {
+    return false;
+  }
+  *item = std::move(queue_.front());
+  queue_.pop();
+  lock.unlock();
+  not_full_.notify_one();
+  return true;
+}
+
+
+template <class T>
+void BoundedQueue<T>::Close() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    closed_ = true;
+  }
+  not_full_.notify_all();
+  not_empty_.notify_all();
+}
+
+
+template <class T>
+size_t BoundedQueue<T>::Size() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
 }  // namespace IceHalo
 
 
@@ -1,50 +1,102 @@
 #include <chrono>
+#include <cstring>
+#include <limits>
+#include <memory>
 
 #include "context.h"
+#include "files.h"
+#include "render.h"
 #include "simulation.h"
 
 using namespace IceHalo;
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    printf("USAGE: %s <config-file>\n", argv[0]);
+  int shard_index = 0;
+  int shard_num = 1;
+  bool args_ok = argc == 2 ||
+                 (argc == 4 && std::strcmp(argv[2], "--shard") == 0 &&
+                  ParseShardOption(argv[3], &shard_index, &shard_num));
+  if (!args_ok) {
+    printf("USAGE: %s <config-file> [--shard <index>/<number>]\n", argv[0]);
     return -1;
   }
 
   auto start = std::chrono::system_clock::now();
   ProjectContextPtr context = ProjectContext::CreateFromFile(argv[1]);
+  if (shard_num > 1) {
+    context->SetShard(shard_index, shard_num);
+  }
   Simulator simulator(context);
 
+  // The renderer is only used to estimate noise level, when there is a target noise.
+  std::unique_ptr<SpectrumRenderer> renderer;
+  if (context->GetTargetNoise() > 0) {
+    renderer.reset(new SpectrumRenderer(context));
+    renderer->EnableNoiseEstimation(true);
+  }
+
   auto t = std::chrono::system_clock::now();
   std::chrono::duration<float, std::ratio<1, 1000>> diff = t - start;
   printf("Initialization: %.2fms\n", diff.count());
 
   char filename[256];
-  const auto& wavelengths = context->wavelengths_;
-  for (decltype(wavelengths.size()) i = 0; i < wavelengths.size(); i++) {
-    const auto& wl = wavelengths[i];
-    printf("starting at wavelength: %d\n", wl.wavelength);
-    simulator.SetWavelengthIndex(i);
-
-    auto t0 = std::chrono::system_clock::now();
-    simulator.Start();
-    auto t1 = std::chrono::system_clock::now();
-    diff = t1 - t0;
-    printf("Ray tracing: %.2fms\n", diff.count());
-
-    t0 = std::chrono::system_clock::now();
-    std::sprintf(filename, "directions_%d_%lli.bin", wl.wavelength, t0.time_since_epoch().count());
-    simulator.SaveFinalDirections(filename);
-
-    t1 = std::chrono::system_clock::now();
-    diff = t1 - t0;
-    printf("Saving: %.2fms\n", diff.count());
+  size_t total_ray_num = 0;
+  float noise = std::numeric_limits<float>::infinity();
+  bool finished = false;
+  while (!finished) {
+    auto wavelengths = context->GetRoundWavelengths();
+    for (const auto& wl : wavelengths) {
+      printf("starting at wavelength: %.1f\n", wl.wavelength);
+      simulator.SetWavelength(wl);
+
+      // Batches of one wavelength go into one file, as if they were traced at once.
+      auto t0 = std::chrono::system_clock::now();
+      std::sprintf(filename, "directions_%d_%lli%s.bin", static_cast<int>(wl.wavelength), t0.time_since_epoch().count(),
+                   context->GetShardTag().c_str());
+      File file(context->GetDataDirectory().c_str(), filename);
+      if (!file.Open(OpenMode::kWrite | OpenMode::kBinary)) {
+        printf("Cannot create file %s!\n", filename);
+        return -1;
+      }
+      file.Write(wl.wavelength);
+      file.Write(wl.weight);
+
+      simulator.Start([&](size_t batch_ray_num) {
+        auto ray_num = simulator.GetFinalRaySegments().size();
+        std::unique_ptr<float[]> data(new float[ray_num * 4]);
+        simulator.GetFinalDirections(data.get());
+        file.Write(data.get(), ray_num * 4);
+        if (renderer) {
+          renderer->LoadData(wl.wavelength, wl.weight, data.get(), ray_num, batch_ray_num);
+        }
+      });
+      file.Close();
+
+      auto t1 = std::chrono::system_clock::now();
+      diff = t1 - t0;
+      printf("Ray tracing and saving: %.2fms\n", diff.count());
+    }
+    total_ray_num += context->GetInitRayNum() * wavelengths.size();
+
+    t = std::chrono::system_clock::now();
+    std::chrono::duration<float> elapsed = t - start;
+    if (renderer) {
+      noise = renderer->GetNoiseLevel();
+      printf("Noise level: %.4f\n", noise);
+    }
+    finished = !context->HasStopCondition() ||
+               (context->GetTargetNoise() > 0 && noise <= context->GetTargetNoise()) ||
+               (context->GetTimeBudget() > 0 && elapsed.count() >= context->GetTimeBudget());
   }
   context->PrintCrystalInfo();
 
   auto end = std::chrono::system_clock::now();
   diff = end - start;
   printf("Total: %.3fs\n", diff.count() / 1e3);
+  printf("Traced %zu rays, %.0f rays/sec\n", total_ray_num, total_ray_num / (diff.count() / 1e3));
+  if (renderer) {
+    printf("Achieved noise level: %.4f (target %.4f)\n", noise, context->GetTargetNoise());
+  }
 
   return 0;
 }
@@ -0,0 +1,299 @@
+#include "transfer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "context.h"
+#include "mymath.h"
+#include "optics.h"
+#include "simulation.h"
+#include "threadingpool.h"
+
+namespace IceHalo {
+
+constexpr int TransferTable::kDefaultBinResolution;
+constexpr int TransferTable::kDefaultRayNumPerBin;
+constexpr int TransferTable::kMaxBinResolution;
+constexpr int TransferTable::kMaxRayNumPerBin;
+constexpr int TransferTable::kBinBlockSize;
+
+namespace {
+
+constexpr uint32_t kTransferStateMagic = 0x54464849;  // "IHFT"
+constexpr uint32_t kTransferStateVersion = 1;
+constexpr uint64_t kMaxExitRayNum = 1ull << 32;
+
+}  // namespace
+
+
+TransferTable::TransferTable() : n_(1.0f), hit_num_(0), bin_resolution_(0), ray_num_per_bin_(0) {}
+
+
+TransferTablePtrU TransferTable::Build(const Crystal* crystal, float n, int hit_num, int bin_resolution,
+                                       int ray_num_per_bin) {
+  TransferTablePtrU table(new TransferTable);
+  table->n_ = n;
+  table->hit_num_ = hit_num;
+  table->bin_resolution_ = std::min(std::max(bin_resolution, 1), kMaxBinResolution);
+  table->ray_num_per_bin_ = std::min(std::max(ray_num_per_bin, 1), kMaxRayNumPerBin);
+
+  int bin_num = 6 * table->bin_resolution_ * table->bin_resolution_;
+  table->entry_dir_.reserve(static_cast<size_t>(bin_num) * table->ray_num_per_bin_ * 3);
+  table->exit_offset_.reserve(static_cast<size_t>(bin_num) * table->ray_num_per_bin_ + 1);
+  table->exit_offset_.emplace_back(0);
+  for (int b = 0; b < bin_num; b += kBinBlockSize) {
+    table->TraceBins(crystal, b, std::min(b + kBinBlockSize, bin_num));
+  }
+  return table;
+}
+
+
+// Trace entry rays of bins in [bin_begin, bin_end), and append them to the table.
+//
+// Incident directions are spread uniformly over every bin, by rejection from the cap around the bin. Entry faces
+// and points are sampled as Simulator does, and rays are traced with the same thresholds on weights, so exit rays
+// of an entry ray are what Simulator gets for it.
+void TransferTable::TraceBins(const Crystal* crystal, int bin_begin, int bin_end) {
+  const size_t ray_num = static_cast<size_t>(bin_end - bin_begin) * ray_num_per_bin_;
+  std::vector<float> dir(ray_num * 3);
+  std::vector<float> cap_dir(ray_num_per_bin_ * 3);
+  for (int b = bin_begin; b < bin_end; b++) {
+    float center[3];
+    float radius = Math::CubeMapBinCenter(b, bin_resolution_, center);
+    float cap = 2 * std::asin(std::min(radius / 2, 1.0f)) * Math::kRadToDegree;
+    float* bin_dir = dir.data() + static_cast<size_t>(b - bin_begin) * ray_num_per_bin_ * 3;
+    int filled = 0;
+    while (filled < ray_num_per_bin_) {
+      Math::RandomSampler::SampleSphericalPointsCart(center, cap, cap_dir.data(), ray_num_per_bin_);
+      for (int i = 0; i < ray_num_per_bin_ && filled < ray_num_per_bin_; i++) {
+        if (Math::CubeMapBin(cap_dir.data() + i * 3, bin_resolution_) == b) {
+          std::memcpy(bin_dir + filled * 3, cap_dir.data() + i * 3, sizeof(float) * 3);
+          filled++;
+        }
+      }
+    }
+  }
+  entry_dir_.insert(entry_dir_.end(), dir.begin(), dir.end());
+
+  // Side 0 holds active rays, and side 1 results of a hit, as SimulationBufferData does.
+  std::vector<float> pt[2]{ std::vector<float>(ray_num * 3) };
+  std::vector<float> w[2]{ std::vector<float>(ray_num, 1.0f) };
+  std::vector<int> face_id[2]{ std::vector<int>(ray_num) };
+  std::vector<uint32_t> root(ray_num);  // Entry ray every active ray comes from, within this block
+  EntryFaceSampler sampler(crystal);
+  for (size_t i = 0; i < ray_num; i++) {
+    face_id[0][i] = sampler.Sample(dir.data() + i * 3);
+    root[i] = static_cast<uint32_t>(i);
+  }
+  std::vector<float> u(ray_num * 2);
+  Math::RandomNumberGenerator::GetInstance()->FillUniform(u.data(), u.size());
+  Math::RandomSampler::MapTriangularPoints(crystal->GetFaceVertex(), face_id[0].data(), u.data(), 2, pt[0].data(),
+                                           ray_num);
+
+  std::vector<uint32_t> exit_root;
+  std::vector<float> exit_data;
+  std::vector<float> dir_out;
+  auto pool = ThreadingPool::GetInstance();
+  size_t active_ray_num = ray_num;
+  for (int k = 0; k < hit_num_ && active_ray_num > 0; k++) {
+    dir_out.resize(active_ray_num * 6);
+    pt[1].resize(active_ray_num * 6);
+    w[1].resize(active_ray_num * 2);
+    face_id[1].resize(active_ray_num * 2);
+    auto step = std::max(active_ray_num / 100, static_cast<size_t>(10));
+    for (size_t j = 0; j < active_ray_num; j += step) {
+      size_t current_num = std::min(active_ray_num - j, step);
+      pool->AddJob([=, &dir, &pt, &w, &face_id, &dir_out] {
+        Optics::HitSurface(crystal, n_, current_num,                                   //
+                           dir.data() + j * 3, face_id[0].data() + j, w[0].data() + j,  //
+                           dir_out.data() + j * 6, w[1].data() + j * 2);                // output
+        Optics::Propagate(crystal, current_num * 2, pt[0].data() + j * 3,                        //
+                          dir_out.data() + j * 6, w[1].data() + j * 2, face_id[0].data() + j,  //
+                          pt[1].data() + j * 6, face_id[1].data() + j * 2);                    // output
+      });
+    }
+    pool->WaitFinish();
+
+    // Keep rays inside crystal in side 0, and collect those leaving it.
+    size_t idx = 0;
+    for (size_t i = 0; i < active_ray_num * 2; i++) {
+      if (w[1][i] <= 0) {  // Refractive rays in total reflection case
+        continue;
+      }
+      if (face_id[1][i] < 0) {
+        if (w[1][i] >= ProjectContext::kScatMinW) {
+          exit_root.emplace_back(root[i / 2]);
+          exit_data.insert(exit_data.end(), dir_out.data() + i * 3, dir_out.data() + i * 3 + 3);
+          exit_data.emplace_back(w[1][i]);
+        }
+      } else if (w[1][i] > ProjectContext::kPropMinW) {
+        // Writing into side 0 at idx never overwrites an input not read yet, since idx <= i / 2.
+        std::memcpy(pt[0].data() + idx * 3, pt[1].data() + i * 3, sizeof(float) * 3);
+        std::memcpy(dir.data() + idx * 3, dir_out.data() + i * 3, sizeof(float) * 3);
+        w[0][idx] = w[1][i];
+        face_id[0][idx] = face_id[1][i];
+        root[idx] = root[i / 2];
+        idx++;
+      }
+    }
+    active_ray_num = idx;
+  }
+
+  // Group exit rays by their entry rays, with a counting sort.
+  std::vector<uint32_t> count(ray_num + 1, 0);
+  for (auto r : exit_root) {
+    count[r + 1]++;
+  }
+  for (size_t i = 0; i < ray_num; i++) {
+    count[i + 1] += count[i];
+  }
+  const uint32_t exit_offset = static_cast<uint32_t>(exit_data_.size() / 4);
+  for (size_t i = 0; i < ray_num; i++) {
+    exit_offset_.emplace_back(exit_offset + count[i + 1]);
+  }
+  exit_data_.resize(exit_data_.size() + exit_data.size());
+  for (size_t i = 0; i < exit_root.size(); i++) {
+    auto pos = exit_offset + count[exit_root[i]]++;
+    std::memcpy(exit_data_.data() + pos * 4, exit_data.data() + i * 4, sizeof(float) * 4);
+  }
+}
+
+
+bool TransferTable::SaveState(File& file) const {
+  auto entry_num = static_cast<uint64_t>(entry_dir_.size() / 3);
+  auto exit_num = static_cast<uint64_t>(exit_data_.size() / 4);
+
+  bool ok = file.Write(kTransferStateMagic) == 1 && file.Write(kTransferStateVersion) == 1;
+  ok = ok && file.Write(n_) == 1 && file.Write(static_cast<int32_t>(hit_num_)) == 1;
+  ok = ok && file.Write(static_cast<int32_t>(bin_resolution_)) == 1;
+  ok = ok && file.Write(static_cast<int32_t>(ray_num_per_bin_)) == 1;
+  ok = ok && file.Write(entry_num) == 1 && file.Write(exit_num) == 1;
+  ok = ok && file.Write(entry_dir_.data(), entry_num * 3) == entry_num * 3;
+  ok = ok && file.Write(exit_offset_.data(), entry_num + 1) == entry_num + 1;
+  ok = ok && file.Write(exit_data_.data(), exit_num * 4) == exit_num * 4;
+  return ok;
+}
+
+
+TransferTablePtrU TransferTable::LoadState(File& file) {
+  uint32_t magic = 0;
+  uint32_t version = 0;
+  float n = 0;
+  int32_t hit_num = 0;
+  int32_t bin_resolution = 0;
+  int32_t ray_num_per_bin = 0;
+  uint64_t entry_num = 0;
+  uint64_t exit_num = 0;
+  bool ok = file.Read(&magic) == 1 && magic == kTransferStateMagic && file.Read(&version) == 1 &&
+            version == kTransferStateVersion;
+  ok = ok && file.Read(&n) == 1 && file.Read(&hit_num) == 1 && file.Read(&bin_resolution) == 1 &&
+       file.Read(&ray_num_per_bin) == 1;
+  ok = ok && file.Read(&entry_num) == 1 && file.Read(&exit_num) == 1;
+  if (!ok || bin_resolution < 1 || bin_resolution > kMaxBinResolution || ray_num_per_bin < 1 ||
+      ray_num_per_bin > kMaxRayNumPerBin ||
+      entry_num != 6ull * bin_resolution * bin_resolution * ray_num_per_bin || exit_num >= kMaxExitRayNum) {
+    return nullptr;
+  }
+
+  TransferTablePtrU table(new TransferTable);
+  table->n_ = n;
+  table->hit_num_ = hit_num;
+  table->bin_resolution_ = bin_resolution;
+  table->ray_num_per_bin_ = ray_num_per_bin;
+  table->entry_dir_.resize(entry_num * 3);
+  table->exit_offset_.resize(entry_num + 1);
+  table->exit_data_.resize(exit_num * 4);
+  ok = file.Read(table->entry_dir_.data(), entry_num * 3) == entry_num * 3;
+  ok = ok && file.Read(table->exit_offset_.data(), entry_num + 1) == entry_num + 1;
+  ok = ok && file.Read(table->exit_data_.data(), exit_num * 4) == exit_num * 4;
+  ok = ok && table->exit_offset_[0] == 0 && table->exit_offset_[entry_num] == exit_num;
+  for (uint64_t i = 0; ok && i < entry_num; i++) {
+    ok = table->exit_offset_[i] <= table->exit_offset_[i + 1];
+  }
+  return ok ? std::move(table) : nullptr;
+}
+
+
+// The path is named by a hash of crystal faces and all settings the table depends on.
+std::string TransferTable::GetFilePath(const Crystal* crystal, float n, int hit_num, int bin_resolution,
+                                       int ray_num_per_bin, const std::string& dir) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto hash_bytes = [&hash](const void* data, size_t size) {
+    const auto* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+      hash ^= p[i];
+      hash *= 0x100000001b3ull;
+    }
+  };
+  hash_bytes(crystal->GetFaceVertex(), sizeof(float) * crystal->TotalFaces() * 9);
+  hash_bytes(&n, sizeof(n));
+  hash_bytes(&hit_num, sizeof(hit_num));
+  hash_bytes(&bin_resolution, sizeof(bin_resolution));
+  hash_bytes(&ray_num_per_bin, sizeof(ray_num_per_bin));
+
+  char filename[32];
+  std::snprintf(filename, sizeof(filename), "transfer_%016llx.dat", static_cast<unsigned long long>(hash));
+  return PathJoin(dir, filename);
+}
+
+
+int TransferTable::GetHitNum() const {
+  return hit_num_;
+}
+
+
+int TransferTable::GetBinResolution() const {
+  return bin_resolution_;
+}
+
+
+int TransferTable::GetRayNumPerBin() const {
+  return ray_num_per_bin_;
+}
+
+
+size_t TransferTable::GetExitRayNum() const {
+  return exit_data_.size() / 4;
+}
+
+
+// The rotation from incident direction s of the entry ray to actual direction d is taken about s x d, and applied
+// with Rodrigues' formula, R e = c e + v x e + v (v . e) / (1 + c), where v = s x d and c = s . d. They are in
+// the same bin, so c is never near -1.
+void TransferTable::Sample(const float* axis_mat, const float* dir, const float* u, size_t num,
+                           std::vector<float>* out) const {
+  std::vector<float> crystal_dir(num * 3);
+  Math::RotateByMatrix(axis_mat, dir, crystal_dir.data(), num);
+
+  for (size_t i = 0; i < num; i++) {
+    const float* d = crystal_dir.data() + i * 3;
+    const float* mat = axis_mat + i * 9;
+    auto k = std::min(static_cast<int>(u[i] * ray_num_per_bin_), ray_num_per_bin_ - 1);
+    auto entry = static_cast<size_t>(Math::CubeMapBin(d, bin_resolution_)) * ray_num_per_bin_ + k;
+    const float* s = entry_dir_.data() + entry * 3;
+
+    float v[3];
+    Math::Cross3(s, d, v);
+    float c = Math::Dot3(s, d);
+    float f = 1.0f / (1.0f + c);
+    for (auto j = exit_offset_[entry]; j < exit_offset_[entry + 1]; j++) {
+      const float* e = exit_data_.data() + j * 4;
+      float ve[3];
+      Math::Cross3(v, e, ve);
+      float vd = Math::Dot3(v, e) * f;
+      float r[3];
+      for (int m = 0; m < 3; m++) {
+        r[m] = c * e[m] + ve[m] + v[m] * vd;
+      }
+      // Back into world frame, by the transpose of main axis matrix.
+      for (int m = 0; m < 3; m++) {
+        out->emplace_back(mat[m] * r[0] + mat[3 + m] * r[1] + mat[6 + m] * r[2]);
+      }
+      out->emplace_back(e[3]);
+    }
+  }
+}
+
+}  // namespace IceHalo
@@ -0,0 +1,90 @@
+#ifndef SRC_TRANSFER_H_
+#define SRC_TRANSFER_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "crystal.h"
+#include "files.h"
+
+
+namespace IceHalo {
+
+class TransferTable;
+using TransferTablePtrU = std::unique_ptr<TransferTable>;
+
+
+/*! @brief Transfer function of a crystal at one wavelength, i.e. exit rays of an incident direction, all in crystal
+ *         frame. It depends on neither crystal orientations nor sun position, so it is traced once and then
+ *         convolved with any of them.
+ *
+ * Incident directions are binned by a cube map. Every bin holds a fixed number of traced entry rays, with their
+ * incident directions spread over the bin, and exit rays of every entry ray.
+ */
+class TransferTable {
+ public:
+  /*! @brief Trace a table, as Simulator traces one scattering with Fresnel mode split.
+   *
+   * @param crystal the crystal.
+   * @param n refractive index.
+   * @param hit_num max hit number of a ray.
+   * @param bin_resolution bin number along an edge of cube face. See Math::CubeMapBin().
+   * @param ray_num_per_bin entry rays traced in every bin.
+   */
+  static TransferTablePtrU Build(const Crystal* crystal, float n, int hit_num, int bin_resolution,
+                                 int ray_num_per_bin);
+
+  bool SaveState(File& file) const;
+  static TransferTablePtrU LoadState(File& file);
+
+  /*! @brief Make a file path for the table of given crystal and settings. Different crystal shapes or settings
+   *         get different paths, so a stale table is never picked up.
+   */
+  static std::string GetFilePath(const Crystal* crystal, float n, int hit_num, int bin_resolution,
+                                 int ray_num_per_bin, const std::string& dir);
+
+  int GetHitNum() const;
+  int GetBinResolution() const;
+  int GetRayNumPerBin() const;
+  size_t GetExitRayNum() const;
+
+  /*! @brief Sample exit rays of given incident rays and crystal orientations, in world frame.
+   *
+   * Every incident ray takes a traced entry ray from its bin. Exit rays of the entry ray are turned by the
+   * rotation from its incident direction to the actual one, which equals tilting the crystal by at most a bin
+   * size. So incident directions are exact, and the only approximation is a little blur of orientations.
+   *
+   * @param axis_mat main axis rotation matrices, num x 9. See Math::RotateZMatrix().
+   * @param dir incident directions in world frame, num x 3.
+   * @param u uniform numbers in [0, 1), one per incident ray, to choose an entry ray.
+   * @param num number of incident rays.
+   * @param out exit rays are appended, [dx, dy, dz, w].
+   */
+  void Sample(const float* axis_mat, const float* dir, const float* u, size_t num, std::vector<float>* out) const;
+
+  static constexpr int kDefaultBinResolution = 32;
+  static constexpr int kDefaultRayNumPerBin = 64;
+  static constexpr int kMaxBinResolution = 256;
+  static constexpr int kMaxRayNumPerBin = 4096;
+  static constexpr int kBinBlockSize = 64;  // Bins are traced in blocks of this size
+
+ private:
+  TransferTable();
+
+  void TraceBins(const Crystal* crystal, int bin_begin, int bin_end);
+
+  float n_;
+  int hit_num_;
+  int bin_resolution_;
+  int ray_num_per_bin_;
+  std::vector<float> entry_dir_;       // Incident direction of every entry ray, 3 floats
+  std::vector<uint32_t> exit_offset_;  // Exit rays of entry ray i are [offset[i], offset[i + 1])
+  std::vector<float> exit_data_;       // 4 floats per exit ray, [dx, dy, dz, w]
+};
+
+}  // namespace IceHalo
+
+
+#endif  // SRC_TRANSFER_H_
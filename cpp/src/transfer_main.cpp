@@ -0,0 +1,157 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "context.h"
+#include "files.h"
+#include "image.h"
+#include "optics.h"
+#include "rapidjson/pointer.h"
+#include "render.h"
+#include "simulation.h"
+#include "transfer.h"
+
+
+namespace {
+
+struct TransferSettings {
+  int bin_resolution;
+  int ray_num_per_bin;
+};
+
+
+/*! @brief Parse optional <transfer> of config, e.g. { "bin_resolution": 32, "ray_number_per_bin": 64 }.
+ */
+void ParseTransferSettings(const rapidjson::Document& d, TransferSettings* settings) {
+  settings->bin_resolution = IceHalo::TransferTable::kDefaultBinResolution;
+  settings->ray_num_per_bin = IceHalo::TransferTable::kDefaultRayNumPerBin;
+
+  const auto* p = rapidjson::Pointer("/transfer/bin_resolution").Get(d);
+  if (p == nullptr) {
+    std::fprintf(stderr, "\nWARNING! Config missing <transfer.bin_resolution>, using default %d!\n",
+                 settings->bin_resolution);
+  } else if (!p->IsInt() || p->GetInt() < 1 || p->GetInt() > IceHalo::TransferTable::kMaxBinResolution) {
+    std::fprintf(stderr, "\nWARNING! Config <transfer.bin_resolution> cannot recognize, using default %d!\n",
+                 settings->bin_resolution);
+  } else {
+    settings->bin_resolution = p->GetInt();
+  }
+
+  p = rapidjson::Pointer("/transfer/ray_number_per_bin").Get(d);
+  if (p == nullptr) {
+    std::fprintf(stderr, "\nWARNING! Config missing <transfer.ray_number_per_bin>, using default %d!\n",
+                 settings->ray_num_per_bin);
+  } else if (!p->IsInt() || p->GetInt() < 1 || p->GetInt() > IceHalo::TransferTable::kMaxRayNumPerBin) {
+    std::fprintf(stderr, "\nWARNING! Config <transfer.ray_number_per_bin> cannot recognize, using default %d!\n",
+                 settings->ray_num_per_bin);
+  } else {
+    settings->ray_num_per_bin = p->GetInt();
+  }
+}
+
+
+/*! @brief Load the table of a crystal at a wavelength from data folder. If there is none, trace one and save it.
+ */
+IceHalo::TransferTablePtrU GetTransferTable(IceHalo::ProjectContextPtr proj_ctx, const IceHalo::Crystal* crystal,
+                                            float n, const TransferSettings& settings) {
+  auto path = IceHalo::TransferTable::GetFilePath(crystal, n, proj_ctx->GetRayHitNum(), settings.bin_resolution,
+                                                  settings.ray_num_per_bin, proj_ctx->GetDataDirectory());
+  if (IceHalo::FileExists(path.c_str())) {
+    IceHalo::File file(path.c_str());
+    if (file.Open(IceHalo::OpenMode::kRead | IceHalo::OpenMode::kBinary)) {
+      auto table = IceHalo::TransferTable::LoadState(file);
+      if (table) {
+        return table;
+      }
+    }
+    std::fprintf(stderr, "Transfer table %s is broken, trace it again.\n", path.c_str());
+  }
+
+  auto t0 = std::chrono::system_clock::now();
+  auto table = IceHalo::TransferTable::Build(crystal, n, proj_ctx->GetRayHitNum(), settings.bin_resolution,
+                                             settings.ray_num_per_bin);
+  auto t1 = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = t1 - t0;
+  std::printf("Traced transfer table, %zu exit rays: %.2fms\n", table->GetExitRayNum(), diff.count());
+
+  if (!IceHalo::WriteFileAtomically(path, [&](IceHalo::File& file) { return table->SaveState(file); })) {
+    std::fprintf(stderr, "Cannot save transfer table %s!\n", path.c_str());
+  }
+  return table;
+}
+
+}  // namespace
+
+
+// Render halos by convolving transfer tables of crystals with their orientations and the sun.
+//
+// A table is traced at the first run for a crystal shape, wavelength and max hit number, and saved into data
+// folder. Later runs with other orientations or sun positions only load it, then every ray costs a table lookup
+// instead of tracing. Only the first scattering is rendered, and ray path filters are not applied.
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    std::printf("USAGE: %s <config-file>\n", argv[0]);
+    return -1;
+  }
+
+  auto start = std::chrono::system_clock::now();
+  rapidjson::Document d;
+  if (!IceHalo::ProjectContext::ReadConfigFile(argv[1], &d)) {
+    return -1;
+  }
+  TransferSettings settings{};
+  ParseTransferSettings(d, &settings);
+  IceHalo::ProjectContextPtr proj_ctx = IceHalo::ProjectContext::CreateFromDocument(d, argv[1]);
+  IceHalo::SpectrumRenderer renderer(proj_ctx);
+  if (proj_ctx->multi_scatter_info_.size() > 1) {
+    std::fprintf(stderr, "\nWARNING! Only the first scattering is rendered from transfer tables!\n");
+  }
+
+  const auto& scatter = proj_ctx->multi_scatter_info_[0];
+  const auto init_ray_num = proj_ctx->GetInitRayNum();
+  const float sun_r = proj_ctx->sun_ctx_.GetSunDiameter() / 2;  // In degree
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  std::vector<float> sun_dir;
+  std::vector<float> axis_u;
+  std::vector<float> axis_mat;
+  std::vector<float> entry_u;
+  std::vector<float> ray_data;
+  for (const auto& wl : proj_ctx->wavelengths_) {
+    auto t0 = std::chrono::system_clock::now();
+    float n = IceHalo::IceRefractiveIndex::Get(wl.wavelength);
+    ray_data.clear();
+    for (const auto& c : scatter.GetCrystalInfo()) {
+      const auto* crystal_ctx = proj_ctx->GetCrystalContext(c.crystal_id);
+      auto table = GetTransferTable(proj_ctx, crystal_ctx->crystal.get(), n, settings);
+
+      auto ray_num = static_cast<size_t>(c.population * init_ray_num);
+      sun_dir.resize(ray_num * 3);
+      axis_u.resize(ray_num * 3);
+      axis_mat.resize(ray_num * 9);
+      entry_u.resize(ray_num);
+      IceHalo::Math::RandomSampler::SampleSphericalPointsCart(proj_ctx->sun_ctx_.GetSunPosition(), sun_r,
+                                                              sun_dir.data(), ray_num);
+      rng->FillUniform(axis_u.data(), axis_u.size());
+      rng->FillUniform(entry_u.data(), entry_u.size());
+      IceHalo::Simulator::InitMainAxis(crystal_ctx, axis_u.data(), 3, axis_mat.data(), ray_num);
+      table->Sample(axis_mat.data(), sun_dir.data(), entry_u.data(), ray_num, &ray_data);
+    }
+    renderer.LoadData(wl.wavelength, wl.weight, ray_data.data(), ray_data.size() / 4, init_ray_num);
+
+    auto t1 = std::chrono::system_clock::now();
+    std::chrono::duration<float, std::ratio<1, 1000>> diff = t1 - t0;
+    std::printf("Wavelength %.1f, %zu exit rays: %.2fms\n", wl.wavelength, ray_data.size() / 4, diff.count());
+  }
+
+  std::vector<uint8_t> rgb_data;
+  if (!IceHalo::SaveImage(proj_ctx->GetDefaultImagePath(), proj_ctx, &renderer, &rgb_data)) {
+    return -1;
+  }
+
+  auto end = std::chrono::system_clock::now();
+  std::chrono::duration<float, std::ratio<1, 1000>> diff = end - start;
+  std::printf("Total: %.3fs\n", diff.count() / 1e3);
+  return 0;
+}
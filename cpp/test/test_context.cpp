@@ -1,4 +1,6 @@
+#include <cmath>
 #include <string>
+#include <vector>
 
 #include "context.h"
 #include "gtest/gtest.h"
@@ -46,4 +48,186 @@ TEST_F(ContextTest, FillSunDir) {
   }
 }
 
+
+TEST_F(ContextTest, RngStateRestore) {
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  rng->GetGaussian();  // Leave a cached value in normal distribution
+  auto state = rng->SaveState();
+
+  constexpr int kNum = 16;
+  float values[kNum];
+  for (auto& v : values) {
+    v = rng->GetGaussian();
+  }
+
+  ASSERT_TRUE(rng->LoadState(state));
+  for (auto v : values) {
+    EXPECT_EQ(rng->GetGaussian(), v);
+  }
+  EXPECT_FALSE(rng->LoadState("not a state"));
+
+  // Bulk generator is saved too.
+  state = rng->SaveState();
+  rng->FillUniform(values, kNum);
+  ASSERT_TRUE(rng->LoadState(state));
+  float bulk_values[kNum];
+  rng->FillUniform(bulk_values, kNum);
+  for (int i = 0; i < kNum; i++) {
+    EXPECT_EQ(bulk_values[i], values[i]);
+  }
+}
+
+
+TEST_F(ContextTest, BulkRandomNumbers) {
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  constexpr size_t kNum = 100001;  // Not a multiple of lanes, nor even
+  std::vector<float> values(kNum);
+
+  rng->FillUniform(values.data(), kNum);
+  double sum = 0;
+  double sum2 = 0;
+  for (auto v : values) {
+    ASSERT_GE(v, 0.0f);
+    ASSERT_LT(v, 1.0f);
+    sum += v;
+    sum2 += v * v;
+  }
+  EXPECT_NEAR(sum / kNum, 0.5, 0.01);
+  EXPECT_NEAR(sum2 / kNum - (sum / kNum) * (sum / kNum), 1.0 / 12, 0.01);
+
+  rng->FillGaussian(values.data(), kNum);
+  sum = 0;
+  sum2 = 0;
+  for (auto v : values) {
+    ASSERT_TRUE(std::isfinite(v));
+    sum += v;
+    sum2 += v * v;
+  }
+  EXPECT_NEAR(sum / kNum, 0.0, 0.02);
+  EXPECT_NEAR(sum2 / kNum, 1.0, 0.02);
+}
+
+
+TEST_F(ContextTest, SobolPoints) {
+  constexpr int kDim = IceHalo::Math::RandomSampler::kSobolMaxDim;
+  constexpr int kNum = 256;
+  std::vector<float> points(kNum * kDim);
+  IceHalo::Math::RandomSampler::SampleSobolPoints(kDim, points.data(), kNum);
+
+  // Every dimension has exactly one point in every interval of length 1 / kNum.
+  for (int d = 0; d < kDim; d++) {
+    std::vector<int> count(kNum, 0);
+    for (int i = 0; i < kNum; i++) {
+      float v = points[i * kDim + d];
+      ASSERT_GE(v, 0.0f);
+      ASSERT_LT(v, 1.0f);
+      count[static_cast<int>(v * kNum)]++;
+    }
+    for (auto c : count) {
+      EXPECT_EQ(c, 1);
+    }
+  }
+
+  // The first two dimensions have exactly one point in every 16 x 16 cell.
+  std::vector<int> count(kNum, 0);
+  for (int i = 0; i < kNum; i++) {
+    count[static_cast<int>(points[i * kDim] * 16) * 16 + static_cast<int>(points[i * kDim + 1] * 16)]++;
+  }
+  for (auto c : count) {
+    EXPECT_EQ(c, 1);
+  }
+}
+
+
+TEST_F(ContextTest, NormalQuantile) {
+  EXPECT_NEAR(IceHalo::Math::NormalQuantile(0.5f), 0.0f, 1e-6);
+  EXPECT_NEAR(IceHalo::Math::NormalQuantile(0.975f), 1.959964f, 1e-5);
+  EXPECT_NEAR(IceHalo::Math::NormalQuantile(0.025f), -1.959964f, 1e-5);
+  EXPECT_NEAR(IceHalo::Math::NormalQuantile(0.001f), -3.090232f, 1e-4);
+  EXPECT_TRUE(std::isfinite(IceHalo::Math::NormalQuantile(0.0f)));
+  EXPECT_TRUE(std::isfinite(IceHalo::Math::NormalQuantile(1.0f)));
+}
+
+
+TEST_F(ContextTest, OrientationIsotropic) {
+  // Crystal 5 is the only one in use. Others are not isotropic, but do not matter.
+  IceHalo::AxisDistribution axis;
+  context->RemoveCrystal(5);
+  context->SetCrystal(5, IceHalo::Crystal::CreateHexPrism(1.0f), axis);
+  EXPECT_TRUE(context->IsOrientationIsotropic());
+
+  axis.roll_dist = IceHalo::Math::Distribution::kGaussian;
+  context->RemoveCrystal(5);
+  context->SetCrystal(5, IceHalo::Crystal::CreateHexPrism(1.0f), axis);
+  EXPECT_FALSE(context->IsOrientationIsotropic());
+}
+
+
+TEST_F(ContextTest, ShardSplit) {
+  int index = 0;
+  int num = 0;
+  EXPECT_TRUE(IceHalo::ParseShardOption("2/3", &index, &num));
+  EXPECT_EQ(index, 2);
+  EXPECT_EQ(num, 3);
+  EXPECT_FALSE(IceHalo::ParseShardOption("3/3", &index, &num));
+  EXPECT_FALSE(IceHalo::ParseShardOption("1/3x", &index, &num));
+
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  auto state = rng->SaveState();
+
+  constexpr int kShardNum = 3;
+  size_t total_ray_num = 0;
+  float first_values[kShardNum];
+  for (int i = 0; i < kShardNum; i++) {
+    auto shard_ctx = IceHalo::ProjectContext::CreateFromFile(config_file_name.c_str());
+    shard_ctx->SetShard(i, kShardNum);
+    total_ray_num += shard_ctx->GetInitRayNum();
+    first_values[i] = rng->GetUniform();
+    EXPECT_EQ(shard_ctx->GetShardTag(), "_shard" + std::to_string(i) + "of3");
+  }
+  EXPECT_EQ(total_ray_num, context->GetInitRayNum());
+  EXPECT_NE(first_values[0], first_values[1]);
+  EXPECT_NE(first_values[1], first_values[2]);
+  EXPECT_EQ(context->GetShardTag(), "");
+
+  rng->SetStream(1);
+  EXPECT_EQ(rng->GetUniform(), first_values[1]);  // Same stream, same sequence
+  ASSERT_TRUE(rng->LoadState(state));
+}
+
+
+TEST_F(ContextTest, SampleWavelengths) {
+  auto wavelengths = context->wavelengths_;
+  context->wavelengths_ = { { 400.0f, 1.0f }, { 500.0f, 1.0f } };
+
+  // A flat spectrum gives evenly spaced samples.
+  auto samples = context->SampleWavelengths(0.1f, 4);
+  ASSERT_EQ(samples.size(), 4u);
+  const float expect[] = { 410.0f, 435.0f, 460.0f, 485.0f };
+  for (int i = 0; i < 4; i++) {
+    EXPECT_NEAR(samples[i].wavelength, expect[i], 1e-3);
+    EXPECT_FLOAT_EQ(samples[i].weight, 1.0f);
+  }
+
+  // A ramp from 0 puts more samples at long wavelengths, with CDF ((x - 400) / 100)^2.
+  context->wavelengths_ = { { 500.0f, 2.0f }, { 400.0f, 0.0f } };
+  samples = context->SampleWavelengths(0.0f, 4);
+  ASSERT_EQ(samples.size(), 4u);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_NEAR(samples[i].wavelength, 400.0f + 100.0f * std::sqrt(i / 4.0f), 1e-2);
+  }
+
+  context->SetSpectrumMode(IceHalo::SpectrumMode::kContinuous);
+  context->SetSpectrumSampleNum(16);
+  samples = context->GetRoundWavelengths();
+  ASSERT_EQ(samples.size(), 16u);
+  for (const auto& wl : samples) {
+    EXPECT_GE(wl.wavelength, 400.0f);
+    EXPECT_LE(wl.wavelength, 500.0f);
+  }
+
+  context->SetSpectrumMode(IceHalo::SpectrumMode::kDiscrete);
+  context->wavelengths_ = wavelengths;
+}
+
 }  // namespace
@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <cstring>
+#include <string>
 #include <vector>
 
 #include "crystal.h"
@@ -77,6 +79,24 @@ class CrystalTest : public ::testing::Test {
       EXPECT_NE(findIter, v1.end());
     }
   }
+
+  void checkSameTables(const IceHalo::CrystalPtrU& c1, const IceHalo::CrystalPtrU& c2) {
+    ASSERT_EQ(c1->TotalFaces(), c2->TotalFaces());
+    ASSERT_EQ(c1->TotalPolygons(), c2->TotalPolygons());
+    auto face_num = static_cast<size_t>(c1->TotalFaces());
+    auto polygon_num = static_cast<size_t>(c1->TotalPolygons());
+    EXPECT_EQ(c1->GetType(), c2->GetType());
+    EXPECT_EQ(c1->GetFaceNumberPeriod(), c2->GetFaceNumberPeriod());
+    EXPECT_EQ(c1->GetPolygonMaxEdges(), c2->GetPolygonMaxEdges());
+    EXPECT_EQ(std::memcmp(c1->GetFaceVertex(), c2->GetFaceVertex(), sizeof(float) * face_num * 9), 0);
+    EXPECT_EQ(std::memcmp(c1->GetFaceNorm(), c2->GetFaceNorm(), sizeof(float) * face_num * 3), 0);
+    EXPECT_EQ(std::memcmp(c1->GetFaceArea(), c2->GetFaceArea(), sizeof(float) * face_num), 0);
+    EXPECT_EQ(std::memcmp(c1->GetPolygonPlane(), c2->GetPolygonPlane(), sizeof(float) * polygon_num * 4), 0);
+    EXPECT_EQ(std::memcmp(c1->GetPolygonEdgeOffset(), c2->GetPolygonEdgeOffset(), sizeof(int) * (polygon_num + 1)),
+              0);
+    checkVertex(c1->GetVertexes(), c2->GetVertexes());
+    checkFaceId(c1->GetFaceNumberMap(), c2->GetFaceNumberMap());
+  }
 };
 
 
@@ -286,4 +306,42 @@ TEST_F(CrystalTest, IrregularHexPrismVertex1) {
   checkCrystal(c1, c2);
 }
 
+
+TEST_F(CrystalTest, CrystalCache) {
+  namespace fs = boost::filesystem;
+  auto dir = (fs::temp_directory_path() / fs::unique_path("icehalo_cache_%%%%%%%%")).string();
+
+  float dist[6] = { 1.0f, 1.0f, 1.5f, 1.0f, 2.5f, 1.0f };
+  int idx[4] = { 1, 1, 2, 3 };
+  float h[3] = { 0.3f, 1.2f, 0.9f };
+  int build_num = 0;
+  auto builder = [&]() {
+    build_num++;
+    return IceHalo::Crystal::CreateIrregularHexPyramid(dist, idx, h);
+  };
+  auto c0 = builder();
+  build_num = 0;
+
+  auto cache = IceHalo::CrystalCache::GetInstance();
+  cache->Clear();
+  const std::string key = "test:IrregularHexPyramid";
+  auto c1 = cache->Get(key, builder, dir);
+  auto c2 = cache->Get(key, builder, dir);  // From memory
+  EXPECT_EQ(build_num, 1);
+  EXPECT_TRUE(IceHalo::FileExists(IceHalo::CrystalCache::GetFilePath(key, dir).c_str()));
+
+  cache->Clear();
+  auto c3 = cache->Get(key, builder, dir);  // From file
+  EXPECT_EQ(build_num, 1);
+  EXPECT_EQ(cache->Size(), 1u);
+
+  checkSameTables(c0, c1);
+  checkSameTables(c0, c2);
+  checkSameTables(c0, c3);
+  EXPECT_NE(c1.get(), c2.get());
+
+  cache->Clear();
+  fs::remove_all(dir);
+}
+
 }  // namespace
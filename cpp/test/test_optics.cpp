@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include "crystal.h"
 #include "gtest/gtest.h"
 #include "optics.h"
 #include "simulation.h"
+#include "threadingpool.h"
+#include "transfer.h"
 
 extern std::string config_file_name;
 
@@ -143,6 +149,43 @@ TEST_F(OpticsTest, HitSurface1) {
 }
 
 
+TEST_F(OpticsTest, HitSurfaceStochastic) {
+  constexpr float kN = 1.31;
+  constexpr int kNum = 3;
+
+  float dir_in[kNum * 3] = {
+    0.0f,      0.0f, -1.0f,       // Case 1: perpendicular incident
+    0.707107f, 0.0f, -0.707107f,  // Case 2: incident at 45 degree
+    0.792624f, 0.0f, 0.609711f,   // Case 3: incident at 45 degree, from inside out, total reflection
+  };
+  float w_in[kNum] = { 0.5f, 0.5f, 0.5f };
+  int face_id_in[kNum] = { 0, 0, 0 };
+  float rand_in[kNum] = {
+    0.01f,  // Case 1: below reflect ratio 0.018, reflective
+    0.5f,   // Case 2: above reflect ratio 0.025, refractive
+    0.9f,   // Case 3: always reflective
+  };
+
+  float w_out_e[2 * kNum] = {
+    0.5f, 0.0f,   // Case 1
+    0.0f, 0.5f,   // Case 2
+    0.5f, -1.0f,  // Case 3
+  };
+
+  float dir_out[2 * kNum * 3];
+  float w_out[2 * kNum];
+
+  IceHalo::Optics::HitSurface(crystal.get(), kN, kNum,   // input
+                              dir_in, face_id_in, w_in,  // input
+                              dir_out, w_out,            // output
+                              rand_in);
+
+  for (int i = 0; i < kNum * 2; i++) {
+    EXPECT_NEAR(w_out[i], w_out_e[i], IceHalo::Math::kFloatEps);
+  }
+}
+
+
 TEST_F(OpticsTest, RayFaceIntersection0) {
   auto c = IceHalo::Crystal::CreateHexPrism(1.0f);
   auto face_num = c->TotalFaces();
@@ -233,6 +276,41 @@ TEST_F(OpticsTest, RayFaceIntersection1) {
 }
 
 
+TEST_F(OpticsTest, RaySegmentPool) {
+  auto ray_pool = IceHalo::RaySegmentPool::GetInstance();
+  ray_pool->Clear();
+
+  float pt[3] = { 0.1f, -0.25f, 1.5f };
+  float dir[3] = { 0.0f, 0.6f, -0.8f };
+  auto r0 = ray_pool->GetRaySegment(pt, dir, 1.0f, 3);
+  auto r1 = ray_pool->GetRaySegment(pt, dir, 0.5f, 7);
+  ray_pool->prev[r1] = r0;
+  ray_pool->next_refract[r0] = r1;
+
+  EXPECT_EQ(ray_pool->Size(), 2u);
+  EXPECT_EQ(ray_pool->prev[r0], IceHalo::RaySegmentPool::kInvalidId);
+  EXPECT_EQ(ray_pool->next_reflect[r0], IceHalo::RaySegmentPool::kInvalidId);
+  EXPECT_EQ(ray_pool->next_refract[r0], r1);
+  EXPECT_EQ(ray_pool->face_id[r1], 7);
+  EXPECT_FLOAT_EQ(ray_pool->w[r1], 0.5f);
+
+  float pt_out[3];
+  ray_pool->GetPoint(r1, pt_out);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_NEAR(pt_out[i], pt[i], 1e-3);  // Half precision is enough for points
+    EXPECT_FLOAT_EQ(ray_pool->GetDirection(r1)[i], dir[i]);
+  }
+
+  for (float v : { 0.0f, 1.0f, -2.5f, 65504.0f, 6.1e-5f, 1e-7f }) {
+    EXPECT_NEAR(IceHalo::Math::HalfToFloat(IceHalo::Math::FloatToHalf(v)), v, std::abs(v) * 1e-3f + 6e-8f);
+  }
+  EXPECT_TRUE(std::isinf(IceHalo::Math::HalfToFloat(IceHalo::Math::FloatToHalf(1e5f))));
+
+  ray_pool->Clear();
+  EXPECT_EQ(ray_pool->Size(), 0u);
+}
+
+
 TEST_F(OpticsTest, RayTracing) {
   context->PrintCrystalInfo();
   IceHalo::Simulator simulator(context);
@@ -241,4 +319,369 @@ TEST_F(OpticsTest, RayTracing) {
   simulator.PrintRayInfo();
 }
 
+
+TEST_F(OpticsTest, RayTracingBatches) {
+  context->SetInitRayNum(20000);
+  context->SetMaxMemory(1);
+  IceHalo::Simulator simulator(context);
+  simulator.SetWavelengthIndex(0);
+
+  auto batch_ray_num = simulator.GetBatchRayNum();
+  EXPECT_LT(batch_ray_num, context->GetInitRayNum());
+
+  size_t batch_num = 0;
+  size_t total_ray_num = 0;
+  simulator.Start([&](size_t ray_num) {
+    EXPECT_LE(ray_num, batch_ray_num);
+    EXPECT_GT(simulator.GetFinalRaySegments().size(), 0u);
+    batch_num++;
+    total_ray_num += ray_num;
+  });
+  EXPECT_GT(batch_num, 1u);
+  EXPECT_EQ(total_ray_num, context->GetInitRayNum());
+}
+
+
+TEST_F(OpticsTest, RussianRoulette) {
+  constexpr float kSurvival = 0.5f;
+  context->SetInitRayNum(20000);
+  auto ray_pool = IceHalo::RaySegmentPool::GetInstance();
+
+  // Roulette kills rays at random but scales up survivors, so the total exit weight stays the same.
+  double total_w[2];
+  for (int i = 0; i < 2; i++) {
+    context->SetRussianRoulette(i == 0 ? 0.0f : 0.1f, kSurvival);
+    IceHalo::Simulator simulator(context);
+    simulator.SetWavelengthIndex(0);
+    simulator.Start();
+    total_w[i] = 0;
+    for (auto r : simulator.GetFinalRaySegments()) {
+      total_w[i] += ray_pool->w[r];
+    }
+  }
+  EXPECT_GT(total_w[0], 0);
+  EXPECT_NEAR(total_w[1], total_w[0], total_w[0] * 0.05);
+
+  // With a threshold above any weight, every ray inside crystal goes through roulette. A reflected ray that is
+  // traced further has survived, and its weight is scaled by 1 / survival, while the weight of its refracted
+  // sibling is not. So reflected * survival + refracted equals the weight of their parent.
+  context->SetInitRayNum(2000);
+  context->SetRussianRoulette(1e6f, kSurvival);
+  IceHalo::Simulator simulator(context);
+  simulator.SetWavelengthIndex(0);
+  simulator.Start();
+  size_t checked_num = 0;
+  for (size_t r = 0; r < ray_pool->Size(); r++) {
+    auto reflect = ray_pool->next_reflect[r];
+    auto refract = ray_pool->next_refract[r];
+    if (ray_pool->is_finished[r] || reflect == IceHalo::RaySegmentPool::kInvalidId ||
+        refract == IceHalo::RaySegmentPool::kInvalidId || ray_pool->is_finished[reflect] ||
+        ray_pool->next_reflect[reflect] == IceHalo::RaySegmentPool::kInvalidId) {
+      continue;
+    }
+    EXPECT_NEAR(ray_pool->w[reflect] * kSurvival + ray_pool->w[refract], ray_pool->w[r], ray_pool->w[r] * 1e-4);
+    checked_num++;
+  }
+  EXPECT_GT(checked_num, 0u);
+}
+
+
+TEST_F(OpticsTest, RayTracingCoherentSort) {
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  auto rng_state = rng->SaveState();
+  auto ray_pool = IceHalo::RaySegmentPool::GetInstance();
+
+  // Sorting only reorders rays. The same rays go out, with the same total weight.
+  size_t ray_num[2];
+  double total_w[2];
+  for (int i = 0; i < 2; i++) {
+    rng->LoadState(rng_state);
+    context->EnableCoherentSort(i == 1);
+    IceHalo::Simulator simulator(context);
+    simulator.SetWavelengthIndex(0);
+    simulator.Start();
+
+    const auto& segs = simulator.GetFinalRaySegments();
+    ray_num[i] = segs.size();
+    total_w[i] = 0;
+    for (auto r : segs) {
+      total_w[i] += ray_pool->w[r];
+    }
+  }
+  context->EnableCoherentSort(false);
+
+  EXPECT_GT(ray_num[0], 0u);
+  EXPECT_EQ(ray_num[0], ray_num[1]);
+  EXPECT_NEAR(total_w[0], total_w[1], total_w[0] * 1e-5);
+}
+
+
+TEST_F(OpticsTest, ShuffleRays) {
+  constexpr size_t kRayNum = 5000;
+  std::vector<float> dir(kRayNum * 3);
+  std::vector<uint32_t> seg(kRayNum);
+  for (size_t i = 0; i < kRayNum; i++) {
+    seg[i] = static_cast<uint32_t>(i);
+    dir[i * 3 + 0] = static_cast<float>(i);
+    dir[i * 3 + 1] = i + 0.5f;
+    dir[i * 3 + 2] = -static_cast<float>(i);
+  }
+
+  auto pool = IceHalo::ThreadingPool::GetInstance();
+  auto thread_num = pool->GetThreadNum();
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  auto rng_state = rng->SaveState();
+  IceHalo::Simulator simulator(context);
+
+  // Rays are permuted with their directions, and the same way whatever the thread number is.
+  std::vector<uint32_t> first_seg;
+  for (size_t n : { 1, 2, 4, 7 }) {
+    pool->SetThreadNum(n);
+    rng->LoadState(rng_state);
+    std::vector<float> dir_out(kRayNum * 3);
+    std::vector<uint32_t> seg_out(kRayNum);
+    simulator.ShuffleRays(dir.data(), seg.data(), kRayNum, dir_out.data(), seg_out.data());
+
+    for (size_t i = 0; i < kRayNum; i++) {
+      ASSERT_LT(seg_out[i], kRayNum);
+      for (int j = 0; j < 3; j++) {
+        EXPECT_EQ(dir_out[i * 3 + j], dir[seg_out[i] * 3 + j]);
+      }
+    }
+    auto sorted_seg = seg_out;
+    std::sort(sorted_seg.begin(), sorted_seg.end());
+    EXPECT_EQ(sorted_seg, seg);
+    EXPECT_NE(seg_out, seg);
+
+    if (first_seg.empty()) {
+      first_seg = seg_out;
+    } else {
+      EXPECT_EQ(seg_out, first_seg);
+    }
+  }
+  pool->SetThreadNum(thread_num);
+}
+
+
+TEST_F(OpticsTest, EntryFaceSampling) {
+  float dir[3] = { 0.3f, -0.5f, -0.8f };
+  IceHalo::Math::Normalize3(dir);
+
+  auto total_faces = crystal->TotalFaces();
+  auto* face_norm = crystal->GetFaceNorm();
+  auto* face_area = crystal->GetFaceArea();
+  std::vector<float> expect(total_faces);
+  float sum = 0;
+  for (int k = 0; k < total_faces; k++) {
+    expect[k] = std::max(-IceHalo::Math::Dot3(face_norm + k * 3, dir) * face_area[k], 0.0f);
+    sum += expect[k];
+  }
+
+  constexpr int kSampleNum = 200000;
+  IceHalo::EntryFaceSampler sampler(crystal.get());
+  std::vector<int> count(total_faces);
+  for (int i = 0; i < kSampleNum; i++) {
+    count[sampler.Sample(dir)]++;
+  }
+  for (int k = 0; k < total_faces; k++) {
+    EXPECT_NEAR(count[k] * 1.0f / kSampleNum, expect[k] / sum, 5e-3);
+  }
+}
+
+
+TEST_F(OpticsTest, PolygonIntersection) {
+  auto total_faces = crystal->TotalFaces();
+  auto* face_bases = crystal->GetFaceBaseVector();
+  auto* face_points = crystal->GetFaceVertex();
+  auto* face_norm = crystal->GetFaceNorm();
+  EXPECT_EQ(crystal->TotalPolygons(), 8);
+  EXPECT_EQ(crystal->GetPolygonMaxEdges(), 6);
+  IceHalo::PolygonBvh bvh(crystal->GetPolygonVertex(), crystal->GetPolygonEdgeOffset(), crystal->TotalPolygons());
+
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  constexpr int kRayNum = 2000;
+  for (int i = 0; i < kRayNum; i++) {
+    int face_id = IceHalo::Math::RandomSampler::SampleInt(total_faces);
+    float pt[3];
+    IceHalo::Math::RandomSampler::SampleTriangularPoints(face_points + face_id * 9, pt);
+    float dir[3] = { rng->GetGaussian(), rng->GetGaussian(), rng->GetGaussian() };
+    IceHalo::Math::Normalize3(dir);
+    if (IceHalo::Math::Dot3(dir, face_norm + face_id * 3) > 0) {
+      for (auto& d : dir) {
+        d = -d;  // Into the crystal
+      }
+    }
+
+    float p[3][3];
+    int idx[3] = { -1, -1, -1 };
+    IceHalo::Optics::IntersectLineWithTriangles(pt, dir, face_id, total_faces, face_bases, face_points, face_norm,
+                                                p[0], idx + 0);
+    IceHalo::Optics::IntersectLineWithPolygons(pt, dir, face_id, crystal.get(), p[1], idx + 1);
+    IceHalo::Optics::IntersectLineWithBvh(pt, dir, face_id, crystal.get(), bvh, p[2], idx + 2);
+    ASSERT_GE(idx[0], 0);
+    for (int k = 1; k < 3; k++) {
+      ASSERT_GE(idx[k], 0);
+      EXPECT_EQ(crystal->FaceNumber(idx[k]), crystal->FaceNumber(idx[0]));
+      for (int j = 0; j < 3; j++) {
+        EXPECT_NEAR(p[k][j], p[0][j], 1e-5);
+      }
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, PropagateKernels) {
+  std::vector<IceHalo::CrystalPtrU> crystals;
+  crystals.emplace_back(IceHalo::Crystal::CreateHexPrism(1.2f));
+  crystals.emplace_back(IceHalo::Crystal::CreateHexPyramid(0.2f, 1.0f, 0.3f));
+  crystals.emplace_back(IceHalo::Crystal::CreateHexPyramidStackHalf(1, 1, 1, 1, 0.3f, 0.3f, 1.0f));
+  crystals.emplace_back(IceHalo::Crystal::CreateCubicPyramid(0.3f, 0.4f));
+
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  constexpr int kRayNum = 1000;
+  for (const auto& c : crystals) {
+    auto total_faces = c->TotalFaces();
+    auto* face_points = c->GetFaceVertex();
+    auto* face_area = c->GetFaceArea();
+
+    std::vector<float> pt(kRayNum * 3);
+    std::vector<int> face_id(kRayNum);
+    std::vector<float> dir(kRayNum * 2 * 3);
+    std::vector<float> w(kRayNum * 2, 1.0f);
+    for (int i = 0; i < kRayNum; i++) {
+      do {
+        face_id[i] = IceHalo::Math::RandomSampler::SampleInt(total_faces);
+      } while (face_area[face_id[i]] <= 0);
+      IceHalo::Math::RandomSampler::SampleTriangularPoints(face_points + face_id[i] * 9, pt.data() + i * 3);
+      for (int k = 0; k < 2; k++) {
+        float* d = dir.data() + (i * 2 + k) * 3;
+        for (int j = 0; j < 3; j++) {
+          d[j] = rng->GetGaussian();
+        }
+        IceHalo::Math::Normalize3(d);
+      }
+    }
+
+    std::vector<float> pt_out(kRayNum * 2 * 3);
+    std::vector<int> face_id_out(kRayNum * 2);
+    IceHalo::Optics::Propagate(c.get(), kRayNum * 2, pt.data(), dir.data(), w.data(), face_id.data(),
+                               pt_out.data(), face_id_out.data());
+    for (int i = 0; i < kRayNum * 2; i++) {
+      float p[3];
+      int idx = -1;
+      IceHalo::Optics::IntersectLineWithPolygons(pt.data() + i / 2 * 3, dir.data() + i * 3, face_id[i / 2], c.get(),
+                                                 p, &idx);
+      ASSERT_EQ(face_id_out[i], idx);
+      if (idx >= 0) {
+        for (int j = 0; j < 3; j++) {
+          EXPECT_FLOAT_EQ(pt_out[i * 3 + j], p[j]);
+        }
+      }
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, RotateByMatrix) {
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  constexpr int kRayNum = 19;  // Not a multiple of SIMD width
+  std::vector<float> mat(kRayNum * 9);
+  std::vector<float> rot(kRayNum * 3);
+  std::vector<float> dir(kRayNum * 3);
+  for (int i = 0; i < kRayNum * 3; i++) {
+    rot[i] = rng->GetUniform() * 2 * IceHalo::Math::kPi;
+    dir[i] = rng->GetGaussian();
+  }
+  for (int i = 0; i < kRayNum; i++) {
+    IceHalo::Math::RotateZMatrix(rot.data() + i * 3, mat.data() + i * 9);
+  }
+
+  std::vector<float> out(kRayNum * 4);
+  std::vector<float> back(kRayNum * 4);
+  IceHalo::Math::RotateByMatrix(mat.data(), dir.data(), out.data(), kRayNum, 4);
+  IceHalo::Math::RotateBackByMatrix(mat.data(), dir.data(), back.data(), kRayNum, 4);
+  for (int i = 0; i < kRayNum; i++) {
+    float expect[3];
+    IceHalo::Math::RotateZ(rot.data() + i * 3, dir.data() + i * 3, expect);
+    float expect_back[3];
+    IceHalo::Math::RotateZBack(rot.data() + i * 3, dir.data() + i * 3, expect_back);
+    for (int j = 0; j < 3; j++) {
+      EXPECT_NEAR(out[i * 4 + j], expect[j], 1e-5);
+      EXPECT_NEAR(back[i * 4 + j], expect_back[j], 1e-5);
+    }
+  }
+}
+
+
+TEST_F(OpticsTest, TransferTable) {
+  constexpr size_t kRayNum = 20000;
+  auto rng = IceHalo::Math::RandomNumberGenerator::GetInstance();
+  context->SetInitRayNum(kRayNum);
+  const auto& crystal_info = context->multi_scatter_info_[0].GetCrystalInfo();
+  ASSERT_EQ(crystal_info.size(), 1u);
+  const auto* crystal_ctx = context->GetCrystalContext(crystal_info[0].crystal_id);
+
+  // Total weight and mean elevation of exit rays, per incident ray.
+  auto get_stats = [](const std::vector<float>& ray_data, size_t init_ray_num, double* w, double* z) {
+    *w = 0;
+    *z = 0;
+    for (size_t i = 0; i < ray_data.size() / 4; i++) {
+      *w += ray_data[i * 4 + 3];
+      *z += ray_data[i * 4 + 2] * ray_data[i * 4 + 3];
+    }
+    *z /= *w;
+    *w /= init_ray_num;
+  };
+
+  IceHalo::Simulator simulator(context);
+  simulator.SetWavelengthIndex(0);
+  simulator.Start();
+  std::vector<float> sim_data(simulator.GetFinalRaySegments().size() * 4);
+  simulator.GetFinalDirections(sim_data.data());
+  double sim_w;
+  double sim_z;
+  get_stats(sim_data, kRayNum, &sim_w, &sim_z);
+
+  float n = IceHalo::IceRefractiveIndex::Get(context->wavelengths_[0].wavelength);
+  auto table = IceHalo::TransferTable::Build(crystal_ctx->crystal.get(), n, context->GetRayHitNum(), 8, 16);
+  ASSERT_TRUE(table);
+  EXPECT_GT(table->GetExitRayNum(), 0u);
+
+  std::vector<float> sun_dir(kRayNum * 3);
+  std::vector<float> u(kRayNum * 4);
+  std::vector<float> axis_mat(kRayNum * 9);
+  IceHalo::Math::RandomSampler::SampleSphericalPointsCart(context->sun_ctx_.GetSunPosition(),
+                                                          context->sun_ctx_.GetSunDiameter() / 2, sun_dir.data(),
+                                                          kRayNum);
+  rng->FillUniform(u.data(), u.size());
+  IceHalo::Simulator::InitMainAxis(crystal_ctx, u.data(), 3, axis_mat.data(), kRayNum);
+  std::vector<float> table_data;
+  table->Sample(axis_mat.data(), sun_dir.data(), u.data() + kRayNum * 3, kRayNum, &table_data);
+  double table_w;
+  double table_z;
+  get_stats(table_data, kRayNum, &table_w, &table_z);
+  EXPECT_NEAR(table_w, sim_w, sim_w * 0.05);
+  EXPECT_NEAR(table_z, sim_z, 0.02);
+
+  // A table read back from file samples the same rays.
+  namespace fs = boost::filesystem;
+  auto path = (fs::temp_directory_path() / fs::unique_path("icehalo_transfer_%%%%%%%%.dat")).string();
+  IceHalo::File file(path.c_str());
+  ASSERT_TRUE(file.Open(IceHalo::OpenMode::kWrite | IceHalo::OpenMode::kBinary));
+  EXPECT_TRUE(table->SaveState(file));
+  file.Close();
+  ASSERT_TRUE(file.Open(IceHalo::OpenMode::kRead | IceHalo::OpenMode::kBinary));
+  auto loaded = IceHalo::TransferTable::LoadState(file);
+  file.Close();
+  fs::remove(path);
+  ASSERT_TRUE(loaded);
+  EXPECT_EQ(loaded->GetExitRayNum(), table->GetExitRayNum());
+  EXPECT_EQ(loaded->GetBinResolution(), 8);
+  EXPECT_EQ(loaded->GetRayNumPerBin(), 16);
+
+  std::vector<float> loaded_data;
+  loaded->Sample(axis_mat.data(), sun_dir.data(), u.data() + kRayNum * 3, kRayNum, &loaded_data);
+  EXPECT_EQ(loaded_data, table_data);
+}
+
 }  // namespace
@@ -0,0 +1,118 @@
+#include <cmath>
+#include <vector>
+
+#include "context.h"
+#include "files.h"
+#include "gtest/gtest.h"
+#include "render.h"
+
+namespace {
+
+class RenderTest : public ::testing::Test {
+ protected:
+  // Many small splats piled up on a few pixels, as on bright halo pixels after a long run.
+  void SetUp() override {
+    idx.resize(kSplatNum);
+    val.resize(kSplatNum);
+    for (size_t i = 0; i < kSplatNum; i++) {
+      idx[i] = static_cast<uint32_t>(i % kPixelNum);
+      val[i] = 1e-3f * (1 + i % 7);
+    }
+  }
+
+  // Add splats in batches of kBatchSize, as every call of SpectrumRenderer::LoadData() does.
+  void AddAll(IceHalo::PixelAccumulator* accumulator) const {
+    for (size_t i = 0; i < kSplatNum; i += kBatchSize) {
+      accumulator->Add(idx.data() + i, val.data() + i, kBatchSize, 1.0f);
+    }
+  }
+
+  static constexpr size_t kPixelNum = 16;
+  static constexpr size_t kSplatNum = 1 << 22;
+  static constexpr size_t kBatchSize = 1 << 12;
+
+  std::vector<uint32_t> idx;
+  std::vector<float> val;
+};
+
+constexpr size_t RenderTest::kPixelNum;
+constexpr size_t RenderTest::kSplatNum;
+constexpr size_t RenderTest::kBatchSize;
+
+
+TEST_F(RenderTest, AccumulatorAccuracy) {
+  std::vector<double> ref(kPixelNum, 0.0);
+  std::vector<float> naive(kPixelNum, 0.0f);
+  for (size_t i = 0; i < kSplatNum; i++) {
+    ref[idx[i]] += val[i];
+    naive[idx[i]] += val[i];
+  }
+
+  IceHalo::PixelAccumulator kahan(IceHalo::AccumulatorType::kKahan, kPixelNum);
+  IceHalo::PixelAccumulator dbl(IceHalo::AccumulatorType::kDouble, kPixelNum);
+  AddAll(&kahan);
+  AddAll(&dbl);
+
+  double naive_err = 0;
+  double kahan_err = 0;
+  double dbl_err = 0;
+  for (size_t i = 0; i < kPixelNum; i++) {
+    naive_err = std::max(naive_err, std::abs(naive[i] - ref[i]) / ref[i]);
+    kahan_err = std::max(kahan_err, std::abs(kahan.Get(i) - ref[i]) / ref[i]);
+    dbl_err = std::max(dbl_err, std::abs(dbl.Get(i) - ref[i]) / ref[i]);
+  }
+  EXPECT_GT(naive_err, 1e-4);
+  EXPECT_LT(kahan_err, 1e-6);
+  EXPECT_LE(dbl_err, kahan_err);
+}
+
+
+TEST_F(RenderTest, AccumulatorMergeAndState) {
+  IceHalo::PixelAccumulator kahan(IceHalo::AccumulatorType::kKahan, kPixelNum);
+  IceHalo::PixelAccumulator dbl(IceHalo::AccumulatorType::kDouble, kPixelNum);
+  AddAll(&kahan);
+  AddAll(&dbl);
+
+  // Accumulators of different types can be merged.
+  IceHalo::PixelAccumulator merged = dbl;
+  merged.Add(kahan);
+  for (size_t i = 0; i < kPixelNum; i++) {
+    EXPECT_NEAR(merged.Get(i), dbl.Get(i) * 2, dbl.Get(i) * 1e-6);
+  }
+
+  // Type is taken from file.
+  namespace fs = boost::filesystem;
+  auto path = (fs::temp_directory_path() / fs::unique_path("icehalo_accumulator_%%%%%%%%.dat")).string();
+  IceHalo::File file(path.c_str());
+  ASSERT_TRUE(file.Open(IceHalo::OpenMode::kWrite | IceHalo::OpenMode::kBinary));
+  EXPECT_TRUE(kahan.SaveState(file));
+  file.Close();
+  ASSERT_TRUE(file.Open(IceHalo::OpenMode::kRead | IceHalo::OpenMode::kBinary));
+  IceHalo::PixelAccumulator loaded(IceHalo::AccumulatorType::kDouble, kPixelNum);
+  EXPECT_TRUE(loaded.LoadState(file));
+  file.Close();
+  fs::remove(path);
+  EXPECT_EQ(loaded.GetType(), IceHalo::AccumulatorType::kKahan);
+  for (size_t i = 0; i < kPixelNum; i++) {
+    EXPECT_EQ(loaded.Get(i), kahan.Get(i));
+  }
+}
+
+
+TEST_F(RenderTest, AccumulatorTypesAgree) {
+  constexpr size_t kImagePixelNum = 8 * 8;
+  for (size_t i = 0; i < kSplatNum; i++) {
+    idx[i] = static_cast<uint32_t>((i * 2654435761u) % kImagePixelNum);  // Scattered as splats of a halo
+  }
+
+  IceHalo::PixelAccumulator kahan(IceHalo::AccumulatorType::kKahan, kImagePixelNum);
+  IceHalo::PixelAccumulator dbl(IceHalo::AccumulatorType::kDouble, kImagePixelNum);
+  AddAll(&kahan);
+  AddAll(&dbl);
+  for (size_t i = 0; i < kImagePixelNum; i++) {
+    EXPECT_GT(dbl.Get(i), 0);
+    EXPECT_NEAR(kahan.Get(i), dbl.Get(i), dbl.Get(i) * 1e-6);
+  }
+}
+
+}  // namespace